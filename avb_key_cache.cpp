@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "avb_key_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <filesystem>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <ext4_utils/ext4_utils.h>
+#include <libavb/libavb.h>
+#include <libgsi/libgsi.h>
+#include <openssl/sha.h>
+
+#include "file_paths.h"
+#include "hex.h"
+
+namespace android {
+namespace gsi {
+
+using android::base::ReadFileToString;
+using android::base::ReadFullyAtOffset;
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+// The file has a version line, then one line per image:
+//   <image> <generation> <unread|invalid|valid> <key as hex, or "-">
+static constexpr int kAvbKeysVersion = 1;
+
+// Names of AvbKeyCache::State values, in order.
+static constexpr const char* kStateNames[] = {"unread", "invalid", "valid"};
+
+bool GetAvbPublicKeyFromFd(int fd, AvbPublicKey* dst) {
+    // Read the AVB footer from EOF.
+    int64_t total_size = get_block_device_size(fd);
+    int64_t footer_offset = total_size - AVB_FOOTER_SIZE;
+    std::array<uint8_t, AVB_FOOTER_SIZE> footer_bytes;
+    if (!ReadFullyAtOffset(fd, footer_bytes.data(), AVB_FOOTER_SIZE, footer_offset)) {
+        PLOG(ERROR) << "cannot read AVB footer";
+        return false;
+    }
+    // Validate the AVB footer data and byte swap to native byte order.
+    AvbFooter footer;
+    if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_bytes.data(), &footer)) {
+        LOG(ERROR) << "invalid AVB footer";
+        return false;
+    }
+    // Read the VBMeta image.
+    std::vector<uint8_t> vbmeta_bytes(footer.vbmeta_size);
+    if (!ReadFullyAtOffset(fd, vbmeta_bytes.data(), vbmeta_bytes.size(), footer.vbmeta_offset)) {
+        PLOG(ERROR) << "cannot read VBMeta image";
+        return false;
+    }
+    // Validate the VBMeta image and retrieve AVB public key.
+    // After a successful call to avb_vbmeta_image_verify(), public_key_data
+    // will point to the serialized AVB public key, in the same format generated
+    // by the `avbtool extract_public_key` command.
+    const uint8_t* public_key_data;
+    size_t public_key_size;
+    AvbVBMetaVerifyResult result = avb_vbmeta_image_verify(vbmeta_bytes.data(), vbmeta_bytes.size(),
+                                                           &public_key_data, &public_key_size);
+    if (result != AVB_VBMETA_VERIFY_RESULT_OK) {
+        LOG(ERROR) << "invalid VBMeta image: " << avb_vbmeta_verify_result_to_string(result);
+        return false;
+    }
+    if (public_key_data != nullptr) {
+        dst->bytes.resize(public_key_size);
+        memcpy(dst->bytes.data(), public_key_data, public_key_size);
+        dst->sha1.resize(SHA_DIGEST_LENGTH);
+        SHA1(public_key_data, public_key_size, dst->sha1.data());
+    }
+    return true;
+}
+
+uint64_t AvbKeyCache::Generation(const std::string& metadata_dir, const std::string& image) {
+    std::lock_guard<std::mutex> guard(lock_);
+    return (*Load(metadata_dir))[image].generation;
+}
+
+bool AvbKeyCache::Get(const std::string& metadata_dir, const std::string& image, bool* ok,
+                      AvbPublicKey* key) {
+    std::lock_guard<std::mutex> guard(lock_);
+    Slot* slot = Load(metadata_dir);
+    auto iter = slot->find(image);
+    if (iter == slot->end() || iter->second.state == State::Unread) {
+        return false;
+    }
+    *ok = iter->second.state == State::Valid;
+    *key = iter->second.key;
+    return true;
+}
+
+void AvbKeyCache::Put(const std::string& metadata_dir, const std::string& image,
+                      uint64_t generation, bool ok, const AvbPublicKey& key) {
+    std::lock_guard<std::mutex> guard(lock_);
+    Slot* slot = Load(metadata_dir);
+    Entry& entry = (*slot)[image];
+    if (entry.generation != generation) {
+        LOG(INFO) << image << " changed while its AVB key was read";
+        return;
+    }
+    entry.state = ok ? State::Valid : State::Invalid;
+    entry.key = ok ? key : AvbPublicKey{};
+    Save(metadata_dir, *slot);
+}
+
+uint64_t AvbKeyCache::Invalidate(const std::string& metadata_dir, const std::string& image) {
+    std::lock_guard<std::mutex> guard(lock_);
+    Slot* slot = Load(metadata_dir);
+    auto invalidate = [](Entry* entry) {
+        entry->generation++;
+        entry->state = State::Unread;
+        entry->key = {};
+    };
+    if (image.empty()) {
+        for (auto& [name, entry] : *slot) {
+            invalidate(&entry);
+        }
+    } else {
+        invalidate(&(*slot)[image]);
+    }
+    Save(metadata_dir, *slot);
+    return image.empty() ? 0 : (*slot)[image].generation;
+}
+
+AvbKeyCache::Slot* AvbKeyCache::Load(const std::string& metadata_dir) {
+    if (auto iter = slots_.find(metadata_dir); iter != slots_.end()) {
+        return &iter->second;
+    }
+    Slot& slot = slots_[metadata_dir];
+
+    auto file = std::filesystem::path(metadata_dir) / kAvbKeysFile;
+    std::string content;
+    if (!ReadFileToString(file, &content)) {
+        return &slot;
+    }
+    auto lines = android::base::Split(content, "\n");
+    int version;
+    if (!android::base::ParseInt(lines[0], &version) || version != kAvbKeysVersion) {
+        LOG(ERROR) << "ignoring " << file << " of version " << lines[0];
+        return &slot;
+    }
+    for (size_t i = 1; i < lines.size(); i++) {
+        if (lines[i].empty()) {
+            continue;
+        }
+        auto fields = android::base::Split(lines[i], " ");
+        Entry entry;
+        auto state = std::end(kStateNames);
+        if (fields.size() == 4) {
+            state = std::find(std::begin(kStateNames), std::end(kStateNames), fields[2]);
+        }
+        if (state == std::end(kStateNames) ||
+            !android::base::ParseUint(fields[1], &entry.generation) ||
+            (fields[3] != "-" && !FromHex(fields[3], &entry.key.bytes))) {
+            LOG(ERROR) << "invalid line in " << file << ": " << lines[i];
+            continue;
+        }
+        entry.state = static_cast<State>(state - std::begin(kStateNames));
+        if (!entry.key.bytes.empty()) {
+            entry.key.sha1.resize(SHA_DIGEST_LENGTH);
+            SHA1(entry.key.bytes.data(), entry.key.bytes.size(), entry.key.sha1.data());
+        }
+        slot[fields[0]] = std::move(entry);
+    }
+    return &slot;
+}
+
+void AvbKeyCache::Save(const std::string& metadata_dir, const Slot& slot) {
+    std::string content = std::to_string(kAvbKeysVersion) + "\n";
+    for (const auto& [name, entry] : slot) {
+        std::string key = entry.key.bytes.empty()
+                                  ? "-"
+                                  : ToHex(entry.key.bytes.data(), entry.key.bytes.size());
+        content += StringPrintf("%s %" PRIu64 " %s %s\n", name.c_str(), entry.generation,
+                                kStateNames[static_cast<int>(entry.state)], key.c_str());
+    }
+
+    // Replace the old file atomically. Keys that could not be replaced must
+    // not be read back later, so the old file is removed instead.
+    auto file = std::filesystem::path(metadata_dir) / kAvbKeysFile;
+    auto tmp = file.string() + ".tmp";
+    unique_fd fd(open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if (fd < 0 && errno == ENOENT) {
+        // The slot is gone, and its keys with it.
+        return;
+    }
+    if (fd < 0 || !android::base::WriteStringToFd(content, fd) || fsync(fd) ||
+        rename(tmp.c_str(), file.c_str())) {
+        PLOG(ERROR) << "write " << file;
+        unlink(tmp.c_str());
+        unlink(file.c_str());
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
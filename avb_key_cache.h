@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <android/gsi/AvbPublicKey.h>
+
+namespace android {
+namespace gsi {
+
+// Reads the AVB public key from the vbmeta of the footer at the end of |fd|.
+// Returns false if there is no valid footer or vbmeta.
+bool GetAvbPublicKeyFromFd(int fd, AvbPublicKey* dst);
+
+// AVB public keys of installed images, so that each image is only read once.
+// The keys of a slot are kept in a file in its metadata directory, and
+// survive gsid restarts.
+//
+// Every image has a generation, bumped before anything that may change its
+// contents. A key read from an image is only kept if the generation of the
+// image has not moved on since the read started.
+class AvbKeyCache final {
+  public:
+    // Returns the current generation of |image|, in the slot whose images
+    // are described in |metadata_dir|.
+    uint64_t Generation(const std::string& metadata_dir, const std::string& image);
+
+    // Looks up the key read from the current generation of |image|. Returns
+    // false if there is none. Otherwise |ok| is whether the read succeeded,
+    // as returned by GetAvbPublicKeyFromFd.
+    bool Get(const std::string& metadata_dir, const std::string& image, bool* ok,
+             AvbPublicKey* key);
+    void Put(const std::string& metadata_dir, const std::string& image, uint64_t generation,
+             bool ok, const AvbPublicKey& key);
+
+    // Forgets the key of |image|, or of every image of the slot if |image|
+    // is empty. Returns the new generation of |image|.
+    uint64_t Invalidate(const std::string& metadata_dir, const std::string& image = {});
+
+  private:
+    enum class State { Unread, Invalid, Valid };
+    struct Entry {
+        uint64_t generation = 0;
+        State state = State::Unread;
+        AvbPublicKey key;
+    };
+    using Slot = std::map<std::string, Entry>;
+
+    Slot* Load(const std::string& metadata_dir);
+    void Save(const std::string& metadata_dir, const Slot& slot);
+
+    std::mutex lock_;
+    // By metadata directory. Loaded from disk when first used.
+    std::map<std::string, Slot> slots_;
+};
+
+}  // namespace gsi
+}  // namespace android
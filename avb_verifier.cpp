@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "avb_verifier.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <future>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <libavb/libavb.h>
+
+namespace android {
+namespace gsi {
+
+using android::base::ReadFullyAtOffset;
+
+// Blocks are only spread over threads in batches at least this large.
+static constexpr uint64_t kMinBlocksPerThread = 64;
+
+// How much data is read back from the device at a time.
+static constexpr size_t kReadBackSize = 4 * 1024 * 1024;
+
+static size_t HashThreads() {
+    return std::max(1u, std::min(std::thread::hardware_concurrency(), 4u));
+}
+
+static const EVP_MD* GetHashAlgorithm(const uint8_t (&name)[32]) {
+    std::string algorithm(reinterpret_cast<const char*>(name), strnlen((const char*)name, 32));
+    if (algorithm == "sha1") return EVP_sha1();
+    if (algorithm == "sha256") return EVP_sha256();
+    if (algorithm == "sha512") return EVP_sha512();
+    LOG(ERROR) << "unsupported AVB hash algorithm: " << algorithm;
+    return nullptr;
+}
+
+AvbVerifier::AvbVerifier(const std::string& partition_name, int fd, uint64_t partition_size)
+    : partition_name_(partition_name),
+      fd_(fd),
+      partition_size_(partition_size),
+      image_ctx_(EVP_MD_CTX_new(), EVP_MD_CTX_free) {}
+
+bool AvbVerifier::SetVbmeta(const std::vector<uint8_t>& vbmeta) {
+    const uint8_t* public_key;
+    size_t public_key_size;
+    auto result = avb_vbmeta_image_verify(vbmeta.data(), vbmeta.size(), &public_key,
+                                          &public_key_size);
+    if (result != AVB_VBMETA_VERIFY_RESULT_OK &&
+        result != AVB_VBMETA_VERIFY_RESULT_OK_NOT_SIGNED) {
+        LOG(ERROR) << "invalid VBMeta image: " << avb_vbmeta_verify_result_to_string(result);
+        return false;
+    }
+
+    size_t num_descriptors;
+    const AvbDescriptor** descriptors =
+            avb_descriptor_get_all(vbmeta.data(), vbmeta.size(), &num_descriptors);
+    bool found = false;
+    for (size_t i = 0; i < num_descriptors && !found; i++) {
+        AvbDescriptor descriptor;
+        if (!avb_descriptor_validate_and_byteswap(descriptors[i], &descriptor)) {
+            continue;
+        }
+        auto raw = reinterpret_cast<const uint8_t*>(descriptors[i]);
+        if (descriptor.tag == AVB_DESCRIPTOR_TAG_HASHTREE) {
+            AvbHashtreeDescriptor hashtree;
+            if (!avb_hashtree_descriptor_validate_and_byteswap(
+                        reinterpret_cast<const AvbHashtreeDescriptor*>(raw), &hashtree)) {
+                continue;
+            }
+            auto name = raw + sizeof(AvbHashtreeDescriptor);
+            if (std::string(reinterpret_cast<const char*>(name), hashtree.partition_name_len) !=
+                partition_name_) {
+                continue;
+            }
+            auto salt = name + hashtree.partition_name_len;
+            auto root_digest = salt + hashtree.salt_len;
+            if (hashtree.data_block_size != hashtree.hash_block_size ||
+                !hashtree.data_block_size || hashtree.image_size % hashtree.data_block_size) {
+                LOG(ERROR) << "unsupported hashtree geometry for " << partition_name_;
+                break;
+            }
+            is_hashtree_ = true;
+            md_ = GetHashAlgorithm(hashtree.hash_algorithm);
+            salt_.assign(salt, salt + hashtree.salt_len);
+            expected_digest_.assign(root_digest, root_digest + hashtree.root_digest_len);
+            image_size_ = hashtree.image_size;
+            block_size_ = hashtree.data_block_size;
+            tree_offset_ = hashtree.tree_offset;
+            tree_size_ = hashtree.tree_size;
+            found = true;
+        } else if (descriptor.tag == AVB_DESCRIPTOR_TAG_HASH) {
+            AvbHashDescriptor hash;
+            if (!avb_hash_descriptor_validate_and_byteswap(
+                        reinterpret_cast<const AvbHashDescriptor*>(raw), &hash)) {
+                continue;
+            }
+            auto name = raw + sizeof(AvbHashDescriptor);
+            if (std::string(reinterpret_cast<const char*>(name), hash.partition_name_len) !=
+                partition_name_) {
+                continue;
+            }
+            auto salt = name + hash.partition_name_len;
+            auto digest = salt + hash.salt_len;
+            is_hashtree_ = false;
+            md_ = GetHashAlgorithm(hash.hash_algorithm);
+            salt_.assign(salt, salt + hash.salt_len);
+            expected_digest_.assign(digest, digest + hash.digest_len);
+            image_size_ = hash.image_size;
+            found = true;
+        }
+    }
+    avb_free(descriptors);
+
+    if (!found) {
+        LOG(ERROR) << "no AVB hashtree or hash descriptor for " << partition_name_;
+        return false;
+    }
+    if (!md_) {
+        return false;
+    }
+    size_t md_size = EVP_MD_size(md_);
+    if (expected_digest_.size() != md_size) {
+        LOG(ERROR) << "AVB digest for " << partition_name_ << " has the wrong size";
+        return false;
+    }
+    if (image_size_ > partition_size_ || tree_size_ > partition_size_ ||
+        tree_offset_ > partition_size_ - tree_size_) {
+        LOG(ERROR) << "AVB descriptor for " << partition_name_ << " exceeds partition size";
+        return false;
+    }
+
+    if (is_hashtree_) {
+        // Digests in the tree are padded to a power of two.
+        digest_size_ = 1;
+        while (digest_size_ < md_size) {
+            digest_size_ *= 2;
+        }
+        leaves_.assign(image_size_ / block_size_ * digest_size_, 0);
+        leaf_valid_.assign(image_size_ / block_size_, 0);
+    } else if (!EVP_DigestInit_ex(image_ctx_.get(), md_, nullptr) ||
+               !EVP_DigestUpdate(image_ctx_.get(), salt_.data(), salt_.size())) {
+        return false;
+    }
+    vbmeta_ = vbmeta;
+    return true;
+}
+
+// Hash |count| blocks from |data| into |out|, one padded digest per block,
+// spreading the work over several threads.
+bool AvbVerifier::HashBlocks(const char* data, uint64_t count, uint8_t* out) {
+    auto hash_range = [this, data, out](uint64_t begin, uint64_t end) -> bool {
+        std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(),
+                                                                    EVP_MD_CTX_free);
+        for (uint64_t i = begin; i < end; i++) {
+            if (!EVP_DigestInit_ex(ctx.get(), md_, nullptr) ||
+                !EVP_DigestUpdate(ctx.get(), salt_.data(), salt_.size()) ||
+                !EVP_DigestUpdate(ctx.get(), data + i * block_size_, block_size_) ||
+                !EVP_DigestFinal_ex(ctx.get(), out + i * digest_size_, nullptr)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    size_t threads = std::min(static_cast<uint64_t>(HashThreads()), count / kMinBlocksPerThread);
+    if (threads <= 1) {
+        return hash_range(0, count);
+    }
+    std::vector<std::future<bool>> results;
+    uint64_t per_thread = (count + threads - 1) / threads;
+    for (uint64_t begin = per_thread; begin < count; begin += per_thread) {
+        results.emplace_back(std::async(std::launch::async, hash_range, begin,
+                                        std::min(begin + per_thread, count)));
+    }
+    bool ok = hash_range(0, per_thread);
+    for (auto& result : results) {
+        ok &= result.get();
+    }
+    return ok;
+}
+
+// Forget the digests of blocks that overlap the range, so that they are read
+// back from the device.
+void AvbVerifier::InvalidateLeaves(uint64_t offset, uint64_t length) {
+    uint64_t first = offset / block_size_;
+    uint64_t end = std::min((offset + length + block_size_ - 1) / block_size_,
+                            static_cast<uint64_t>(leaf_valid_.size()));
+    for (uint64_t i = first; i < end; i++) {
+        leaf_valid_[i] = 0;
+    }
+}
+
+bool AvbVerifier::HashImageInOrder(const char* data, size_t length) {
+    if (!hashed_in_order_) {
+        return true;
+    }
+    size_t n = std::min(static_cast<uint64_t>(length), image_size_ - hashed_);
+    if (!EVP_DigestUpdate(image_ctx_.get(), data, n)) {
+        hashed_in_order_ = false;
+        return false;
+    }
+    hashed_ += n;
+    return true;
+}
+
+void AvbVerifier::OnWrite(uint64_t offset, const char* data, size_t length) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!md_ || offset >= image_size_) {
+        return;
+    }
+    if (!is_hashtree_) {
+        if (offset != hashed_) {
+            hashed_in_order_ = false;
+        }
+        HashImageInOrder(data, length);
+        return;
+    }
+
+    uint64_t end = std::min(offset + length, image_size_);
+    uint64_t first = (offset + block_size_ - 1) / block_size_;
+    uint64_t last = end / block_size_;
+    if (first >= last) {
+        InvalidateLeaves(offset, end - offset);
+        return;
+    }
+    InvalidateLeaves(offset, first * block_size_ - offset);
+    InvalidateLeaves(last * block_size_, end - last * block_size_);
+
+    const char* blocks = data + (first * block_size_ - offset);
+    if (!HashBlocks(blocks, last - first, &leaves_[first * digest_size_])) {
+        InvalidateLeaves(first * block_size_, (last - first) * block_size_);
+        return;
+    }
+    std::fill(leaf_valid_.begin() + first, leaf_valid_.begin() + last, 1);
+}
+
+void AvbVerifier::OnFill(uint64_t offset, uint64_t length, uint32_t pattern) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (!md_ || offset >= image_size_) {
+        return;
+    }
+    uint64_t end = std::min(offset + length, image_size_);
+
+    if (!is_hashtree_) {
+        if (offset != hashed_) {
+            hashed_in_order_ = false;
+            return;
+        }
+        std::vector<uint32_t> buffer(16 * 1024, pattern);
+        auto chunk = reinterpret_cast<const char*>(buffer.data());
+        for (uint64_t pos = offset; pos < end && hashed_in_order_;) {
+            size_t n = std::min(static_cast<uint64_t>(buffer.size() * sizeof(pattern)), end - pos);
+            HashImageInOrder(chunk, n);
+            pos += n;
+        }
+        return;
+    }
+
+    uint64_t first = (offset + block_size_ - 1) / block_size_;
+    uint64_t last = end / block_size_;
+    if (first >= last) {
+        InvalidateLeaves(offset, end - offset);
+        return;
+    }
+    InvalidateLeaves(offset, first * block_size_ - offset);
+    InvalidateLeaves(last * block_size_, end - last * block_size_);
+
+    // Every block of a fill has the same digest.
+    if (fill_digest_.empty() || fill_pattern_ != pattern) {
+        std::vector<uint32_t> block(block_size_ / sizeof(pattern), pattern);
+        fill_digest_.assign(digest_size_, 0);
+        if (!HashBlocks(reinterpret_cast<const char*>(block.data()), 1, fill_digest_.data())) {
+            fill_digest_.clear();
+            InvalidateLeaves(first * block_size_, (last - first) * block_size_);
+            return;
+        }
+        fill_pattern_ = pattern;
+    }
+    for (uint64_t i = first; i < last; i++) {
+        std::copy(fill_digest_.begin(), fill_digest_.end(), &leaves_[i * digest_size_]);
+        leaf_valid_[i] = 1;
+    }
+}
+
+bool AvbVerifier::ReadVbmetaFromFooter(std::vector<uint8_t>* vbmeta) {
+    std::array<uint8_t, AVB_FOOTER_SIZE> footer_bytes;
+    if (partition_size_ < AVB_FOOTER_SIZE ||
+        !ReadFullyAtOffset(fd_, footer_bytes.data(), footer_bytes.size(),
+                           partition_size_ - AVB_FOOTER_SIZE)) {
+        PLOG(ERROR) << "cannot read AVB footer of " << partition_name_;
+        return false;
+    }
+    AvbFooter footer;
+    if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_bytes.data(), &footer)) {
+        LOG(ERROR) << "invalid AVB footer in " << partition_name_;
+        return false;
+    }
+    if (footer.vbmeta_offset > partition_size_ ||
+        footer.vbmeta_size > partition_size_ - footer.vbmeta_offset) {
+        LOG(ERROR) << "AVB footer of " << partition_name_ << " points past the partition";
+        return false;
+    }
+    vbmeta->resize(footer.vbmeta_size);
+    if (!ReadFullyAtOffset(fd_, vbmeta->data(), vbmeta->size(), footer.vbmeta_offset)) {
+        PLOG(ERROR) << "cannot read VBMeta image of " << partition_name_;
+        return false;
+    }
+    return true;
+}
+
+bool AvbVerifier::ReadBackMissing(const PartitionWriter::ProgressCallback& on_progress) {
+    StagingBuffer buffer(kReadBackSize);
+    if (!buffer.ok()) {
+        return false;
+    }
+    uint64_t blocks_per_read = buffer.size() / block_size_;
+    uint64_t read_back = 0;
+    for (uint64_t i = 0; i < leaf_valid_.size();) {
+        if (leaf_valid_[i]) {
+            i++;
+            continue;
+        }
+        uint64_t count = 1;
+        while (count < blocks_per_read && i + count < leaf_valid_.size() &&
+               !leaf_valid_[i + count]) {
+            count++;
+        }
+        if (!ReadFullyAtOffset(fd_, buffer.data(), count * block_size_, i * block_size_)) {
+            PLOG(ERROR) << "read " << partition_name_ << " for verification";
+            return false;
+        }
+        if (!HashBlocks(buffer.data(), count, &leaves_[i * digest_size_])) {
+            return false;
+        }
+        std::fill(leaf_valid_.begin() + i, leaf_valid_.begin() + i + count, 1);
+        i += count;
+        read_back += count * block_size_;
+        if (on_progress && !on_progress(read_back)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AvbVerifier::VerifyHashtree(const PartitionWriter::ProgressCallback& on_progress) {
+    if (!ReadBackMissing(on_progress)) {
+        return false;
+    }
+
+    // Build the tree the way avbtool does: each level holds the digests of
+    // the blocks of the level below, padded to whole blocks, up to a level
+    // that fits in a single block.
+    std::vector<std::vector<uint8_t>> levels;
+    std::vector<uint8_t> level = leaves_;
+    while (true) {
+        level.resize((level.size() + block_size_ - 1) / block_size_ * block_size_, 0);
+        levels.emplace_back(level);
+        if (level.size() <= block_size_) {
+            break;
+        }
+        uint64_t count = level.size() / block_size_;
+        std::vector<uint8_t> next(count * digest_size_, 0);
+        if (!HashBlocks(reinterpret_cast<const char*>(level.data()), count, next.data())) {
+            return false;
+        }
+        level = std::move(next);
+    }
+
+    std::vector<uint8_t> root(EVP_MD_size(md_));
+    if (image_size_ <= block_size_) {
+        // A single data block is its own root.
+        levels.clear();
+        std::copy(leaves_.begin(), leaves_.begin() + root.size(), root.begin());
+    } else {
+        std::vector<uint8_t> top(digest_size_);
+        if (!HashBlocks(reinterpret_cast<const char*>(level.data()), 1, top.data())) {
+            return false;
+        }
+        std::copy(top.begin(), top.begin() + root.size(), root.begin());
+    }
+    if (root != expected_digest_) {
+        LOG(ERROR) << "AVB hashtree root digest mismatch for " << partition_name_;
+        return false;
+    }
+
+    // dm-verity checks data against the stored tree, not the root digest, so
+    // the stored tree must be intact too. The top level is stored first.
+    std::vector<uint8_t> tree;
+    for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+        tree.insert(tree.end(), it->begin(), it->end());
+    }
+    if (tree.size() != tree_size_) {
+        LOG(ERROR) << "AVB hashtree for " << partition_name_ << " should be " << tree.size()
+                   << " bytes, descriptor says " << tree_size_;
+        return false;
+    }
+    std::vector<uint8_t> stored(tree_size_);
+    if (!ReadFullyAtOffset(fd_, stored.data(), stored.size(), tree_offset_)) {
+        PLOG(ERROR) << "read AVB hashtree of " << partition_name_;
+        return false;
+    }
+    if (stored != tree) {
+        LOG(ERROR) << "stored AVB hashtree of " << partition_name_ << " is corrupt";
+        return false;
+    }
+    return true;
+}
+
+bool AvbVerifier::VerifyHash(const PartitionWriter::ProgressCallback& on_progress) {
+    if (!hashed_in_order_ || hashed_ != image_size_) {
+        // Start over from the device.
+        if (!EVP_DigestInit_ex(image_ctx_.get(), md_, nullptr) ||
+            !EVP_DigestUpdate(image_ctx_.get(), salt_.data(), salt_.size())) {
+            return false;
+        }
+        StagingBuffer buffer(kReadBackSize);
+        if (!buffer.ok()) {
+            return false;
+        }
+        for (uint64_t pos = 0; pos < image_size_;) {
+            size_t n = std::min(static_cast<uint64_t>(buffer.size()), image_size_ - pos);
+            if (!ReadFullyAtOffset(fd_, buffer.data(), n, pos)) {
+                PLOG(ERROR) << "read " << partition_name_ << " for verification";
+                return false;
+            }
+            if (!EVP_DigestUpdate(image_ctx_.get(), buffer.data(), n)) {
+                return false;
+            }
+            pos += n;
+            if (on_progress && !on_progress(pos)) {
+                return false;
+            }
+        }
+    }
+    std::vector<uint8_t> digest(EVP_MD_size(md_));
+    if (!EVP_DigestFinal_ex(image_ctx_.get(), digest.data(), nullptr)) {
+        return false;
+    }
+    if (digest != expected_digest_) {
+        LOG(ERROR) << "AVB hash digest mismatch for " << partition_name_;
+        return false;
+    }
+    return true;
+}
+
+bool AvbVerifier::Verify(const PartitionWriter::ProgressCallback& on_progress) {
+    std::lock_guard<std::mutex> guard(lock_);
+    std::vector<uint8_t> vbmeta;
+    if (!ReadVbmetaFromFooter(&vbmeta)) {
+        return false;
+    }
+    if (vbmeta_.empty()) {
+        if (!SetVbmeta(vbmeta)) {
+            return false;
+        }
+    } else if (vbmeta != vbmeta_) {
+        LOG(ERROR) << "VBMeta image in " << partition_name_
+                   << " does not match the one given before the install";
+        return false;
+    }
+    return is_hashtree_ ? VerifyHashtree(on_progress) : VerifyHash(on_progress);
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <openssl/evp.h>
+
+#include "partition_writer.h"
+
+namespace android {
+namespace gsi {
+
+// Checks a partition against the AVB hashtree or hash descriptor that
+// describes it, so that a corrupt image is caught at install time rather than
+// by dm-verity or the bootloader.
+//
+// If the vbmeta image is known before the data is written, data blocks are
+// hashed as they are written, on several threads. Blocks that were never seen
+// (all blocks when the vbmeta only arrives at the end of the image) are read
+// back from the device and hashed when the partition is complete. DONT_CARE
+// regions of sparse images are zeroed while a verifier is set, so they are
+// seen as fills.
+class AvbVerifier final : public WriteObserver {
+  public:
+    // |fd| is the partition device, and |partition_size| its size.
+    AvbVerifier(const std::string& partition_name, int fd, uint64_t partition_size);
+
+    // Parse the descriptor for this partition out of |vbmeta|. This must be
+    // called before any data is written for blocks to be verified inline.
+    bool SetVbmeta(const std::vector<uint8_t>& vbmeta);
+
+    void OnWrite(uint64_t offset, const char* data, size_t length) override;
+    void OnFill(uint64_t offset, uint64_t length, uint32_t pattern) override;
+
+    // Called once the whole partition has been written. If no vbmeta was set,
+    // it is read from the AVB footer now. The vbmeta in the footer must match
+    // the one given to SetVbmeta. |on_progress| is invoked with the number of
+    // bytes read back from the device.
+    bool Verify(const PartitionWriter::ProgressCallback& on_progress);
+
+  private:
+    bool ReadVbmetaFromFooter(std::vector<uint8_t>* vbmeta);
+    void InvalidateLeaves(uint64_t offset, uint64_t length);
+    bool HashBlocks(const char* data, uint64_t count, uint8_t* out);
+    bool HashImageInOrder(const char* data, size_t length);
+    bool ReadBackMissing(const PartitionWriter::ProgressCallback& on_progress);
+    bool VerifyHashtree(const PartitionWriter::ProgressCallback& on_progress);
+    bool VerifyHash(const PartitionWriter::ProgressCallback& on_progress);
+
+    // Ranges of a partition can be written from several threads.
+    std::mutex lock_;
+
+    std::string partition_name_;
+    int fd_;
+    uint64_t partition_size_;
+    std::vector<uint8_t> vbmeta_;
+
+    bool is_hashtree_ = false;
+    const EVP_MD* md_ = nullptr;
+    std::vector<uint8_t> salt_;
+    std::vector<uint8_t> expected_digest_;
+    uint64_t image_size_ = 0;
+    uint32_t block_size_ = 0;
+    uint64_t tree_offset_ = 0;
+    uint64_t tree_size_ = 0;
+
+    // Hashtree descriptors: the digest of every data block, and whether it
+    // has been computed from data as it was written.
+    size_t digest_size_ = 0;
+    std::vector<uint8_t> leaves_;
+    std::vector<uint8_t> leaf_valid_;
+    // Leaf digest of the block most recently filled, keyed by its pattern.
+    uint32_t fill_pattern_ = 0;
+    std::vector<uint8_t> fill_digest_;
+
+    // Hash descriptors: the image is hashed as a whole, so only data written
+    // in order can be hashed inline.
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> image_ctx_;
+    uint64_t hashed_ = 0;
+    bool hashed_in_order_ = true;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "block_diff.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+using android::base::ReadFullyAtOffset;
+
+static_assert(sizeof(BlockDiffHeader) == 32);
+static_assert(sizeof(BlockDiffOp) == 32);
+
+BlockDiffWriter::BlockDiffWriter(PartitionWriter* writer, int fd, uint64_t partition_size)
+    : writer_(writer), fd_(fd), partition_size_(partition_size) {}
+
+bool BlockDiffWriter::Gather(const char** data, size_t* length, size_t needed) {
+    size_t n = std::min(*length, needed - pending_length_);
+    memcpy(pending_ + pending_length_, *data, n);
+    pending_length_ += n;
+    *data += n;
+    *length -= n;
+    if (pending_length_ < needed) {
+        return false;
+    }
+    pending_length_ = 0;
+    return true;
+}
+
+bool BlockDiffWriter::ParseFileHeader() {
+    BlockDiffHeader header;
+    memcpy(&header, pending_, sizeof(header));
+    if (header.magic != kBlockDiffMagic) {
+        LOG(ERROR) << "bad block diff magic " << std::hex << header.magic;
+        return false;
+    }
+    if (header.major_version != kBlockDiffMajorVersion) {
+        LOG(ERROR) << "unsupported block diff version " << header.major_version;
+        return false;
+    }
+    if (header.header_size < sizeof(BlockDiffHeader) ||
+        header.op_header_size < sizeof(BlockDiffOp)) {
+        LOG(ERROR) << "bad block diff header sizes " << header.header_size << ", "
+                   << header.op_header_size;
+        return false;
+    }
+    if (!header.block_size || (header.block_size % 512)) {
+        LOG(ERROR) << "bad block diff block size " << header.block_size;
+        return false;
+    }
+    if (header.total_blocks != partition_size_ / header.block_size ||
+        partition_size_ % header.block_size) {
+        LOG(ERROR) << "block diff of " << header.total_blocks << " blocks of "
+                   << header.block_size << " bytes does not match partition size "
+                   << partition_size_;
+        return false;
+    }
+    if (!header.op_count && partition_size_) {
+        LOG(ERROR) << "block diff has no operations";
+        return false;
+    }
+    op_header_size_ = header.op_header_size;
+    block_size_ = header.block_size;
+    ops_remaining_ = header.op_count;
+
+    skip_ = header.header_size - sizeof(BlockDiffHeader);
+    after_skip_ = ops_remaining_ ? State::OpHeader : State::Done;
+    state_ = skip_ ? State::Skip : after_skip_;
+    return true;
+}
+
+bool BlockDiffWriter::ParseOp() {
+    BlockDiffOp op;
+    memcpy(&op, pending_, sizeof(op));
+
+    uint64_t total_blocks = partition_size_ / block_size_;
+    if (!op.block_count || op.block_count > total_blocks ||
+        op.dst_block > total_blocks - op.block_count) {
+        LOG(ERROR) << "block diff operation writes " << op.block_count << " blocks at "
+                   << op.dst_block << ", past the end of the partition";
+        return false;
+    }
+    uint64_t dst = op.dst_block * block_size_;
+    uint64_t length = op.block_count * block_size_;
+    if (claimed_.Overlaps(dst, length)) {
+        LOG(ERROR) << "block diff writes blocks at " << op.dst_block << " more than once";
+        return false;
+    }
+    skip_ = op_header_size_ - sizeof(BlockDiffOp);
+    after_skip_ = State::OpHeader;
+
+    switch (static_cast<BlockDiffOpType>(op.type)) {
+        case BlockDiffOpType::Copy: {
+            if (op.src_block > total_blocks - op.block_count) {
+                LOG(ERROR) << "block diff copies " << op.block_count << " blocks from "
+                           << op.src_block << ", past the end of the partition";
+                return false;
+            }
+            uint64_t src = op.src_block * block_size_;
+            if (claimed_.Overlaps(src, length)) {
+                LOG(ERROR) << "block diff copies from blocks at " << op.src_block
+                           << " after overwriting them";
+                return false;
+            }
+            if (!Copy(src, dst, length)) {
+                return false;
+            }
+            break;
+        }
+        case BlockDiffOpType::Literal:
+            literal_offset_ = dst;
+            literal_remaining_ = length;
+            after_skip_ = State::Literal;
+            break;
+        case BlockDiffOpType::Zero:
+            if (!writer_->Fill(dst, length, 0)) {
+                return false;
+            }
+            break;
+        default:
+            LOG(ERROR) << "unknown block diff operation " << op.type;
+            return false;
+    }
+    claimed_.Add(dst, length);
+    if (after_skip_ != State::Literal) {
+        written_ += length;
+        if (!FinishOp()) {
+            return false;
+        }
+    }
+    state_ = skip_ ? State::Skip : after_skip_;
+    return true;
+}
+
+// Copies like memmove, so that runs may overlap their source.
+bool BlockDiffWriter::Copy(uint64_t src, uint64_t dst, uint64_t length) {
+    if (src == dst) {
+        return true;
+    }
+    if (!copy_buffer_) {
+        copy_buffer_ = std::make_unique<StagingBuffer>(kStagingBufferSize);
+        if (!copy_buffer_->ok()) {
+            copy_buffer_ = nullptr;
+            return false;
+        }
+    }
+    bool forward = dst < src;
+    for (uint64_t copied = 0; copied < length;) {
+        size_t n = std::min(length - copied, static_cast<uint64_t>(copy_buffer_->size()));
+        uint64_t pos = forward ? copied : length - copied - n;
+        if (!ReadFullyAtOffset(fd_, copy_buffer_->data(), n, src + pos)) {
+            PLOG(ERROR) << "read " << n << " bytes at " << (src + pos);
+            return false;
+        }
+        if (!writer_->Write(dst + pos, copy_buffer_->data(), n)) {
+            return false;
+        }
+        copied += n;
+    }
+    return true;
+}
+
+// Called once an operation has been fully applied. Sets |after_skip_| to the
+// state that follows it.
+bool BlockDiffWriter::FinishOp() {
+    if (--ops_remaining_) {
+        after_skip_ = State::OpHeader;
+        return true;
+    }
+    if (written_ != partition_size_) {
+        LOG(ERROR) << "block diff operations cover " << written_ << " bytes, expected "
+                   << partition_size_;
+        return false;
+    }
+    after_skip_ = State::Done;
+    return true;
+}
+
+bool BlockDiffWriter::Feed(const char* data, size_t length) {
+    while (length) {
+        switch (state_) {
+            case State::FileHeader:
+                if (Gather(&data, &length, sizeof(BlockDiffHeader)) && !ParseFileHeader()) {
+                    return false;
+                }
+                break;
+            case State::OpHeader:
+                if (Gather(&data, &length, sizeof(BlockDiffOp)) && !ParseOp()) {
+                    return false;
+                }
+                break;
+            case State::Skip: {
+                size_t n = std::min(static_cast<uint64_t>(length), skip_);
+                data += n;
+                length -= n;
+                skip_ -= n;
+                if (!skip_) {
+                    state_ = after_skip_;
+                }
+                break;
+            }
+            case State::Literal: {
+                size_t n = std::min(static_cast<uint64_t>(length), literal_remaining_);
+                if (!writer_->Write(literal_offset_, data, n)) {
+                    return false;
+                }
+                data += n;
+                length -= n;
+                literal_offset_ += n;
+                literal_remaining_ -= n;
+                written_ += n;
+                if (!literal_remaining_) {
+                    if (!FinishOp()) {
+                        return false;
+                    }
+                    state_ = after_skip_;
+                }
+                break;
+            }
+            case State::Done:
+                LOG(ERROR) << length << " bytes of trailing data after block diff";
+                return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
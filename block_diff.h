@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "partition_writer.h"
+#include "written_ranges.h"
+
+namespace android {
+namespace gsi {
+
+// Block diff format. All fields are little-endian. A diff is a header
+// followed by |op_count| operations, each rewriting a run of blocks of the
+// partition:
+//
+//   COPY     Copy |block_count| blocks starting at |src_block|, as they were
+//            before the update. A run copied onto itself is kept as is.
+//   LITERAL  Write the |block_count| blocks of data that follow the
+//            operation in the diff.
+//   ZERO     Zero the blocks.
+//
+// Every block of the partition must be written by exactly one operation.
+// Since the diff is applied in place, a COPY can only read blocks that no
+// earlier operation has written, so diffs must order their operations such
+// that blocks are read before they are overwritten.
+static constexpr uint32_t kBlockDiffMagic = 0x46494444;  // "DDIF"
+static constexpr uint16_t kBlockDiffMajorVersion = 1;
+
+enum class BlockDiffOpType : uint32_t {
+    Copy = 1,
+    Literal = 2,
+    Zero = 3,
+};
+
+struct BlockDiffHeader {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t header_size;
+    uint32_t block_size;
+    uint32_t op_header_size;
+    uint64_t total_blocks;
+    uint64_t op_count;
+} __attribute__((packed));
+
+struct BlockDiffOp {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t dst_block;
+    uint64_t src_block;
+    uint64_t block_count;
+} __attribute__((packed));
+
+// Applies a block diff to a partition as the diff is streamed in, in pieces of
+// any size.
+class BlockDiffWriter final {
+  public:
+    // |fd| is the partition device, read for COPY operations, and
+    // |partition_size| its size. Diffs cannot change the size of a partition.
+    BlockDiffWriter(PartitionWriter* writer, int fd, uint64_t partition_size);
+
+    bool Feed(const char* data, size_t length);
+
+    // Number of bytes of the partition written so far. This reaches the
+    // partition size once the last operation has been applied.
+    uint64_t offset() const { return written_; }
+
+  private:
+    enum class State {
+        FileHeader,
+        OpHeader,
+        Skip,
+        Literal,
+        Done,
+    };
+
+    bool Gather(const char** data, size_t* length, size_t needed);
+    bool ParseFileHeader();
+    bool ParseOp();
+    bool Copy(uint64_t src, uint64_t dst, uint64_t length);
+    bool FinishOp();
+
+    PartitionWriter* writer_;
+    int fd_;
+    uint64_t partition_size_;
+    State state_ = State::FileHeader;
+    // Header bytes collected so far, for headers split across pieces.
+    char pending_[sizeof(BlockDiffOp)];
+    size_t pending_length_ = 0;
+
+    uint32_t op_header_size_ = 0;
+    uint32_t block_size_ = 0;
+    uint64_t ops_remaining_ = 0;
+
+    // Bytes of the partition already claimed by an operation.
+    WrittenRanges claimed_;
+    uint64_t written_ = 0;
+    // Device offset and bytes left of the current LITERAL operation.
+    uint64_t literal_offset_ = 0;
+    uint64_t literal_remaining_ = 0;
+    // Bytes to skip, and the state to resume with afterwards.
+    uint64_t skip_ = 0;
+    State after_skip_ = State::OpHeader;
+    std::unique_ptr<StagingBuffer> copy_buffer_;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -62,6 +62,7 @@ int main(int argc, char** argv) {
         }
     }
 
+    android::gsi::EnableStateCache();
     android::gsi::GsiService::Register();
     {
         sp<ProcessState> ps(ProcessState::self());
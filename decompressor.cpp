@@ -0,0 +1,440 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "decompressor.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <lz4.h>
+#include <zlib.h>
+
+#include "partition_writer.h"
+
+namespace android {
+namespace gsi {
+
+class GzipDecompressor final : public Decompressor {
+  public:
+    explicit GzipDecompressor(Sink sink) : sink_(std::move(sink)), output_(kStagingBufferSize) {}
+    ~GzipDecompressor() override;
+
+    bool Init();
+    bool Feed(const char* data, size_t length) override;
+    bool Finish() override;
+
+  private:
+    bool FlushOutput();
+
+    Sink sink_;
+    StagingBuffer output_;
+    z_stream zs_ = {};
+    bool initialized_ = false;
+    // True while in the middle of a gzip member.
+    bool in_member_ = false;
+};
+
+GzipDecompressor::~GzipDecompressor() {
+    if (initialized_) {
+        inflateEnd(&zs_);
+    }
+}
+
+bool GzipDecompressor::Init() {
+    if (!output_.ok()) {
+        return false;
+    }
+    // 15 + 32: maximum window size, and auto-detect gzip or zlib headers.
+    int rv = inflateInit2(&zs_, 15 + 32);
+    if (rv != Z_OK) {
+        LOG(ERROR) << "inflateInit2 failed: " << rv;
+        return false;
+    }
+    initialized_ = true;
+    zs_.next_out = reinterpret_cast<Bytef*>(output_.data());
+    zs_.avail_out = output_.size();
+    return true;
+}
+
+bool GzipDecompressor::FlushOutput() {
+    size_t length = output_.size() - zs_.avail_out;
+    zs_.next_out = reinterpret_cast<Bytef*>(output_.data());
+    zs_.avail_out = output_.size();
+    return !length || sink_(output_.data(), length);
+}
+
+bool GzipDecompressor::Feed(const char* data, size_t length) {
+    zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    zs_.avail_in = length;
+    while (zs_.avail_in) {
+        in_member_ = true;
+        int rv = inflate(&zs_, Z_NO_FLUSH);
+        if (rv == Z_STREAM_END) {
+            // Images compressed with pigz, or concatenated by hand, contain
+            // several members back to back.
+            in_member_ = false;
+            if (inflateReset(&zs_) != Z_OK) {
+                LOG(ERROR) << "inflateReset failed";
+                return false;
+            }
+        } else if (rv != Z_OK && rv != Z_BUF_ERROR) {
+            LOG(ERROR) << "inflate failed: " << rv << " (" << (zs_.msg ? zs_.msg : "") << ")";
+            return false;
+        }
+        if (!zs_.avail_out && !FlushOutput()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GzipDecompressor::Finish() {
+    // Drain any output zlib is still holding back.
+    while (in_member_) {
+        int rv = inflate(&zs_, Z_FINISH);
+        if (rv == Z_STREAM_END) {
+            in_member_ = false;
+        } else if (rv != Z_OK && (rv != Z_BUF_ERROR || zs_.avail_out)) {
+            LOG(ERROR) << "gzip stream is truncated";
+            return false;
+        }
+        if (!FlushOutput()) {
+            return false;
+        }
+    }
+    return FlushOutput();
+}
+
+// Decompresses the LZ4 frame format. When a frame declares its blocks as
+// independent, blocks are decompressed in parallel on a few workers and handed
+// to the sink in order; otherwise each block is decompressed against the
+// output before it.
+class Lz4Decompressor final : public Decompressor {
+  public:
+    explicit Lz4Decompressor(Sink sink) : sink_(std::move(sink)) {}
+    ~Lz4Decompressor() override;
+
+    bool Feed(const char* data, size_t length) override;
+    bool Finish() override;
+
+  private:
+    static constexpr uint32_t kFrameMagic = 0x184D2204;
+    static constexpr uint32_t kSkippableMagicMask = 0xFFFFFFF0;
+    static constexpr uint32_t kSkippableMagic = 0x184D2A50;
+    static constexpr uint32_t kUncompressedBit = 0x80000000;
+    static constexpr size_t kDictSize = 64 * 1024;
+
+    enum class State { Magic, FrameHeader, BlockSize, Block, ContentChecksum, Skip };
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        int size;
+    };
+
+    bool Parse();
+    bool ParseFrameHeader(const char* p, size_t header_size);
+    bool DecodeBlock(const char* data, size_t length, bool compressed);
+    bool DrainInFlight(size_t max_in_flight);
+    void Worker();
+    bool Emit(const char* data, size_t length);
+
+    Sink sink_;
+    std::vector<char> pending_;
+    size_t pos_ = 0;
+    State state_ = State::Magic;
+
+    // Current frame parameters.
+    uint8_t flags_ = 0;
+    size_t block_max_size_ = 0;
+    uint32_t block_size_ = 0;
+    uint32_t skip_size_ = 0;
+
+    // Independent blocks being decompressed, oldest first.
+    std::deque<std::future<Block>> in_flight_;
+    size_t num_workers_ = std::max(1u, std::min(std::thread::hardware_concurrency(), 4u));
+    size_t max_in_flight_ = num_workers_ * 2;
+
+    // Workers are started for the first independent block, and then kept for
+    // the rest of the stream.
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::deque<std::packaged_task<Block()>> queue_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+
+    // The last 64KiB of output, for frames with dependent blocks.
+    std::vector<char> dict_;
+};
+
+Lz4Decompressor::~Lz4Decompressor() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stopping_ = true;
+        queue_.clear();
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+void Lz4Decompressor::Worker() {
+    while (true) {
+        std::packaged_task<Block()> task;
+        {
+            std::unique_lock<std::mutex> lock(lock_);
+            cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        task();
+    }
+}
+
+static uint32_t ReadLe32(const char* data) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+bool Lz4Decompressor::Feed(const char* data, size_t length) {
+    pending_.insert(pending_.end(), data, data + length);
+    if (!Parse()) {
+        return false;
+    }
+    pending_.erase(pending_.begin(), pending_.begin() + pos_);
+    pos_ = 0;
+    return true;
+}
+
+bool Lz4Decompressor::Parse() {
+    while (true) {
+        size_t available = pending_.size() - pos_;
+        const char* p = pending_.data() + pos_;
+        switch (state_) {
+            case State::Magic: {
+                if (available < 4) return true;
+                uint32_t magic = ReadLe32(p);
+                pos_ += 4;
+                if (magic == kFrameMagic) {
+                    state_ = State::FrameHeader;
+                } else if ((magic & kSkippableMagicMask) == kSkippableMagic) {
+                    if (available < 8) {
+                        pos_ -= 4;
+                        return true;
+                    }
+                    skip_size_ = ReadLe32(p + 4);
+                    pos_ += 4;
+                    state_ = State::Skip;
+                } else {
+                    LOG(ERROR) << "invalid lz4 frame magic " << std::hex << magic;
+                    return false;
+                }
+                break;
+            }
+            case State::FrameHeader: {
+                if (available < 1) return true;
+                // FLG, BD, optional content size and dictionary ID, and the
+                // header checksum.
+                uint8_t flags = p[0];
+                size_t header_size = 3 + ((flags & 0x08) ? 8 : 0) + ((flags & 0x01) ? 4 : 0);
+                if (available < header_size) return true;
+                if (!ParseFrameHeader(p, header_size)) return false;
+                break;
+            }
+            case State::BlockSize:
+                if (available < 4) return true;
+                block_size_ = ReadLe32(p);
+                pos_ += 4;
+                if (block_size_ == 0) {
+                    // End mark. Frames may be concatenated.
+                    state_ = (flags_ & 0x04) ? State::ContentChecksum : State::Magic;
+                } else if ((block_size_ & ~kUncompressedBit) > block_max_size_) {
+                    LOG(ERROR) << "lz4 block size " << (block_size_ & ~kUncompressedBit)
+                               << " exceeds frame maximum " << block_max_size_;
+                    return false;
+                } else {
+                    state_ = State::Block;
+                }
+                break;
+            case State::Block: {
+                size_t size = block_size_ & ~kUncompressedBit;
+                // Block checksums are skipped, see decompressor.h.
+                size_t checksum = (flags_ & 0x10) ? 4 : 0;
+                if (available < size + checksum) return true;
+                if (!DecodeBlock(p, size, !(block_size_ & kUncompressedBit))) return false;
+                pos_ += size + checksum;
+                state_ = State::BlockSize;
+                break;
+            }
+            case State::ContentChecksum:
+                // Not verified either.
+                if (available < 4) return true;
+                pos_ += 4;
+                state_ = State::Magic;
+                break;
+            case State::Skip: {
+                size_t skip = std::min(static_cast<size_t>(skip_size_), available);
+                pos_ += skip;
+                skip_size_ -= skip;
+                if (skip_size_) return true;
+                state_ = State::Magic;
+                break;
+            }
+        }
+    }
+}
+
+bool Lz4Decompressor::ParseFrameHeader(const char* p, size_t header_size) {
+    uint8_t flags = p[0];
+    uint8_t bd = p[1];
+    if ((flags >> 6) != 1) {
+        LOG(ERROR) << "unsupported lz4 frame version " << (flags >> 6);
+        return false;
+    }
+    if (flags & 0x01) {
+        LOG(ERROR) << "lz4 frames with a preset dictionary are not supported";
+        return false;
+    }
+    int block_max = (bd >> 4) & 0x7;
+    if (block_max < 4) {
+        LOG(ERROR) << "invalid lz4 block maximum size " << block_max;
+        return false;
+    }
+    // 4 => 64KiB, 5 => 256KiB, 6 => 1MiB, 7 => 4MiB.
+    block_max_size_ = size_t(1) << (8 + 2 * block_max);
+    flags_ = flags;
+    dict_.clear();
+    pos_ += header_size;
+    state_ = State::BlockSize;
+    return true;
+}
+
+bool Lz4Decompressor::DecodeBlock(const char* data, size_t length, bool compressed) {
+    bool independent = flags_ & 0x20;
+    if (independent) {
+        std::vector<char> input(data, data + length);
+        size_t capacity = block_max_size_;
+        auto task = [input = std::move(input), capacity, compressed]() -> Block {
+            Block block{std::make_unique<char[]>(capacity), 0};
+            if (!compressed) {
+                memcpy(block.data.get(), input.data(), input.size());
+                block.size = input.size();
+            } else {
+                block.size = LZ4_decompress_safe(input.data(), block.data.get(), input.size(),
+                                                 capacity);
+            }
+            return block;
+        };
+        std::packaged_task<Block()> job(std::move(task));
+        in_flight_.emplace_back(job.get_future());
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            queue_.emplace_back(std::move(job));
+        }
+        cv_.notify_one();
+        while (workers_.size() < num_workers_) {
+            workers_.emplace_back([this]() { Worker(); });
+        }
+        return DrainInFlight(max_in_flight_);
+    }
+
+    // Dependent blocks must be decompressed in order; flush any independent
+    // blocks still in flight first (a new frame may have started).
+    if (!DrainInFlight(0)) {
+        return false;
+    }
+    auto output = std::make_unique<char[]>(block_max_size_);
+    int size;
+    if (!compressed) {
+        memcpy(output.get(), data, length);
+        size = length;
+    } else {
+        size = LZ4_decompress_safe_usingDict(data, output.get(), length, block_max_size_,
+                                             dict_.data(), dict_.size());
+    }
+    if (size < 0) {
+        LOG(ERROR) << "lz4 block is corrupt";
+        return false;
+    }
+    // Blocks may be shorter than the 64KiB window, e.g. when the compressor
+    // was flushed, so earlier output stays in the dictionary.
+    dict_.insert(dict_.end(), output.get(), output.get() + size);
+    if (dict_.size() > kDictSize) {
+        dict_.erase(dict_.begin(), dict_.end() - kDictSize);
+    }
+    return Emit(output.get(), size);
+}
+
+bool Lz4Decompressor::DrainInFlight(size_t max_in_flight) {
+    while (in_flight_.size() > max_in_flight) {
+        Block block = in_flight_.front().get();
+        in_flight_.pop_front();
+        if (block.size < 0) {
+            LOG(ERROR) << "lz4 block is corrupt";
+            return false;
+        }
+        if (!Emit(block.data.get(), block.size)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Lz4Decompressor::Emit(const char* data, size_t length) {
+    return !length || sink_(data, length);
+}
+
+bool Lz4Decompressor::Finish() {
+    if (!DrainInFlight(0)) {
+        return false;
+    }
+    if (state_ != State::Magic || pos_ != pending_.size()) {
+        LOG(ERROR) << "lz4 stream is truncated";
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<Decompressor> Decompressor::Create(Compression compression, Sink sink) {
+    switch (compression) {
+        case Compression::Gzip: {
+            auto decompressor = std::make_unique<GzipDecompressor>(std::move(sink));
+            if (!decompressor->Init()) {
+                return nullptr;
+            }
+            return decompressor;
+        }
+        case Compression::Lz4:
+            return std::make_unique<Lz4Decompressor>(std::move(sink));
+        default:
+            LOG(ERROR) << "unsupported compression " << static_cast<int>(compression);
+            return nullptr;
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <memory>
+
+namespace android {
+namespace gsi {
+
+// These values match the IGsiService.COMPRESSION_* constants.
+enum class Compression {
+    None = 0,
+    Gzip = 1,
+    Lz4 = 2,
+};
+
+// Incrementally decompresses a stream. Decompressed data is handed to the
+// sink in order, in pieces of at most a few MiB; returning false from the
+// sink aborts decompression.
+//
+// The optional block and content checksums of LZ4 frames are not verified.
+// Corrupt input is still caught by the decoder in most cases, and images are
+// checked as a whole by AVB, either at install time or by dm-verity.
+class Decompressor {
+  public:
+    using Sink = std::function<bool(const char* data, size_t length)>;
+
+    virtual ~Decompressor() = default;
+
+    // Returns nullptr if |compression| is not supported.
+    static std::unique_ptr<Decompressor> Create(Compression compression, Sink sink);
+
+    // Feed the next piece of compressed input.
+    virtual bool Feed(const char* data, size_t length) = 0;
+
+    // Called once all input has been fed. Fails if the input was truncated.
+    virtual bool Finish() = 0;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "directory_watcher.h"
+
+#include <errno.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+static constexpr uint32_t kDirMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE |
+                                     IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                     IN_MOVE_SELF;
+static constexpr uint32_t kSubdirMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+DirectoryWatcher::DirectoryWatcher(const std::string& dir) : dir_(dir) {
+    inotify_.reset(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+    if (!inotify_.ok()) {
+        PLOG(ERROR) << "inotify_init1";
+    }
+}
+
+bool DirectoryWatcher::Poll(uint64_t* generation) {
+    if (!inotify_.ok()) {
+        return false;
+    }
+    if (watch_ < 0) {
+        watch_ = inotify_add_watch(inotify_.get(), dir_.c_str(), kDirMask);
+        if (watch_ < 0) {
+            return false;
+        }
+        // Anything read before the watch existed may be stale.
+        generation_++;
+    }
+
+    // Events of our own writes are queued before the write returns, so
+    // draining the queue here is enough to see them.
+    alignas(struct inotify_event) char buffer[4096];
+    while (true) {
+        ssize_t n = TEMP_FAILURE_RETRY(read(inotify_.get(), buffer, sizeof(buffer)));
+        if (n < 0) {
+            if (errno == EAGAIN) {
+                break;
+            }
+            PLOG(ERROR) << "read inotify events";
+            return false;
+        }
+        generation_++;
+        for (ssize_t offset = 0; offset < n;) {
+            auto event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+            if (event->wd == watch_ && (event->mask & (IN_IGNORED | IN_MOVE_SELF))) {
+                // The directory went away. Watch it again once it is back.
+                inotify_rm_watch(inotify_.get(), watch_);
+                watch_ = -1;
+            }
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    *generation = generation_;
+    return watch_ >= 0;
+}
+
+void DirectoryWatcher::WatchSubdirectory(const std::string& path) {
+    if (inotify_.ok()) {
+        inotify_add_watch(inotify_.get(), path.c_str(), kSubdirMask);
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
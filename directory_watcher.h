@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+#include <android-base/unique_fd.h>
+
+namespace android {
+namespace gsi {
+
+// Tells, with inotify, whether anything in a directory has changed since it
+// was last asked. Changes made by this process are seen as soon as the call
+// making them returns, so cached state is never read back stale.
+//
+// Not thread-safe.
+class DirectoryWatcher final {
+  public:
+    explicit DirectoryWatcher(const std::string& dir);
+
+    // Sets |generation| to a number that changes whenever the directory, or
+    // a subdirectory passed to WatchSubdirectory, has changed since the last
+    // call. Returns false if changes cannot be tracked, for example because
+    // the directory does not exist yet. It is watched again on the next call.
+    bool Poll(uint64_t* generation);
+
+    // Also reports entries created, removed or renamed in |path|. Fails
+    // silently, since a missing subdirectory has no entries to miss.
+    void WatchSubdirectory(const std::string& path);
+
+  private:
+    std::string dir_;
+    android::base::unique_fd inotify_;
+    int watch_ = -1;
+    uint64_t generation_ = 0;
+};
+
+}  // namespace gsi
+}  // namespace android
@@ -28,6 +28,16 @@ static inline std::string MetadataDir(const std::string& dsu_slot) {
     return std::filesystem::path(DSU_METADATA_PREFIX) / dsu_slot;
 }
 
+// Progress of a partition install that can be resumed after gsid restarts.
+static constexpr char kCheckpointSuffix[] = ".checkpoint";
+
+static inline std::string CheckpointFile(const std::string& dsu_slot, const std::string& name) {
+    return std::filesystem::path(MetadataDir(dsu_slot)) / (name + kCheckpointSuffix);
+}
+
+// AVB public keys read from the images of a slot, in its metadata directory.
+static constexpr char kAvbKeysFile[] = "avb_keys";
+
 static constexpr char kDsuOneShotBootFile[] = DSU_METADATA_PREFIX "one_shot_boot";
 
 // This file can contain the following values:
@@ -17,8 +17,10 @@
 #include "gsi_service.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <linux/fs.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,6 +29,7 @@
 
 #include <array>
 #include <chrono>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -41,10 +44,9 @@
 #include <binder/LazyServiceRegistrar.h>
 #include <ext4_utils/ext4_utils.h>
 #include <fs_mgr.h>
-#include <libavb/libavb.h>
 #include <libdm/dm.h>
 #include <libfiemap/image_manager.h>
-#include <openssl/sha.h>
+#include <liblp/liblp.h>
 #include <private/android_filesystem_config.h>
 
 #include "file_paths.h"
@@ -72,15 +74,31 @@ static std::mutex sInstanceLock;
 // Default userdata image size.
 static constexpr int64_t kDefaultUserdataSize = int64_t(2) * 1024 * 1024 * 1024;
 
-static bool GetAvbPublicKeyFromFd(int fd, AvbPublicKey* dst);
-
-GsiService::GsiService() {
-    progress_ = {};
+// Threads running asynchronous calls. Jobs that need lock_ still run one at a
+// time, but the rest are not held up behind them. At most three run partition
+// writes, creates or wipes, so one is left for enable and remove.
+static constexpr size_t kNumJobWorkers = 4;
+
+GsiService::GsiService()
+    : progress_publisher_([this]() { return GetProgress(); }),
+      jobs_(kNumJobWorkers, INSTALL_ERROR_CANCELLED, [](bool busy) {
+          // gsid is a lazy service, and would otherwise exit once clients
+          // drop their references, even with jobs still writing images.
+          LazyServiceRegistrar::getInstance().forcePersist(busy);
+      }) {
+    ResetProgress();
 }
 
 void GsiService::Register() {
     auto lazyRegistrar = LazyServiceRegistrar::getInstance();
     android::sp<GsiService> service = new GsiService();
+    service->jobs_.Schedule(
+            "read avb keys", false,
+            [service]() -> int {
+                service->FillAvbKeyCache();
+                return INSTALL_OK;
+            },
+            {}, {});
     auto ret = lazyRegistrar.registerService(service, kGsiServiceName);
 
     if (ret != android::OK) {
@@ -122,6 +140,7 @@ int GsiService::SaveInstallation(const std::string& installation) {
 binder::Status GsiService::openInstall(const std::string& install_dir, int* _aidl_return) {
     ENFORCE_SYSTEM;
     std::lock_guard<std::mutex> guard(lock_);
+    std::lock_guard<std::shared_mutex> state_guard(state_lock_);
     if (IsGsiRunning()) {
         *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
         return binder::Status::ok();
@@ -131,8 +150,10 @@ binder::Status GsiService::openInstall(const std::string& install_dir, int* _aid
         *_aidl_return = status;
         return binder::Status::ok();
     }
+    install_stats_.Clear();
     std::string message;
     auto dsu_slot = GetDsuSlot(install_dir_);
+    avb_keys_.Invalidate(MetadataDir(dsu_slot));
     if (!RemoveFileIfExists(GetCompleteIndication(dsu_slot), &message)) {
         LOG(ERROR) << message;
     }
@@ -144,6 +165,7 @@ binder::Status GsiService::openInstall(const std::string& install_dir, int* _aid
 binder::Status GsiService::closeInstall(int* _aidl_return) {
     ENFORCE_SYSTEM;
     std::lock_guard<std::mutex> guard(lock_);
+    std::lock_guard<std::shared_mutex> state_guard(state_lock_);
     auto dsu_slot = GetDsuSlot(install_dir_);
     std::string file = GetCompleteIndication(dsu_slot);
     if (!WriteStringToFile("OK", file)) {
@@ -157,149 +179,495 @@ binder::Status GsiService::closeInstall(int* _aidl_return) {
 binder::Status GsiService::createPartition(const ::std::string& name, int64_t size, bool readOnly,
                                            int32_t* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::string install_dir;
+    uint64_t generation;
+    std::shared_ptr<PartitionInstaller> previous;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        if (install_dir_.empty()) {
+            PLOG(ERROR) << "open is required for createPartition";
+            *_aidl_return = INSTALL_ERROR_GENERIC;
+            return binder::Status::ok();
+        }
 
-    if (install_dir_.empty()) {
-        PLOG(ERROR) << "open is required for createPartition";
-        *_aidl_return = INSTALL_ERROR_GENERIC;
-        return binder::Status::ok();
+        // Do some precursor validation on the arguments before diving into the
+        // install process.
+        if (size % LP_SECTOR_SIZE) {
+            LOG(ERROR) << " size " << size << " is not a multiple of " << LP_SECTOR_SIZE;
+            *_aidl_return = INSTALL_ERROR_GENERIC;
+            return binder::Status::ok();
+        }
+
+        if (size == 0 && name == "userdata") {
+            size = kDefaultUserdataSize;
+        }
+        // Make sure a pending interrupted installation of this partition is
+        // cleaned up. Other partitions stay open.
+        previous = DetachInstaller(name);
+        install_dir = install_dir_;
+        generation = session_generation_;
+        ResetProgress();
+    }
+    FinishInstaller(std::move(previous));
+
+    // Preallocation can take a while, so other partitions are not held up by
+    // it. Read-only images are allocated in the background, and the installer
+    // is published while that runs.
+    auto installer = std::make_shared<PartitionInstaller>(this, install_dir, name,
+                                                          GetDsuSlot(install_dir), size, readOnly);
+    int status = installer->StartInstall();
+    if (status == INSTALL_OK) {
+        status = AddInstaller(std::move(installer), generation);
     }
+    *_aidl_return = status;
+    return binder::Status::ok();
+}
 
-    // Make sure a pending interrupted installations are cleaned up.
-    installer_ = nullptr;
+binder::Status GsiService::resumePartition(const ::std::string& name, int64_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    *_aidl_return = -1;
+    std::string install_dir;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        if (install_dir_.empty()) {
+            LOG(ERROR) << "open is required for resumePartition";
+            return binder::Status::ok();
+        }
+        if (access(CheckpointFile(GetDsuSlot(install_dir_), name).c_str(), F_OK) != 0) {
+            PLOG(ERROR) << "no install of " << name << " to resume";
+            return binder::Status::ok();
+        }
+        ResetProgress();
+        install_dir = install_dir_;
+        generation = session_generation_;
+    }
+
+    // The installer is still around if only the client went away. It may be
+    // busy with a commit, which is waited for without holding lock_.
+    int64_t offset;
+    int status = INSTALL_ERROR_GENERIC;
+    bool found = false;
+    if (auto installer = LockInstaller(name)) {
+        found = true;
+        status = installer->ResumeInstall(&offset);
+    }
+    if (found) {
+        std::unique_lock<std::mutex> guard(lock_);
+        if (status != INSTALL_OK) {
+            auto failed = DetachInstaller(name);
+            guard.unlock();
+            FinishInstaller(std::move(failed));
+            return binder::Status::ok();
+        }
+        if (installers_.count(name)) {
+            current_partition_ = name;
+            *_aidl_return = offset;
+        }
+        return binder::Status::ok();
+    }
 
-    // Do some precursor validation on the arguments before diving into the
-    // install process.
-    if (size % LP_SECTOR_SIZE) {
-        LOG(ERROR) << " size " << size << " is not a multiple of " << LP_SECTOR_SIZE;
-        *_aidl_return = INSTALL_ERROR_GENERIC;
+    auto installer = std::make_shared<PartitionInstaller>(this, install_dir, name,
+                                                          GetDsuSlot(install_dir), 0, true);
+    if (installer->ResumeInstall(&offset) != INSTALL_OK ||
+        AddInstaller(std::move(installer), generation) != INSTALL_OK) {
         return binder::Status::ok();
     }
+    *_aidl_return = offset;
+    return binder::Status::ok();
+}
 
-    if (size == 0 && name == "userdata") {
-        size = kDefaultUserdataSize;
+binder::Status GsiService::updatePartition(const ::std::string& name, int64_t size,
+                                           int32_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    *_aidl_return = INSTALL_ERROR_GENERIC;
+    std::string install_dir;
+    uint64_t generation;
+    std::shared_ptr<PartitionInstaller> previous;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        if (install_dir_.empty()) {
+            LOG(ERROR) << "open is required for updatePartition";
+            return binder::Status::ok();
+        }
+        previous = DetachInstaller(name);
+        install_dir = install_dir_;
+        generation = session_generation_;
+        ResetProgress();
     }
-    installer_ = std::make_unique<PartitionInstaller>(this, install_dir_, name,
-                                                      GetDsuSlot(install_dir_), size, readOnly);
-    progress_ = {};
-    int status = installer_->StartInstall();
-    if (status != INSTALL_OK) {
-        installer_ = nullptr;
+    FinishInstaller(std::move(previous));
+
+    auto installer = std::make_shared<PartitionInstaller>(this, install_dir, name,
+                                                          GetDsuSlot(install_dir), size, true);
+    int status = installer->StartUpdate();
+    if (status == INSTALL_OK) {
+        status = AddInstaller(std::move(installer), generation);
     }
     *_aidl_return = status;
     return binder::Status::ok();
 }
 
+// Makes a started installer available to other calls, and the current
+// partition. Fails if the install was cancelled or finished in the meantime.
+int GsiService::AddInstaller(std::shared_ptr<PartitionInstaller> installer, uint64_t generation) {
+    std::unique_lock<std::mutex> guard(lock_);
+
+    if (generation != session_generation_) {
+        LOG(ERROR) << "install ended while " << installer->name() << " was being opened";
+        return INSTALL_ERROR_GENERIC;
+    }
+    auto name = installer->name();
+    auto previous = DetachInstaller(name);
+    installers_[name] = std::move(installer);
+    num_installers_ = installers_.size();
+    current_partition_ = name;
+    guard.unlock();
+
+    FinishInstaller(std::move(previous));
+    return INSTALL_OK;
+}
+
+// Returns the installer for |name|, or for the current partition if |name|
+// is empty. Calls for a partition wait for each other, unless they are all
+// |shared|. lock_ is not held while waiting, so that a long commit to one
+// partition does not hold up the others.
+LockedInstaller GsiService::LockInstaller(const std::string& name, bool shared) {
+    std::shared_ptr<PartitionInstaller> installer;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+
+        auto iter = installers_.find(name.empty() ? current_partition_ : name);
+        if (iter == installers_.end()) {
+            return {};
+        }
+        installer = iter->second;
+    }
+    LockedInstaller locked(std::move(installer), shared);
+    if (locked->closed()) {
+        return {};
+    }
+    return locked;
+}
+
+// Takes the installer for |name| out of the install, if there is one, so that
+// no new call can use it. lock_ must be held.
+std::shared_ptr<PartitionInstaller> GsiService::DetachInstaller(const std::string& name) {
+    auto iter = installers_.find(name);
+    if (iter == installers_.end()) {
+        return {};
+    }
+    auto installer = std::move(iter->second);
+    installers_.erase(iter);
+    num_installers_ = installers_.size();
+    if (current_partition_ == name) {
+        current_partition_.clear();
+    }
+    // Calls still waiting for the installer drop it once they get the lock.
+    installer->MarkClosed();
+    return installer;
+}
+
+// Waits for calls using a detached installer to return, then finishes the
+// partition, or removes it if it is incomplete. This can take as long as a
+// commit in progress, so lock_ should not be held unless the install session
+// is ending anyway.
+void GsiService::FinishInstaller(std::shared_ptr<PartitionInstaller> installer) {
+    if (installer) {
+        PartitionInstaller::WaitForLastReference(installer);
+    }
+}
+
+// Closes the installer for |name|. lock_ must be held.
+void GsiService::CloseInstaller(const std::string& name) {
+    FinishInstaller(DetachInstaller(name));
+}
+
+// Ends the install session. lock_ must be held.
+void GsiService::CloseInstallers() {
+    session_generation_++;
+    while (!installers_.empty()) {
+        CloseInstaller(installers_.begin()->first);
+    }
+}
+
 binder::Status GsiService::commitGsiChunkFromStream(const android::os::ParcelFileDescriptor& stream,
                                                     int64_t bytes, bool* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    auto installer = LockInstaller();
+
+    if (!installer) {
+        *_aidl_return = false;
+        return binder::Status::ok();
+    }
+
+    *_aidl_return = installer->CommitGsiChunk(stream.get(), bytes);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::commitCompressedGsiChunkFromStream(
+        const android::os::ParcelFileDescriptor& stream, int64_t bytes, int32_t compression,
+        bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller();
+
+    if (!installer) {
+        *_aidl_return = false;
+        return binder::Status::ok();
+    }
+
+    *_aidl_return = installer->CommitCompressedGsiChunk(stream.get(), bytes,
+                                                        static_cast<Compression>(compression));
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::commitPartitionChunkFromStream(
+        const std::string& name, const android::os::ParcelFileDescriptor& stream, int64_t bytes,
+        int32_t compression, bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    *_aidl_return = CommitChunk(name, stream.get(), bytes, compression);
+    return binder::Status::ok();
+}
+
+bool GsiService::CommitChunk(const std::string& name, int stream_fd, int64_t bytes,
+                             int32_t compression) {
+    auto installer = LockInstaller(name);
 
-    if (!installer_) {
+    if (!installer) {
+        LOG(ERROR) << "partition " << name << " is not being installed";
+        return false;
+    }
+    return installer->CommitCompressedGsiChunk(stream_fd, bytes,
+                                               static_cast<Compression>(compression));
+}
+
+binder::Status GsiService::commitPartitionRangeFromStream(
+        const std::string& name, int64_t offset, const android::os::ParcelFileDescriptor& stream,
+        int64_t bytes, int32_t compression, bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller(name, true);
+
+    if (!installer) {
+        LOG(ERROR) << "partition " << name << " is not being installed";
         *_aidl_return = false;
         return binder::Status::ok();
     }
 
-    *_aidl_return = installer_->CommitGsiChunk(stream.get(), bytes);
+    *_aidl_return = installer->CommitGsiChunkAt(stream.get(), offset, bytes,
+                                                static_cast<Compression>(compression));
     return binder::Status::ok();
 }
 
 void GsiService::StartAsyncOperation(const std::string& step, int64_t total_bytes) {
     std::lock_guard<std::mutex> guard(progress_lock_);
 
-    progress_.step = step;
-    progress_.status = STATUS_WORKING;
-    progress_.bytes_processed = 0;
-    progress_.total_bytes = total_bytes;
+    progress_step_ = step;
+    progress_status_ = STATUS_WORKING;
+    progress_bytes_ = 0;
+    progress_total_ = total_bytes;
+    progress_publisher_.Notify();
+    JobScheduler::ReportProgress(0, total_bytes);
 }
 
-void GsiService::UpdateProgress(int status, int64_t bytes_processed) {
+void GsiService::StartBackgroundOperation(const std::string& step, int64_t total_bytes) {
     std::lock_guard<std::mutex> guard(progress_lock_);
+    if (progress_status_ == STATUS_WORKING) {
+        return;
+    }
+    progress_step_ = step;
+    progress_status_ = STATUS_WORKING;
+    progress_bytes_ = 0;
+    progress_total_ = total_bytes;
+    progress_publisher_.Notify();
+}
 
-    progress_.status = status;
+void GsiService::UpdateBackgroundProgress(const std::string& step, int status,
+                                          int64_t bytes_processed) {
+    std::lock_guard<std::mutex> guard(progress_lock_);
+    if (progress_step_ == step) {
+        UpdateProgress(status, bytes_processed);
+    }
+}
+
+// Called from the write path, so this never blocks. Pollers may see the
+// status and byte count of an update a little apart, which is harmless.
+void GsiService::UpdateProgress(int status, int64_t bytes_processed) {
     if (status == STATUS_COMPLETE) {
-        progress_.bytes_processed = progress_.total_bytes;
-    } else {
-        progress_.bytes_processed = bytes_processed;
+        bytes_processed = progress_total_.load(std::memory_order_relaxed);
     }
+    progress_bytes_.store(bytes_processed, std::memory_order_relaxed);
+    progress_status_.store(status, std::memory_order_release);
+    progress_publisher_.Notify();
+    JobScheduler::ReportProgress(bytes_processed, progress_total_.load(std::memory_order_relaxed));
+}
+
+void GsiService::ResetProgress() {
+    std::lock_guard<std::mutex> guard(progress_lock_);
+
+    progress_step_.clear();
+    progress_status_ = STATUS_NO_OPERATION;
+    progress_bytes_ = 0;
+    progress_total_ = 0;
 }
 
 binder::Status GsiService::getInstallProgress(::android::gsi::GsiProgress* _aidl_return) {
     ENFORCE_SYSTEM;
+    if (num_installers_ == 0) {
+        ResetProgress();
+    }
+    *_aidl_return = GetProgress();
+    return binder::Status::ok();
+}
+
+GsiProgress GsiService::GetProgress() {
     std::lock_guard<std::mutex> guard(progress_lock_);
 
-    if (installer_ == nullptr) {
-        progress_ = {};
+    GsiProgress progress;
+    progress.step = progress_step_;
+    progress.status = progress_status_.load(std::memory_order_acquire);
+    progress.bytes_processed = progress_bytes_.load(std::memory_order_relaxed);
+    progress.total_bytes = progress_total_;
+    return progress;
+}
+
+binder::Status GsiService::registerProgressCallback(const sp<IGsiProgressCallback>& callback) {
+    ENFORCE_SYSTEM;
+    if (!callback) {
+        return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_ARGUMENT,
+                                                 String8("callback is null"));
     }
-    *_aidl_return = progress_;
+    progress_publisher_.Register(callback);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::unregisterProgressCallback(const sp<IGsiProgressCallback>& callback) {
+    ENFORCE_SYSTEM;
+    if (callback) {
+        progress_publisher_.Unregister(callback);
+    }
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::getInstallStats(std::vector<GsiPhaseStats>* _aidl_return) {
+    ENFORCE_SYSTEM;
+    *_aidl_return = install_stats_.Get();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    auto installer = LockInstaller();
 
-    if (!installer_) {
+    if (!installer) {
         *_aidl_return = false;
         return binder::Status::ok();
     }
-    *_aidl_return = installer_->CommitGsiChunk(bytes);
+    *_aidl_return = installer->CommitGsiChunk(bytes);
     return binder::Status::ok();
 }
 
 binder::Status GsiService::setGsiAshmem(const ::android::os::ParcelFileDescriptor& ashmem,
                                         int64_t size, bool* _aidl_return) {
     ENFORCE_SYSTEM;
-    if (!installer_) {
+    auto installer = LockInstaller();
+
+    if (!installer) {
         *_aidl_return = false;
         return binder::Status::ok();
     }
-    *_aidl_return = installer_->MapAshmem(ashmem.get(), size);
+    *_aidl_return = installer->MapAshmem(ashmem.get(), size);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::setGsiAshmemRing(const ::android::os::ParcelFileDescriptor& ashmem,
+                                            int32_t slot_count, int64_t slot_size,
+                                            bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller();
+
+    if (!installer || slot_count <= 0 || slot_size <= 0) {
+        *_aidl_return = false;
+        return binder::Status::ok();
+    }
+    *_aidl_return = installer->MapAshmemRing(ashmem.get(), slot_count, slot_size);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::commitGsiChunksFromAshmemRing(bool* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller();
+
+    if (!installer) {
+        *_aidl_return = false;
+        return binder::Status::ok();
+    }
+    *_aidl_return = installer->CommitAshmemRing();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::enableGsiAsync(bool one_shot, const std::string& dsuSlot,
                                           const sp<IGsiServiceCallback>& resultCallback) {
-    int result;
-    auto status = enableGsi(one_shot, dsuSlot, &result);
-    if (!status.isOk()) {
-        LOG(ERROR) << "Could not enableGsi: " << status.exceptionMessage().string();
-        result = IGsiService::INSTALL_ERROR_GENERIC;
-    }
-    resultCallback->onResult(result);
+    if (!resultCallback) {
+        return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_ARGUMENT,
+                                                 String8("callback is null"));
+    }
+    auto work = [this, one_shot, dsuSlot]() -> int {
+        int result;
+        auto status = enableGsi(one_shot, dsuSlot, &result);
+        if (!status.isOk()) {
+            LOG(ERROR) << "Could not enableGsi: " << status.exceptionMessage().string();
+            result = IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        return result;
+    };
+    jobs_.Schedule("enable " + dsuSlot, false, work, {},
+                   [resultCallback](int64_t, int result) { resultCallback->onResult(result); });
     return binder::Status::ok();
 }
 
 binder::Status GsiService::enableGsi(bool one_shot, const std::string& dsuSlot, int* _aidl_return) {
     std::lock_guard<std::mutex> guard(lock_);
 
-    if (!WriteStringToFile(dsuSlot, kDsuActiveFile)) {
-        PLOG(ERROR) << "write failed: " << GetDsuSlot(install_dir_);
-        *_aidl_return = INSTALL_ERROR_GENERIC;
-        return binder::Status::ok();
-    }
-    if (installer_) {
+    if (!installers_.empty()) {
         ENFORCE_SYSTEM;
-        installer_ = {};
+        // Finishing the partitions can take a while; queries keep seeing the
+        // previous state until the new one is written below.
+        CloseInstallers();
+        std::lock_guard<std::shared_mutex> state_guard(state_lock_);
         // Note: create the install status file last, since this is the actual boot
         // indicator.
-        if (!SetBootMode(one_shot) || !CreateInstallStatusFile()) {
+        if (!WriteActiveDsu(dsuSlot) || !SetBootMode(one_shot) || !CreateInstallStatusFile()) {
             *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
         } else {
             *_aidl_return = INSTALL_OK;
         }
     } else {
         ENFORCE_SYSTEM_OR_SHELL;
-        *_aidl_return = ReenableGsi(one_shot);
+        std::lock_guard<std::shared_mutex> state_guard(state_lock_);
+        if (!WriteActiveDsu(dsuSlot)) {
+            *_aidl_return = IGsiService::INSTALL_ERROR_GENERIC;
+        } else {
+            *_aidl_return = ReenableGsi(one_shot);
+        }
     }
 
-    installer_ = nullptr;
+    CloseInstallers();
     return binder::Status::ok();
 }
 
+bool GsiService::WriteActiveDsu(const std::string& dsu_slot) {
+    if (!WriteStringToFile(dsu_slot, kDsuActiveFile)) {
+        PLOG(ERROR) << "write failed: " << kDsuActiveFile;
+        return false;
+    }
+    return true;
+}
+
 binder::Status GsiService::isGsiEnabled(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::shared_lock<std::shared_mutex> state_guard(state_lock_);
     std::string boot_key;
     if (!GetInstallStatus(&boot_key)) {
         *_aidl_return = false;
@@ -310,13 +678,21 @@ binder::Status GsiService::isGsiEnabled(bool* _aidl_return) {
 }
 
 binder::Status GsiService::removeGsiAsync(const sp<IGsiServiceCallback>& resultCallback) {
-    bool result;
-    auto status = removeGsi(&result);
-    if (!status.isOk()) {
-        LOG(ERROR) << "Could not removeGsi: " << status.exceptionMessage().string();
-        result = IGsiService::INSTALL_ERROR_GENERIC;
-    }
-    resultCallback->onResult(result);
+    if (!resultCallback) {
+        return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_ARGUMENT,
+                                                 String8("callback is null"));
+    }
+    auto work = [this]() -> int {
+        bool result;
+        auto status = removeGsi(&result);
+        if (!status.isOk()) {
+            LOG(ERROR) << "Could not removeGsi: " << status.exceptionMessage().string();
+            result = IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        return result;
+    };
+    jobs_.Schedule("remove", false, work, {},
+                   [resultCallback](int64_t, int result) { resultCallback->onResult(result); });
     return binder::Status::ok();
 }
 
@@ -325,11 +701,14 @@ binder::Status GsiService::removeGsi(bool* _aidl_return) {
     std::lock_guard<std::mutex> guard(lock_);
 
     std::string install_dir = GetActiveInstalledImageDir();
+    avb_keys_.Invalidate(MetadataDir(GetDsuSlot(install_dir)));
     if (IsGsiRunning()) {
         // Can't remove gsi files while running.
+        std::lock_guard<std::shared_mutex> state_guard(state_lock_);
         *_aidl_return = UninstallGsi();
     } else {
-        installer_ = {};
+        CloseInstallers();
+        std::lock_guard<std::shared_mutex> state_guard(state_lock_);
         *_aidl_return = RemoveGsiFiles(install_dir);
     }
     return binder::Status::ok();
@@ -338,6 +717,7 @@ binder::Status GsiService::removeGsi(bool* _aidl_return) {
 binder::Status GsiService::disableGsi(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
     std::lock_guard<std::mutex> guard(lock_);
+    std::lock_guard<std::shared_mutex> state_guard(state_lock_);
 
     *_aidl_return = DisableGsiInstall();
     return binder::Status::ok();
@@ -345,7 +725,7 @@ binder::Status GsiService::disableGsi(bool* _aidl_return) {
 
 binder::Status GsiService::isGsiRunning(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::shared_lock<std::shared_mutex> state_guard(state_lock_);
 
     *_aidl_return = IsGsiRunning();
     return binder::Status::ok();
@@ -353,7 +733,7 @@ binder::Status GsiService::isGsiRunning(bool* _aidl_return) {
 
 binder::Status GsiService::isGsiInstalled(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::shared_lock<std::shared_mutex> state_guard(state_lock_);
 
     *_aidl_return = IsGsiInstalled();
     return binder::Status::ok();
@@ -361,9 +741,8 @@ binder::Status GsiService::isGsiInstalled(bool* _aidl_return) {
 
 binder::Status GsiService::isGsiInstallInProgress(bool* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
 
-    *_aidl_return = !!installer_;
+    *_aidl_return = num_installers_ > 0;
     return binder::Status::ok();
 }
 
@@ -372,8 +751,8 @@ binder::Status GsiService::cancelGsiInstall(bool* _aidl_return) {
     should_abort_ = true;
     std::lock_guard<std::mutex> guard(lock_);
 
+    CloseInstallers();
     should_abort_ = false;
-    installer_ = nullptr;
 
     *_aidl_return = true;
     return binder::Status::ok();
@@ -381,15 +760,17 @@ binder::Status GsiService::cancelGsiInstall(bool* _aidl_return) {
 
 binder::Status GsiService::getInstalledGsiImageDir(std::string* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::shared_lock<std::shared_mutex> state_guard(state_lock_);
 
-    *_aidl_return = GetActiveInstalledImageDir();
+    // Installers are all opened in install_dir_, so this matches
+    // GetActiveInstalledImageDir() without looking at installers_.
+    *_aidl_return = num_installers_ > 0 ? install_dir_ : GetInstalledImageDir();
     return binder::Status::ok();
 }
 
 binder::Status GsiService::getActiveDsuSlot(std::string* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::shared_lock<std::shared_mutex> state_guard(state_lock_);
 
     *_aidl_return = GetActiveDsuSlot();
     return binder::Status::ok();
@@ -397,12 +778,162 @@ binder::Status GsiService::getActiveDsuSlot(std::string* _aidl_return) {
 
 binder::Status GsiService::getInstalledDsuSlots(std::vector<std::string>* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    std::shared_lock<std::shared_mutex> state_guard(state_lock_);
     *_aidl_return = GetInstalledDsuSlots();
     return binder::Status::ok();
 }
 
+// Lists the images of |dsu_slot| from its image metadata, in one read.
+static std::vector<GsiImageStatus> GetSlotImages(const std::string& dsu_slot,
+                                                 const std::set<std::string>& mapped) {
+    std::vector<GsiImageStatus> images;
+    auto metadata = ReadFromImageFile(DsuLpMetadataFile(dsu_slot));
+    if (!metadata) {
+        return images;
+    }
+    for (const auto& partition : metadata->partitions) {
+        GsiImageStatus image;
+        image.name = GetPartitionName(partition);
+        image.size = GetPartitionSize(*metadata.get(), partition);
+        image.mapped = mapped.count(image.name) > 0;
+        image.disabled = (partition.attributes & LP_PARTITION_ATTR_DISABLED) != 0;
+        images.emplace_back(std::move(image));
+    }
+    return images;
+}
+
+binder::Status GsiService::getStatus(GsiStatus* _aidl_return) {
+    ENFORCE_SYSTEM_OR_SHELL;
+    bool list_slots = CheckUid().isOk();
+
+    {
+        std::shared_lock<std::shared_mutex> state_guard(state_lock_);
+
+        _aidl_return->running = IsGsiRunning();
+        _aidl_return->installed = IsGsiInstalled();
+        std::string boot_key;
+        _aidl_return->enabled =
+                GetInstallStatus(&boot_key) && boot_key != kInstallStatusDisabled;
+        _aidl_return->install_in_progress = num_installers_ > 0;
+        _aidl_return->active_slot = GetActiveDsuSlot();
+        if (!list_slots) {
+            return binder::Status::ok();
+        }
+        for (const auto& dsu_slot : GetInstalledDsuSlots()) {
+            GsiSlotStatus slot;
+            slot.name = dsu_slot;
+            ReadFileToString(DsuInstallDirFile(dsu_slot), &slot.install_dir);
+            slot.complete = IsInstallationComplete(dsu_slot);
+            _aidl_return->slots.emplace_back(std::move(slot));
+        }
+    }
+
+    // A single device-mapper listing tells which images of every slot are
+    // mapped.
+    std::set<std::string> mapped;
+    std::vector<DeviceMapper::DmBlockDevice> devices;
+    if (DeviceMapper::Instance().GetAvailableDevices(&devices)) {
+        for (const auto& device : devices) {
+            mapped.emplace(device.name());
+        }
+    }
+
+    {
+        std::shared_lock<std::shared_mutex> images_guard(images_lock_);
+        for (auto& slot : _aidl_return->slots) {
+            slot.images = GetSlotImages(slot.name, mapped);
+        }
+    }
+    for (auto& slot : _aidl_return->slots) {
+        GetAvbKeyDigests(&slot);
+    }
+    return binder::Status::ok();
+}
+
+// Reads the AVB key of |name|, mapping the image if it is not mapped, and
+// remembers it in |keys|. Returns false if the image could not be read at
+// all, and sets |ok| to whether it had a valid key. Called with lock_,
+// images_lock_ and PartitionInstaller::metadata_lock() held, since mapping
+// and unmapping rewrite the ImageManager metadata.
+static bool ReadAvbKey(IImageManager* manager, AvbKeyCache* keys, const std::string& metadata_dir,
+                       const std::string& name, bool* ok, AvbPublicKey* key) {
+    uint64_t generation = keys->Generation(metadata_dir, name);
+    std::string device_path;
+    std::unique_ptr<MappedDevice> mapped_device;
+    if (!manager->IsImageMapped(name)) {
+        mapped_device = MappedDevice::Open(manager, 10s, name);
+        if (!mapped_device) {
+            PLOG(ERROR) << "Fail to map image: " << name;
+            return false;
+        }
+        device_path = mapped_device->path();
+    } else if (!manager->GetMappedImageDevice(name, &device_path)) {
+        PLOG(ERROR) << "GetMappedImageDevice() failed";
+        return false;
+    }
+    unique_fd fd(open(device_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.ok()) {
+        PLOG(ERROR) << "Fail to open mapped device: " << device_path;
+        return false;
+    }
+    *ok = GetAvbPublicKeyFromFd(fd.get(), key);
+    keys->Put(metadata_dir, name, generation, *ok, *key);
+    return true;
+}
+
+// Fills in the AVB key digests of the images of |slot| from the key cache. A
+// status query never maps images or waits on lock_ for this; images whose key
+// has not been read yet have no digest.
+void GsiService::GetAvbKeyDigests(GsiSlotStatus* slot) {
+    auto metadata_dir = MetadataDir(slot->name);
+    for (auto& image : slot->images) {
+        bool ok;
+        AvbPublicKey key;
+        if (avb_keys_.Get(metadata_dir, image.name, &ok, &key)) {
+            image.avb_public_key_sha1 = key.sha1;
+        }
+    }
+}
+
+// Reads the keys of images installed before gsid kept them. Keys of new images
+// are read when they finish installing, so this only runs once, at startup.
+void GsiService::FillAvbKeyCache() {
+    std::lock_guard<std::mutex> guard(lock_);
+    std::lock_guard<std::shared_mutex> images_guard(images_lock_);
+    // Partitions of a new install are allocated without lock_.
+    std::lock_guard<std::mutex> metadata_guard(PartitionInstaller::metadata_lock());
+
+    for (const auto& dsu_slot : GetInstalledDsuSlots()) {
+        // Images being written have no key yet.
+        if (!installers_.empty() && GetDsuSlot(install_dir_) == dsu_slot) {
+            continue;
+        }
+        auto metadata_dir = MetadataDir(dsu_slot);
+        std::string install_dir;
+        ReadFileToString(DsuInstallDirFile(dsu_slot), &install_dir);
+        if (install_dir.empty()) {
+            install_dir = kDefaultDsuImageFolder + dsu_slot + "/";
+        }
+        std::unique_ptr<ImageManager> manager;
+        for (const auto& image : GetSlotImages(dsu_slot, {})) {
+            bool ok;
+            AvbPublicKey key;
+            if (image.disabled || avb_keys_.Get(metadata_dir, image.name, &ok, &key)) {
+                continue;
+            }
+            if (!manager && !(manager = ImageManager::Open(metadata_dir, install_dir))) {
+                break;
+            }
+            ReadAvbKey(manager.get(), &avb_keys_, metadata_dir, image.name, &ok, &key);
+        }
+    }
+}
+
 binder::Status GsiService::zeroPartition(const std::string& name, int* _aidl_return) {
+    return wipePartition(name, false, _aidl_return);
+}
+
+binder::Status GsiService::wipePartition(const std::string& name, bool full, int* _aidl_return) {
     ENFORCE_SYSTEM_OR_SHELL;
     std::lock_guard<std::mutex> guard(lock_);
 
@@ -412,8 +943,99 @@ binder::Status GsiService::zeroPartition(const std::string& name, int* _aidl_ret
     }
 
     std::string install_dir = GetActiveInstalledImageDir();
-    *_aidl_return = PartitionInstaller::WipeWritable(GetDsuSlot(install_dir), install_dir, name);
+    avb_keys_.Invalidate(MetadataDir(GetDsuSlot(install_dir)), name);
+    PartitionInstaller::WipeProgress on_progress;
+    bool started = false;
+    if (full) {
+        on_progress = [&](uint64_t bytes, uint64_t total) -> bool {
+            if (!started) {
+                StartAsyncOperation("wipe " + name, total);
+                started = true;
+            }
+            UpdateProgress(STATUS_WORKING, bytes);
+            return !JobScheduler::Cancelled();
+        };
+    }
+    *_aidl_return = PartitionInstaller::WipeWritable(GetDsuSlot(install_dir), install_dir, name,
+                                                     full, on_progress);
+    if (started) {
+        UpdateProgress(*_aidl_return == IGsiService::INSTALL_OK ? STATUS_COMPLETE
+                                                                : STATUS_NO_OPERATION,
+                       0);
+    }
+    return binder::Status::ok();
+}
+
+// Runs |work| as a job, and sends its progress and result to |callback|.
+// Jobs that fail after being cancelled complete with INSTALL_ERROR_CANCELLED.
+int64_t GsiService::ScheduleJob(const std::string& name, JobScheduler::Work work,
+                                const sp<IGsiJobCallback>& callback) {
+    auto wrapped = [work]() -> int {
+        int result = work();
+        if (result != INSTALL_OK && JobScheduler::Cancelled()) {
+            return INSTALL_ERROR_CANCELLED;
+        }
+        return result;
+    };
+    JobScheduler::ProgressCallback on_progress;
+    JobScheduler::CompletionCallback on_complete;
+    if (callback) {
+        on_progress = [callback](int64_t id, uint64_t current, uint64_t total) {
+            callback->onProgress(id, static_cast<int64_t>(current), static_cast<int64_t>(total));
+        };
+        on_complete = [callback](int64_t id, int result) { callback->onComplete(id, result); };
+    }
+    return jobs_.Schedule(name, true, wrapped, on_progress, on_complete);
+}
+
+binder::Status GsiService::createPartitionAsync(const std::string& name, int64_t size,
+                                                bool readOnly, const sp<IGsiJobCallback>& callback,
+                                                int64_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto work = [this, name, size, readOnly]() -> int {
+        int result;
+        auto status = createPartition(name, size, readOnly, &result);
+        return status.isOk() ? result : INSTALL_ERROR_GENERIC;
+    };
+    *_aidl_return = ScheduleJob("create " + name, work, callback);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::commitPartitionChunkAsync(
+        const std::string& name, const android::os::ParcelFileDescriptor& stream, int64_t bytes,
+        int32_t compression, const sp<IGsiJobCallback>& callback, int64_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    // The descriptor of the call is closed when it returns.
+    auto fd = std::make_shared<unique_fd>(fcntl(stream.get(), F_DUPFD_CLOEXEC, 0));
+    if (*fd < 0) {
+        PLOG(ERROR) << "dup stream";
+        return binder::Status::fromExceptionCode(binder::Status::EX_ILLEGAL_ARGUMENT,
+                                                 String8("bad stream"));
+    }
+    auto work = [this, name, fd, bytes, compression]() -> int {
+        return CommitChunk(name, fd->get(), bytes, compression) ? INSTALL_OK
+                                                                 : INSTALL_ERROR_GENERIC;
+    };
+    *_aidl_return = ScheduleJob("write " + name, work, callback);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::wipePartitionAsync(const std::string& name, bool full,
+                                              const sp<IGsiJobCallback>& callback,
+                                              int64_t* _aidl_return) {
+    ENFORCE_SYSTEM_OR_SHELL;
+    auto work = [this, name, full]() -> int {
+        int result;
+        auto status = wipePartition(name, full, &result);
+        return status.isOk() ? result : INSTALL_ERROR_GENERIC;
+    };
+    *_aidl_return = ScheduleJob("wipe " + name, work, callback);
+    return binder::Status::ok();
+}
 
+binder::Status GsiService::cancelJob(int64_t job_id, bool* _aidl_return) {
+    ENFORCE_SYSTEM_OR_SHELL;
+    *_aidl_return = jobs_.Cancel(job_id);
     return binder::Status::ok();
 }
 
@@ -456,13 +1078,13 @@ binder::Status GsiService::dumpDeviceMapperDevices(std::string* _aidl_return) {
 
 binder::Status GsiService::getAvbPublicKey(AvbPublicKey* dst, int32_t* _aidl_return) {
     ENFORCE_SYSTEM;
-    std::lock_guard<std::mutex> guard(lock_);
+    auto installer = LockInstaller();
 
-    if (!installer_) {
+    if (!installer) {
         *_aidl_return = INSTALL_ERROR_GENERIC;
         return binder::Status::ok();
     }
-    int fd = installer_->GetPartitionFd();
+    int fd = installer->GetPartitionFd();
     if (!GetAvbPublicKeyFromFd(fd, dst)) {
         LOG(ERROR) << "Failed to extract AVB public key";
         *_aidl_return = INSTALL_ERROR_GENERIC;
@@ -472,6 +1094,45 @@ binder::Status GsiService::getAvbPublicKey(AvbPublicKey* dst, int32_t* _aidl_ret
     return binder::Status::ok();
 }
 
+binder::Status GsiService::enablePartitionDigest(const std::vector<uint8_t>& expectedSha256,
+                                                 int32_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller();
+
+    if (!installer) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    *_aidl_return = installer->EnableDigest(expectedSha256);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::getPartitionDigest(std::vector<uint8_t>* sha256,
+                                              int32_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller();
+
+    if (!installer) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    *_aidl_return = installer->GetDigest(sha256);
+    return binder::Status::ok();
+}
+
+binder::Status GsiService::enablePartitionVerification(const std::vector<uint8_t>& vbmeta,
+                                                       int32_t* _aidl_return) {
+    ENFORCE_SYSTEM;
+    auto installer = LockInstaller();
+
+    if (!installer) {
+        *_aidl_return = INSTALL_ERROR_GENERIC;
+        return binder::Status::ok();
+    }
+    *_aidl_return = installer->EnableVerification(vbmeta);
+    return binder::Status::ok();
+}
+
 bool GsiService::CreateInstallStatusFile() {
     if (!android::base::WriteStringToFile("0", kDsuInstallStatusFile)) {
         PLOG(ERROR) << "write " << kDsuInstallStatusFile;
@@ -505,7 +1166,8 @@ static binder::Status UidSecurityError() {
 
 class ImageService : public BinderService<ImageService>, public BnImageService {
   public:
-    ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl, uid_t uid);
+    ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl,
+                 const std::string& metadata_dir, uid_t uid);
     binder::Status getAllBackingImages(std::vector<std::string>* _aidl_return);
     binder::Status createBackingImage(const std::string& name, int64_t size, int flags,
                                       const sp<IProgressCallback>& on_progress) override;
@@ -527,11 +1189,13 @@ class ImageService : public BinderService<ImageService>, public BnImageService {
 
     android::sp<GsiService> service_;
     std::unique_ptr<ImageManager> impl_;
+    std::string metadata_dir_;
     uid_t uid_;
 };
 
-ImageService::ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl, uid_t uid)
-    : service_(service), impl_(std::move(impl)), uid_(uid) {}
+ImageService::ImageService(GsiService* service, std::unique_ptr<ImageManager>&& impl,
+                           const std::string& metadata_dir, uid_t uid)
+    : service_(service), impl_(std::move(impl)), metadata_dir_(metadata_dir), uid_(uid) {}
 
 binder::Status ImageService::getAllBackingImages(std::vector<std::string>* _aidl_return) {
     *_aidl_return = impl_->GetAllBackingImages();
@@ -543,6 +1207,8 @@ binder::Status ImageService::createBackingImage(const std::string& name, int64_t
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+    service_->avb_keys()->Invalidate(metadata_dir_, name);
 
     std::function<bool(uint64_t, uint64_t)> callback;
     if (on_progress) {
@@ -568,6 +1234,8 @@ binder::Status ImageService::deleteBackingImage(const std::string& name) {
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+    service_->avb_keys()->Invalidate(metadata_dir_, name);
 
     if (!impl_->DeleteBackingImage(name)) {
         return BinderError("Failed to delete");
@@ -580,6 +1248,9 @@ binder::Status ImageService::mapImageDevice(const std::string& name, int32_t tim
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+    // The client may write to the device.
+    service_->avb_keys()->Invalidate(metadata_dir_, name);
 
     if (!impl_->MapImageDevice(name, std::chrono::milliseconds(timeout_ms), &mapping->path)) {
         return BinderError("Failed to map");
@@ -591,6 +1262,7 @@ binder::Status ImageService::unmapImageDevice(const std::string& name) {
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
 
     if (!impl_->UnmapImageDevice(name)) {
         return BinderError("Failed to unmap");
@@ -601,7 +1273,7 @@ binder::Status ImageService::unmapImageDevice(const std::string& name) {
 binder::Status ImageService::backingImageExists(const std::string& name, bool* _aidl_return) {
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    std::shared_lock<std::shared_mutex> images_guard(service_->images_lock_);
 
     *_aidl_return = impl_->BackingImageExists(name);
     return binder::Status::ok();
@@ -610,7 +1282,7 @@ binder::Status ImageService::backingImageExists(const std::string& name, bool* _
 binder::Status ImageService::isImageMapped(const std::string& name, bool* _aidl_return) {
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    std::shared_lock<std::shared_mutex> images_guard(service_->images_lock_);
 
     *_aidl_return = impl_->IsImageMapped(name);
     return binder::Status::ok();
@@ -620,33 +1292,17 @@ binder::Status ImageService::getAvbPublicKey(const std::string& name, AvbPublicK
                                              int32_t* _aidl_return) {
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
-
-    std::string device_path;
-    std::unique_ptr<MappedDevice> mapped_device;
-    if (!impl_->IsImageMapped(name)) {
-        mapped_device = MappedDevice::Open(impl_.get(), 10s, name);
-        if (!mapped_device) {
-            PLOG(ERROR) << "Fail to map image: " << name;
-            *_aidl_return = IMAGE_ERROR;
-            return binder::Status::ok();
-        }
-        device_path = mapped_device->path();
-    } else {
-        if (!impl_->GetMappedImageDevice(name, &device_path)) {
-            PLOG(ERROR) << "GetMappedImageDevice() failed";
+    // Keys are kept once read, so most calls do not map the image.
+    bool ok;
+    if (!service_->avb_keys()->Get(metadata_dir_, name, &ok, dst)) {
+        std::lock_guard<std::mutex> guard(service_->lock());
+        std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+        std::lock_guard<std::mutex> metadata_guard(PartitionInstaller::metadata_lock());
+        if (!ReadAvbKey(impl_.get(), service_->avb_keys(), metadata_dir_, name, &ok, dst)) {
             *_aidl_return = IMAGE_ERROR;
             return binder::Status::ok();
         }
     }
-    android::base::unique_fd fd(open(device_path.c_str(), O_RDONLY | O_CLOEXEC));
-    if (!fd.ok()) {
-        PLOG(ERROR) << "Fail to open mapped device: " << device_path;
-        *_aidl_return = IMAGE_ERROR;
-        return binder::Status::ok();
-    }
-    bool ok = GetAvbPublicKeyFromFd(fd.get(), dst);
-    fd = {};
     if (!ok) {
         LOG(ERROR) << "Failed to extract AVB public key";
         *_aidl_return = IMAGE_ERROR;
@@ -660,6 +1316,8 @@ binder::Status ImageService::zeroFillNewImage(const std::string& name, int64_t b
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+    service_->avb_keys()->Invalidate(metadata_dir_, name);
 
     if (bytes < 0) {
         return BinderError("Cannot use negative values");
@@ -675,6 +1333,8 @@ binder::Status ImageService::removeAllImages() {
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+    service_->avb_keys()->Invalidate(metadata_dir_);
     if (!impl_->RemoveAllImages()) {
         return BinderError("Failed to remove all images");
     }
@@ -685,6 +1345,8 @@ binder::Status ImageService::removeDisabledImages() {
     if (!CheckUid()) return UidSecurityError();
 
     std::lock_guard<std::mutex> guard(service_->lock());
+    std::lock_guard<std::shared_mutex> images_guard(service_->images_lock_);
+    service_->avb_keys()->Invalidate(metadata_dir_);
     if (!impl_->RemoveDisabledImages()) {
         return BinderError("Failed to remove disabled images");
     }
@@ -694,7 +1356,7 @@ binder::Status ImageService::removeDisabledImages() {
 binder::Status ImageService::getMappedImageDevice(const std::string& name, std::string* device) {
     if (!CheckUid()) return UidSecurityError();
 
-    std::lock_guard<std::mutex> guard(service_->lock());
+    std::shared_lock<std::shared_mutex> images_guard(service_->images_lock_);
     if (!impl_->GetMappedImageDevice(name, device)) {
         *device = "";
     }
@@ -743,7 +1405,7 @@ binder::Status GsiService::openImageService(const std::string& prefix,
         return BinderError("Unknown error");
     }
 
-    *_aidl_return = new ImageService(this, std::move(impl), uid);
+    *_aidl_return = new ImageService(this, std::move(impl), metadata_dir, uid);
     return binder::Status::ok();
 }
 
@@ -833,8 +1495,8 @@ std::string GsiService::GetActiveDsuSlot() {
 
 std::string GsiService::GetActiveInstalledImageDir() {
     // Just in case an install was left hanging.
-    if (installer_) {
-        return installer_->install_dir();
+    if (!installers_.empty()) {
+        return installers_.begin()->second->install_dir();
     } else {
         return GetInstalledImageDir();
     }
@@ -881,6 +1543,7 @@ int GsiService::ReenableGsi(bool one_shot) {
 bool GsiService::RemoveGsiFiles(const std::string& install_dir) {
     bool ok = true;
     auto active_dsu = GetDsuSlot(install_dir);
+    std::lock_guard<std::mutex> metadata_guard(PartitionInstaller::metadata_lock());
     if (auto manager = ImageManager::Open(MetadataDir(active_dsu), install_dir)) {
         std::vector<std::string> images = manager->GetAllBackingImages();
         for (auto&& image : images) {
@@ -891,6 +1554,13 @@ bool GsiService::RemoveGsiFiles(const std::string& install_dir) {
                 ok &= manager->UnmapImageDevice(image);
             }
             ok &= manager->DeleteBackingImage(image);
+
+            std::string message;
+            auto name = image.substr(0, image.size() - strlen(kDsuPostfix));
+            if (!RemoveFileIfExists(CheckpointFile(active_dsu, name), &message)) {
+                LOG(ERROR) << message;
+                ok = false;
+            }
         }
     }
     auto dsu_slot = GetDsuSlot(install_dir);
@@ -918,7 +1588,7 @@ bool GsiService::DisableGsiInstall() {
         LOG(ERROR) << "cannot disable gsi install - no install detected";
         return false;
     }
-    if (installer_) {
+    if (!installers_.empty()) {
         LOG(ERROR) << "cannot disable gsi during GSI installation";
         return false;
     }
@@ -945,29 +1615,12 @@ bool GsiService::IsInstallationComplete(const std::string& dsu_slot) {
     return content == "OK";
 }
 
-std::vector<std::string> GsiService::GetInstalledDsuSlots() {
-    std::vector<std::string> dsu_slots;
-    auto d = std::unique_ptr<DIR, decltype(&closedir)>(opendir(DSU_METADATA_PREFIX), closedir);
-    if (d != nullptr) {
-        struct dirent* de;
-        while ((de = readdir(d.get())) != nullptr) {
-            if (de->d_name[0] == '.') {
-                continue;
-            }
-            auto dsu_slot = std::string(de->d_name);
-            if (access(DsuInstallDirFile(dsu_slot).c_str(), F_OK) != 0) {
-                continue;
-            }
-            dsu_slots.push_back(dsu_slot);
-        }
-    }
-    return dsu_slots;
-}
-
 void GsiService::CleanCorruptedInstallation() {
     for (auto&& slot : GetInstalledDsuSlots()) {
         bool is_complete = IsInstallationComplete(slot);
-        if (!is_complete) {
+        if (!is_complete && PartitionInstaller::HasCheckpoints(slot)) {
+            LOG(INFO) << "Keeping interrupted installation for slot: " << slot;
+        } else if (!is_complete) {
             LOG(INFO) << "CleanCorruptedInstallation for slot: " << slot;
             std::string install_dir;
             if (!android::base::ReadFileToString(DsuInstallDirFile(slot), &install_dir) ||
@@ -1011,47 +1664,5 @@ void GsiService::RunStartupTasks() {
     }
 }
 
-static bool GetAvbPublicKeyFromFd(int fd, AvbPublicKey* dst) {
-    // Read the AVB footer from EOF.
-    int64_t total_size = get_block_device_size(fd);
-    int64_t footer_offset = total_size - AVB_FOOTER_SIZE;
-    std::array<uint8_t, AVB_FOOTER_SIZE> footer_bytes;
-    if (!ReadFullyAtOffset(fd, footer_bytes.data(), AVB_FOOTER_SIZE, footer_offset)) {
-        PLOG(ERROR) << "cannot read AVB footer";
-        return false;
-    }
-    // Validate the AVB footer data and byte swap to native byte order.
-    AvbFooter footer;
-    if (!avb_footer_validate_and_byteswap((const AvbFooter*)footer_bytes.data(), &footer)) {
-        LOG(ERROR) << "invalid AVB footer";
-        return false;
-    }
-    // Read the VBMeta image.
-    std::vector<uint8_t> vbmeta_bytes(footer.vbmeta_size);
-    if (!ReadFullyAtOffset(fd, vbmeta_bytes.data(), vbmeta_bytes.size(), footer.vbmeta_offset)) {
-        PLOG(ERROR) << "cannot read VBMeta image";
-        return false;
-    }
-    // Validate the VBMeta image and retrieve AVB public key.
-    // After a successful call to avb_vbmeta_image_verify(), public_key_data
-    // will point to the serialized AVB public key, in the same format generated
-    // by the `avbtool extract_public_key` command.
-    const uint8_t* public_key_data;
-    size_t public_key_size;
-    AvbVBMetaVerifyResult result = avb_vbmeta_image_verify(vbmeta_bytes.data(), vbmeta_bytes.size(),
-                                                           &public_key_data, &public_key_size);
-    if (result != AVB_VBMETA_VERIFY_RESULT_OK) {
-        LOG(ERROR) << "invalid VBMeta image: " << avb_vbmeta_verify_result_to_string(result);
-        return false;
-    }
-    if (public_key_data != nullptr) {
-        dst->bytes.resize(public_key_size);
-        memcpy(dst->bytes.data(), public_key_data, public_key_size);
-        dst->sha1.resize(SHA_DIGEST_LENGTH);
-        SHA1(public_key_data, public_key_size, dst->sha1.data());
-    }
-    return true;
-}
-
 }  // namespace gsi
 }  // namespace android
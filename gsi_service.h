@@ -15,9 +15,11 @@
  */
 #pragma once
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -29,11 +31,56 @@
 #include <liblp/builder.h>
 #include "libgsi/libgsi.h"
 
+#include "avb_key_cache.h"
+#include "install_stats.h"
+#include "job_scheduler.h"
 #include "partition_installer.h"
+#include "progress_publisher.h"
 
 namespace android {
 namespace gsi {
 
+// A PartitionInstaller, locked for as long as one binder call uses it.
+class LockedInstaller final {
+  public:
+    LockedInstaller() = default;
+    // With |shared|, other shared holders may use the installer at the same
+    // time; only range commits are safe to run that way.
+    LockedInstaller(std::shared_ptr<PartitionInstaller> installer, bool shared)
+        : installer_(std::move(installer)) {
+        if (shared) {
+            shared_guard_ = std::shared_lock<std::shared_mutex>(installer_->lock());
+        } else {
+            guard_ = std::unique_lock<std::shared_mutex>(installer_->lock());
+        }
+    }
+
+    LockedInstaller(LockedInstaller&&) = default;
+    LockedInstaller& operator=(LockedInstaller&&) = delete;
+
+    // Closing an installer waits until no call holds a reference, so that
+    // whoever closes it holds the last one. The installer is unlocked first.
+    ~LockedInstaller() {
+        if (guard_.owns_lock()) {
+            guard_.unlock();
+        }
+        if (shared_guard_.owns_lock()) {
+            shared_guard_.unlock();
+        }
+        if (installer_) {
+            PartitionInstaller::Release(&installer_);
+        }
+    }
+
+    PartitionInstaller* operator->() const { return installer_.get(); }
+    explicit operator bool() const { return installer_ != nullptr; }
+
+  private:
+    std::unique_lock<std::shared_mutex> guard_;
+    std::shared_lock<std::shared_mutex> shared_guard_;
+    std::shared_ptr<PartitionInstaller> installer_;
+};
+
 class GsiService : public BinderService<GsiService>, public BnGsiService {
   public:
     static void Register();
@@ -42,12 +89,34 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status closeInstall(int32_t* _aidl_return) override;
     binder::Status createPartition(const ::std::string& name, int64_t size, bool readOnly,
                                    int32_t* _aidl_return) override;
+    binder::Status resumePartition(const ::std::string& name, int64_t* _aidl_return) override;
+    binder::Status updatePartition(const ::std::string& name, int64_t size,
+                                   int32_t* _aidl_return) override;
     binder::Status commitGsiChunkFromStream(const ::android::os::ParcelFileDescriptor& stream,
                                             int64_t bytes, bool* _aidl_return) override;
+    binder::Status commitCompressedGsiChunkFromStream(
+            const ::android::os::ParcelFileDescriptor& stream, int64_t bytes, int32_t compression,
+            bool* _aidl_return) override;
+    binder::Status commitPartitionChunkFromStream(const ::std::string& name,
+                                                  const ::android::os::ParcelFileDescriptor& stream,
+                                                  int64_t bytes, int32_t compression,
+                                                  bool* _aidl_return) override;
+    binder::Status commitPartitionRangeFromStream(const ::std::string& name, int64_t offset,
+                                                  const ::android::os::ParcelFileDescriptor& stream,
+                                                  int64_t bytes, int32_t compression,
+                                                  bool* _aidl_return) override;
     binder::Status getInstallProgress(::android::gsi::GsiProgress* _aidl_return) override;
+    binder::Status getInstallStats(
+            std::vector<::android::gsi::GsiPhaseStats>* _aidl_return) override;
+    binder::Status registerProgressCallback(const sp<IGsiProgressCallback>& callback) override;
+    binder::Status unregisterProgressCallback(const sp<IGsiProgressCallback>& callback) override;
     binder::Status setGsiAshmem(const ::android::os::ParcelFileDescriptor& ashmem, int64_t size,
                                 bool* _aidl_return) override;
     binder::Status commitGsiChunkFromAshmem(int64_t bytes, bool* _aidl_return) override;
+    binder::Status setGsiAshmemRing(const ::android::os::ParcelFileDescriptor& ashmem,
+                                    int32_t slot_count, int64_t slot_size,
+                                    bool* _aidl_return) override;
+    binder::Status commitGsiChunksFromAshmemRing(bool* _aidl_return) override;
     binder::Status cancelGsiInstall(bool* _aidl_return) override;
     binder::Status enableGsi(bool oneShot, const std::string& dsuSlot, int* _aidl_return) override;
     binder::Status enableGsiAsync(bool oneShot, const ::std::string& dsuSlot,
@@ -62,34 +131,63 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status getInstalledGsiImageDir(std::string* _aidl_return) override;
     binder::Status getActiveDsuSlot(std::string* _aidl_return) override;
     binder::Status getInstalledDsuSlots(std::vector<std::string>* _aidl_return) override;
+    binder::Status getStatus(GsiStatus* _aidl_return) override;
     binder::Status zeroPartition(const std::string& name, int* _aidl_return) override;
+    binder::Status wipePartition(const std::string& name, bool full, int* _aidl_return) override;
+    binder::Status createPartitionAsync(const std::string& name, int64_t size, bool readOnly,
+                                        const sp<IGsiJobCallback>& callback,
+                                        int64_t* _aidl_return) override;
+    binder::Status commitPartitionChunkAsync(const std::string& name,
+                                             const ::android::os::ParcelFileDescriptor& stream,
+                                             int64_t bytes, int32_t compression,
+                                             const sp<IGsiJobCallback>& callback,
+                                             int64_t* _aidl_return) override;
+    binder::Status wipePartitionAsync(const std::string& name, bool full,
+                                      const sp<IGsiJobCallback>& callback,
+                                      int64_t* _aidl_return) override;
+    binder::Status cancelJob(int64_t job_id, bool* _aidl_return) override;
     binder::Status openImageService(const std::string& prefix,
                                     android::sp<IImageService>* _aidl_return) override;
     binder::Status dumpDeviceMapperDevices(std::string* _aidl_return) override;
     binder::Status getAvbPublicKey(AvbPublicKey* dst, int32_t* _aidl_return) override;
+    binder::Status enablePartitionDigest(const std::vector<uint8_t>& expectedSha256,
+                                         int32_t* _aidl_return) override;
+    binder::Status getPartitionDigest(std::vector<uint8_t>* sha256,
+                                      int32_t* _aidl_return) override;
+    binder::Status enablePartitionVerification(const std::vector<uint8_t>& vbmeta,
+                                               int32_t* _aidl_return) override;
 
     // This is in GsiService, rather than GsiInstaller, since we need to access
     // it outside of the main lock which protects the unique_ptr.
     void StartAsyncOperation(const std::string& step, int64_t total_bytes);
     void UpdateProgress(int status, int64_t bytes_processed);
+    void ResetProgress();
+    // For work the client is not waiting on, such as allocating an image in
+    // the background. Its progress is only published while no other operation
+    // is in progress, and until another one starts.
+    void StartBackgroundOperation(const std::string& step, int64_t total_bytes);
+    void UpdateBackgroundProgress(const std::string& step, int status, int64_t bytes_processed);
+    GsiProgress GetProgress();
 
     // Helper methods for GsiInstaller.
     static bool RemoveGsiFiles(const std::string& install_dir);
-    bool should_abort() const { return should_abort_; }
+    // Whether the install was cancelled, or the job writing it.
+    bool should_abort() const { return should_abort_ || JobScheduler::Cancelled(); }
+    InstallStats* install_stats() { return &install_stats_; }
+    AvbKeyCache* avb_keys() { return &avb_keys_; }
 
     static void RunStartupTasks();
     static std::string GetInstalledImageDir();
     std::string GetActiveDsuSlot();
     std::string GetActiveInstalledImageDir();
 
-    static std::vector<std::string> GetInstalledDsuSlots();
-
   private:
     friend class ImageService;
 
     GsiService();
     static int ValidateInstallParams(std::string& install_dir);
     bool DisableGsiInstall();
+    static bool WriteActiveDsu(const std::string& dsu_slot);
     int ReenableGsi(bool one_shot);
     static void CleanCorruptedInstallation();
     static int SaveInstallation(const std::string&);
@@ -100,19 +198,65 @@ class GsiService : public BinderService<GsiService>, public BnGsiService {
     binder::Status CheckUid(AccessLevel level = AccessLevel::System);
     bool CreateInstallStatusFile();
     bool SetBootMode(bool one_shot);
+    int AddInstaller(std::shared_ptr<PartitionInstaller> installer, uint64_t generation);
+    LockedInstaller LockInstaller(const std::string& name = {}, bool shared = false);
+    bool CommitChunk(const std::string& name, int stream_fd, int64_t bytes, int32_t compression);
+    int64_t ScheduleJob(const std::string& name, JobScheduler::Work work,
+                        const sp<IGsiJobCallback>& callback);
+    std::shared_ptr<PartitionInstaller> DetachInstaller(const std::string& name);
+    static void FinishInstaller(std::shared_ptr<PartitionInstaller> installer);
+    void CloseInstaller(const std::string& name);
+    void CloseInstallers();
+    void GetAvbKeyDigests(GsiSlotStatus* slot);
+    void FillAvbKeyCache();
 
     static android::wp<GsiService> sInstance;
 
     std::string install_dir_ = {};
-    std::unique_ptr<PartitionInstaller> installer_;
+    // Partitions of the install in progress, by name. lock_ is only held to
+    // look an installer up or to close it, so that partitions can be
+    // written from several binder threads at once.
+    std::map<std::string, std::shared_ptr<PartitionInstaller>> installers_;
+    // Partition used by calls that do not name one: the one most recently
+    // created or resumed.
+    std::string current_partition_;
+    // installers_.size(), for progress queries that do not take lock_.
+    std::atomic<size_t> num_installers_ = 0;
+    // Bumped whenever the install session ends, so that partitions still
+    // being opened at that point are discarded.
+    uint64_t session_generation_ = 0;
     std::mutex lock_;
     std::mutex& lock() { return lock_; }
+    // Guards what status queries read: install_dir_ and the DSU state files
+    // under /metadata. Calls that change them hold lock_ as well, and only
+    // take this exclusively while they write, so queries never wait on lock_,
+    // which can be held while partitions are finished or removed.
+    std::shared_mutex state_lock_;
+    // Likewise for the images of IImageService clients, whose queries take
+    // this shared instead of taking lock_.
+    std::shared_mutex images_lock_;
+    // AVB keys of installed images, read once per image.
+    AvbKeyCache avb_keys_;
     // These are initialized or set in StartInstall().
     std::atomic<bool> should_abort_ = false;
 
     // Progress bar state.
+    // Progress of the current operation. The step only changes when an
+    // operation starts, under progress_lock_; the counters are updated as
+    // data is written, so they are atomics and updates never wait on pollers.
     std::mutex progress_lock_;
-    GsiProgress progress_;
+    std::string progress_step_;
+    std::atomic<int> progress_status_ = STATUS_NO_OPERATION;
+    std::atomic<int64_t> progress_bytes_ = 0;
+    std::atomic<int64_t> progress_total_ = 0;
+    // Phases of the partitions installed since openInstall.
+    InstallStats install_stats_;
+    // Pushes progress to registered callbacks. Declared after the progress
+    // state, so that its thread is stopped before the state goes away.
+    ProgressPublisher progress_publisher_;
+    // Runs the asynchronous calls. Declared last, so that jobs are stopped
+    // before anything they use goes away.
+    JobScheduler jobs_;
 };
 
 }  // namespace gsi
@@ -34,8 +34,10 @@
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
+#include <android/gsi/BnGsiProgressCallback.h>
 #include <android/gsi/IGsiService.h>
 #include <binder/IServiceManager.h>
+#include <binder/ProcessState.h>
 #include <cutils/android_reboot.h>
 #include <libgsi/libgsi.h>
 #include <libgsi/libgsid.h>
@@ -76,16 +78,31 @@ static std::string ErrorMessage(const android::binder::Status& status,
     return "error code " + std::to_string(error_code);
 }
 
+// Shows the progress gsid pushes, or polls for it if gsid is too old to push
+// it. Pushed progress arrives on binder threads, so the thread pool must be
+// running.
 class ProgressBar {
   public:
-    explicit ProgressBar(sp<IGsiService> gsid) : gsid_(gsid) {}
+    explicit ProgressBar(sp<IGsiService> gsid) : gsid_(gsid) {
+        listener_ = new Listener(this);
+        pushed_ = gsid_->registerProgressCallback(listener_).isOk();
+    }
 
-    ~ProgressBar() { Stop(); }
+    ~ProgressBar() {
+        Stop();
+        if (pushed_) {
+            gsid_->unregisterProgressCallback(listener_);
+        }
+        listener_->Detach();
+    }
 
     void Display() {
         Finish();
-        done_ = false;
-        last_update_ = {};
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            done_ = false;
+            last_update_ = {};
+        }
         worker_ = std::make_unique<std::thread>([this]() { Worker(); });
     }
 
@@ -107,31 +124,65 @@ class ProgressBar {
     }
 
   private:
+    class Listener : public BnGsiProgressCallback {
+      public:
+        explicit Listener(ProgressBar* bar) : bar_(bar) {}
+
+        android::binder::Status onProgress(const GsiProgress& progress) override {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (bar_) {
+                bar_->OnProgress(progress);
+            }
+            return android::binder::Status::ok();
+        }
+
+        // Waits for a callback in progress, and drops the ones still queued.
+        void Detach() {
+            std::lock_guard<std::mutex> guard(lock_);
+            bar_ = nullptr;
+        }
+
+      private:
+        std::mutex lock_;
+        ProgressBar* bar_;
+    };
+
+    void OnProgress(const GsiProgress& progress) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (!done_) {
+            Show(progress);
+        }
+    }
+
     void Worker() {
         std::unique_lock<std::mutex> lock(mutex_);
         while (!done_) {
-            if (!UpdateProgress()) {
+            if (!pushed_ && !Poll()) {
                 return;
             }
             cv_.wait_for(lock, 500ms, [this] { return done_; });
         }
     }
 
-    bool UpdateProgress() {
+    bool Poll() {
         GsiProgress latest;
         auto status = gsid_->getInstallProgress(&latest);
         if (!status.isOk()) {
             std::cout << std::endl;
             return false;
         }
+        Show(latest);
+        return true;
+    }
+
+    void Show(const GsiProgress& latest) {
         if (latest.status == IGsiService::STATUS_NO_OPERATION) {
-            return true;
+            return;
         }
         if (last_update_.step != latest.step) {
             FinishLastBar();
         }
         Display(latest);
-        return true;
     }
 
     void FinishLastBar() {
@@ -183,11 +234,14 @@ class ProgressBar {
 
   private:
     sp<IGsiService> gsid_;
+    sp<Listener> listener_;
+    // Whether gsid pushes progress, rather than having to be polled.
+    bool pushed_ = false;
     std::unique_ptr<std::thread> worker_;
     std::condition_variable cv_;
     std::mutex mutex_;
     GsiProgress last_update_;
-    bool done_ = false;
+    bool done_ = true;
 };
 
 static int Install(sp<IGsiService> gsid, int argc, char** argv) {
@@ -261,6 +315,8 @@ static int Install(sp<IGsiService> gsid, int argc, char** argv) {
         std::cerr << "Error duplicating descriptor: " << strerror(errno) << std::endl;
         return EX_SOFTWARE;
     }
+    // Progress updates are received on binder threads.
+    android::ProcessState::self()->startThreadPool();
     // Note: the progress bar needs to be re-started in between each call.
     ProgressBar progress(gsid);
     progress.Display();
@@ -344,8 +400,11 @@ static int Wipe(sp<IGsiService> gsid, int argc, char** /* argv */) {
     return 0;
 }
 
-static int WipeData(sp<IGsiService> gsid, int argc, char** /* argv */) {
-    if (argc > 1) {
+static int WipeData(sp<IGsiService> gsid, int argc, char** argv) {
+    bool full = false;
+    if (argc == 2 && argv[1] == std::string("--full")) {
+        full = true;
+    } else if (argc > 1) {
         std::cerr << "Unrecognized arguments to wipe-data.\n";
         return EX_USAGE;
     }
@@ -373,7 +432,15 @@ static int WipeData(sp<IGsiService> gsid, int argc, char** /* argv */) {
     }
 
     int error;
-    status = gsid->zeroPartition("userdata" + std::string(kDsuPostfix), &error);
+    if (full) {
+        android::ProcessState::self()->startThreadPool();
+        ProgressBar progress(gsid);
+        progress.Display();
+        status = gsid->wipePartition("userdata" + std::string(kDsuPostfix), true, &error);
+        progress.Finish();
+    } else {
+        status = gsid->zeroPartition("userdata" + std::string(kDsuPostfix), &error);
+    }
     if (!status.isOk() || error) {
         std::cerr << "Could not wipe GSI userdata: " << ErrorMessage(status, error) << "\n";
         return EX_SOFTWARE;
@@ -386,65 +453,33 @@ static int Status(sp<IGsiService> gsid, int argc, char** /* argv */) {
         std::cerr << "Unrecognized arguments to status." << std::endl;
         return EX_USAGE;
     }
-    bool running;
-    auto status = gsid->isGsiRunning(&running);
+    GsiStatus gsi_status;
+    auto status = gsid->getStatus(&gsi_status);
     if (!status.isOk()) {
         std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
         return EX_SOFTWARE;
-    } else if (running) {
+    }
+    if (gsi_status.running) {
         std::cout << "running" << std::endl;
     }
-    bool installed;
-    status = gsid->isGsiInstalled(&installed);
-    if (!status.isOk()) {
-        std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
-        return EX_SOFTWARE;
-    } else if (installed) {
+    if (gsi_status.installed) {
         std::cout << "installed" << std::endl;
     }
-    bool enabled;
-    status = gsid->isGsiEnabled(&enabled);
-    if (!status.isOk()) {
-        std::cerr << status.exceptionMessage().string() << std::endl;
-        return EX_SOFTWARE;
-    } else if (running || installed) {
-        std::cout << (enabled ? "enabled" : "disabled") << std::endl;
+    if (gsi_status.running || gsi_status.installed) {
+        std::cout << (gsi_status.enabled ? "enabled" : "disabled") << std::endl;
     } else {
         std::cout << "normal" << std::endl;
     }
-    if (getuid() != 0) {
-        return 0;
-    }
 
-    std::vector<std::string> dsu_slots;
-    status = gsid->getInstalledDsuSlots(&dsu_slots);
-    if (!status.isOk()) {
-        std::cerr << status.exceptionMessage().string() << std::endl;
-        return EX_SOFTWARE;
-    }
+    // Slots are only listed for root.
     int n = 0;
-    for (auto&& dsu_slot : dsu_slots) {
-        std::cout << "[" << n++ << "] " << dsu_slot << std::endl;
-        sp<IImageService> image_service = nullptr;
-        status = gsid->openImageService("dsu/" + dsu_slot + "/", &image_service);
-        if (!status.isOk()) {
-            std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
-            return EX_SOFTWARE;
-        }
-        std::vector<std::string> images;
-        status = image_service->getAllBackingImages(&images);
-        if (!status.isOk()) {
-            std::cerr << "error: " << status.exceptionMessage().string() << std::endl;
-            return EX_SOFTWARE;
-        }
-        for (auto&& image : images) {
-            std::cout << "installed: " << image << std::endl;
-            AvbPublicKey public_key;
-            int err = 0;
-            status = image_service->getAvbPublicKey(image, &public_key, &err);
+    for (auto&& slot : gsi_status.slots) {
+        std::cout << "[" << n++ << "] " << slot.name << std::endl;
+        for (auto&& image : slot.images) {
+            std::cout << "installed: " << image.name << std::endl;
             std::cout << "AVB public key (sha1): ";
-            if (!public_key.bytes.empty()) {
-                for (auto b : public_key.sha1) {
+            if (!image.avb_public_key_sha1.empty()) {
+                for (auto b : image.avb_public_key_sha1) {
                     std::cout << StringPrintf("%02x", b & 255);
                 }
                 std::cout << std::endl;
@@ -563,6 +598,7 @@ static int usage(int /* argc */, char* argv[]) {
             "               --wipe (remove old gsi userdata first)\n"
             "  wipe         Completely remove a GSI and its associated data\n"
             "  wipe-data    Ensure the GSI's userdata will be formatted\n"
+            "               [--full] (zero all of it)\n"
             "  cancel       Cancel the installation\n"
             "  status       Show status\n",
             argv[0], argv[0]);
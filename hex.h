@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/parseint.h>
+
+namespace android {
+namespace gsi {
+
+// Hex encoding of the binary state gsid keeps in text files under /metadata.
+static inline std::string ToHex(const void* data, size_t length) {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    std::string hex;
+    for (size_t i = 0; i < length; i++) {
+        hex += kDigits[bytes[i] >> 4];
+        hex += kDigits[bytes[i] & 0xf];
+    }
+    return hex;
+}
+
+static inline bool FromHex(const std::string& hex, std::vector<uint8_t>* bytes) {
+    if (hex.size() % 2) {
+        return false;
+    }
+    bytes->clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        unsigned int byte;
+        if (!android::base::ParseUint(hex.substr(i, 2).insert(0, "0x"), &byte)) {
+            return false;
+        }
+        bytes->push_back(byte);
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
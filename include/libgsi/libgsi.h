@@ -17,6 +17,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 namespace android {
 namespace gsi {
@@ -57,6 +58,16 @@ static constexpr int kMaxBootAttempts = 1;
 // Return true on success
 bool GetActiveDsu(std::string* active_dsu);
 
+// Returns the slots with an installation, complete or not.
+std::vector<std::string> GetInstalledDsuSlots();
+
+// Caches the state returned by IsGsiRunning, IsGsiInstalled, GetActiveDsu,
+// GetInstallStatus and GetInstalledDsuSlots, and drops it whenever inotify
+// reports a change under DSU_METADATA_PREFIX. Returns false if the cache is
+// not available, as in recovery and host builds; the state is then read on
+// every call, as it is without this.
+bool EnableStateCache();
+
 // Returns true if the currently running system image is a live GSI.
 bool IsGsiRunning();
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install_checkpoint.h"
+
+#include <inttypes.h>
+
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <openssl/sha.h>
+
+#include "hex.h"
+
+namespace android {
+namespace gsi {
+
+static constexpr int kCheckpointVersion = 1;
+
+static std::string HexOrDash(const std::vector<uint8_t>& bytes) {
+    return bytes.empty() ? "-" : ToHex(bytes.data(), bytes.size());
+}
+
+// Parses a field written by HexOrDash that, if present, is |size| bytes.
+static bool ParseHexOrDash(const std::string& field, size_t size, std::vector<uint8_t>* bytes) {
+    if (field == "-") {
+        bytes->clear();
+        return true;
+    }
+    return FromHex(field, bytes) && bytes->size() == size;
+}
+
+std::string SerializeCheckpoint(const InstallCheckpoint& checkpoint) {
+    return android::base::StringPrintf("%d %" PRIu64 " %" PRIu64 " %s %s\n", kCheckpointVersion,
+                                       checkpoint.size, checkpoint.written,
+                                       HexOrDash(checkpoint.digest_state).c_str(),
+                                       HexOrDash(checkpoint.expected_digest).c_str());
+}
+
+bool ParseCheckpoint(const std::string& content, uint64_t expected_size,
+                     InstallCheckpoint* checkpoint) {
+    auto fields = android::base::Split(android::base::Trim(content), " ");
+    int version;
+    return fields.size() == 5 && android::base::ParseInt(fields[0], &version) &&
+           version == kCheckpointVersion &&
+           android::base::ParseUint(fields[1], &checkpoint->size) &&
+           android::base::ParseUint(fields[2], &checkpoint->written) &&
+           checkpoint->written <= checkpoint->size &&
+           (!expected_size || checkpoint->size == expected_size) &&
+           ParseHexOrDash(fields[3], sizeof(SHA256_CTX), &checkpoint->digest_state) &&
+           ParseHexOrDash(fields[4], SHA256_DIGEST_LENGTH, &checkpoint->expected_digest);
+}
+
+}  // namespace gsi
+}  // namespace android
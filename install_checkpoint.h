@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// Progress of a partition install, kept in CheckpointFile() so that the
+// install can be resumed after gsid restarts.
+struct InstallCheckpoint {
+    // Size of the image, and how much of its start is on disk.
+    uint64_t size = 0;
+    uint64_t written = 0;
+    // SHA256_CTX over the written data, if the image is hashed as it is
+    // written, and the digest the client expects, if it gave one.
+    std::vector<uint8_t> digest_state;
+    std::vector<uint8_t> expected_digest;
+};
+
+// Format: <version> <image size> <bytes written> <SHA-256 state or "-">
+// <expected SHA-256 or "-">
+std::string SerializeCheckpoint(const InstallCheckpoint& checkpoint);
+
+// Fails if |content| is not a checkpoint of this version, or, unless
+// |expected_size| is 0, of an image of another size.
+bool ParseCheckpoint(const std::string& content, uint64_t expected_size,
+                     InstallCheckpoint* checkpoint);
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "install_stats.h"
+
+namespace android {
+namespace gsi {
+
+using std::chrono::duration_cast;
+using std::chrono::nanoseconds;
+
+static int64_t BytesPerSecond(uint64_t bytes, InstallStats::Clock::duration elapsed) {
+    int64_t ns = duration_cast<nanoseconds>(elapsed).count();
+    if (ns <= 0) {
+        return 0;
+    }
+    return static_cast<int64_t>(static_cast<double>(bytes) * 1e9 / ns);
+}
+
+uint64_t InstallStats::Start(const std::string& partition, const std::string& phase,
+                             BytesSource bytes) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = Clock::now();
+    Phase& entry = phases_[next_id_];
+    entry.partition = partition;
+    entry.phase = phase;
+    entry.start = now;
+    entry.sampled = now;
+    entry.source = std::move(bytes);
+    return next_id_++;
+}
+
+void InstallStats::SetBytes(uint64_t id, uint64_t bytes) {
+    std::lock_guard<std::mutex> guard(lock_);
+    if (auto iter = phases_.find(id); iter != phases_.end() && !iter->second.finished) {
+        iter->second.bytes = bytes;
+    }
+}
+
+void InstallStats::End(uint64_t id) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto iter = phases_.find(id);
+    if (iter == phases_.end() || iter->second.finished) {
+        return;
+    }
+    Phase& entry = iter->second;
+    if (entry.source) {
+        entry.bytes = entry.source();
+        entry.source = nullptr;
+    }
+    entry.end = Clock::now();
+    entry.finished = true;
+}
+
+void InstallStats::Clear() {
+    std::lock_guard<std::mutex> guard(lock_);
+    phases_.clear();
+}
+
+std::vector<GsiPhaseStats> InstallStats::Get() {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto now = Clock::now();
+    std::vector<GsiPhaseStats> stats;
+    for (auto& [id, entry] : phases_) {
+        if (entry.source) {
+            entry.bytes = entry.source();
+        }
+        auto end = entry.finished ? entry.end : now;
+
+        GsiPhaseStats out;
+        out.partition = entry.partition;
+        out.phase = entry.phase;
+        out.start_ns = duration_cast<nanoseconds>(entry.start.time_since_epoch()).count();
+        out.duration_ns = duration_cast<nanoseconds>(end - entry.start).count();
+        out.bytes = entry.bytes;
+        out.finished = entry.finished;
+        out.average_bytes_per_second = BytesPerSecond(entry.bytes, end - entry.start);
+        if (entry.finished) {
+            out.current_bytes_per_second = out.average_bytes_per_second;
+        } else {
+            // A resumed write can go back.
+            uint64_t delta = entry.bytes > entry.sampled_bytes ? entry.bytes - entry.sampled_bytes
+                                                               : 0;
+            out.current_bytes_per_second = BytesPerSecond(delta, now - entry.sampled);
+            entry.sampled = now;
+            entry.sampled_bytes = entry.bytes;
+        }
+        stats.emplace_back(std::move(out));
+    }
+    return stats;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android/gsi/GsiPhaseStats.h>
+
+namespace android {
+namespace gsi {
+
+// Timings and byte counts of the phases of an install, for each partition.
+// Phases of several partitions may be recorded from different threads.
+class InstallStats final {
+  public:
+    using Clock = std::chrono::steady_clock;
+    // Returns the bytes a phase has processed so far. Called when the stats
+    // are read, until the phase ends.
+    using BytesSource = std::function<uint64_t()>;
+
+    // Never returned by Start, so it can stand for no phase.
+    static constexpr uint64_t kNoPhase = UINT64_MAX;
+
+    // Returns an id for a phase that starts now.
+    uint64_t Start(const std::string& partition, const std::string& phase,
+                   BytesSource bytes = {});
+    void SetBytes(uint64_t id, uint64_t bytes);
+    // Ends the phase, if it has not ended yet. Its byte source is sampled one
+    // last time and released.
+    void End(uint64_t id);
+    // Forgets all phases. Ids handed out before are ignored from then on.
+    void Clear();
+
+    std::vector<GsiPhaseStats> Get();
+
+  private:
+    struct Phase {
+        std::string partition;
+        std::string phase;
+        Clock::time_point start;
+        Clock::time_point end;
+        bool finished = false;
+        uint64_t bytes = 0;
+        BytesSource source;
+        // When and at which byte count the phase was last read, to report
+        // the throughput since.
+        Clock::time_point sampled;
+        uint64_t sampled_bytes = 0;
+    };
+
+    std::mutex lock_;
+    uint64_t next_id_ = 0;
+    std::map<uint64_t, Phase> phases_;
+};
+
+// Records a phase for as long as it is in scope.
+class ScopedPhase final {
+  public:
+    ScopedPhase(InstallStats* stats, const std::string& partition, const std::string& phase)
+        : stats_(stats), id_(stats->Start(partition, phase)) {}
+    ~ScopedPhase() { stats_->End(id_); }
+    ScopedPhase(const ScopedPhase&) = delete;
+    ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+    void SetBytes(uint64_t bytes) { stats_->SetBytes(id_, bytes); }
+
+  private:
+    InstallStats* stats_;
+    uint64_t id_;
+};
+
+}  // namespace gsi
+}  // namespace android
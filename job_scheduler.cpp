@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "job_scheduler.h"
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+#include <binder/IPCThreadState.h>
+
+namespace android {
+namespace gsi {
+
+thread_local JobScheduler::Job* JobScheduler::current_ = nullptr;
+
+JobScheduler::JobScheduler(size_t num_workers, int cancelled_result, BusyCallback on_busy)
+    : cancelled_result_(cancelled_result),
+      on_busy_(std::move(on_busy)),
+      max_long_running_(std::max<size_t>(num_workers, 2) - 1) {
+    for (size_t i = 0; i < num_workers; i++) {
+        workers_.emplace_back([this]() { Worker(); });
+    }
+}
+
+JobScheduler::~JobScheduler() {
+    std::deque<std::shared_ptr<Job>> queued;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+        for (const auto& [id, job] : jobs_) {
+            job->cancelled = true;
+        }
+        queued.swap(queue_);
+        for (const auto& job : queued) {
+            jobs_.erase(job->id);
+        }
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+    // Clients wait for every job they scheduled to complete.
+    for (const auto& job : queued) {
+        LOG(INFO) << "job " << job->id << " (" << job->name << ") dropped at shutdown";
+        Complete(job.get(), cancelled_result_);
+    }
+}
+
+// Sends the result of |job| to its client, and reports when no job is left.
+void JobScheduler::Complete(Job* job, int result) {
+    if (job->on_complete) {
+        job->on_complete(job->id, result);
+    }
+    std::lock_guard<std::mutex> guard(pending_lock_);
+    if (!--pending_ && on_busy_) {
+        on_busy_(false);
+    }
+}
+
+int64_t JobScheduler::Schedule(const std::string& name, bool long_running, Work work,
+                               ProgressCallback on_progress, CompletionCallback on_complete) {
+    auto job = std::make_shared<Job>();
+    job->name = name;
+    job->long_running = long_running;
+    job->work = std::move(work);
+    job->on_progress = std::move(on_progress);
+    job->on_complete = std::move(on_complete);
+
+    // There is no call to read the identity without clearing it.
+    auto ipc = IPCThreadState::self();
+    job->identity = ipc->clearCallingIdentity();
+    ipc->restoreCallingIdentity(job->identity);
+
+    {
+        std::lock_guard<std::mutex> guard(pending_lock_);
+        if (!pending_++ && on_busy_) {
+            on_busy_(true);
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock_);
+    job->id = next_id_++;
+    jobs_[job->id] = job;
+    queue_.emplace_back(job);
+    cv_.notify_one();
+    return job->id;
+}
+
+bool JobScheduler::Cancel(int64_t id) {
+    std::shared_ptr<Job> job;
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        auto iter = jobs_.find(id);
+        if (iter == jobs_.end()) {
+            return false;
+        }
+        job = iter->second;
+        job->cancelled = true;
+
+        auto queued = std::find(queue_.begin(), queue_.end(), job);
+        if (queued == queue_.end()) {
+            // Running; it completes on its own.
+            return true;
+        }
+        queue_.erase(queued);
+        jobs_.erase(iter);
+    }
+    LOG(INFO) << "job " << id << " (" << job->name << ") cancelled before it started";
+    Complete(job.get(), cancelled_result_);
+    return true;
+}
+
+bool JobScheduler::Cancelled() {
+    return current_ && current_->cancelled;
+}
+
+void JobScheduler::ReportProgress(uint64_t current, uint64_t total) {
+    Job* job = current_;
+    if (!job || !job->on_progress) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (current != total && now - job->last_progress < kProgressInterval) {
+        return;
+    }
+    job->last_progress = now;
+    job->on_progress(job->id, current, total);
+}
+
+// Returns the oldest queued job that may start now, or the end of the queue.
+// lock_ must be held.
+std::deque<std::shared_ptr<JobScheduler::Job>>::iterator JobScheduler::NextJob() {
+    return std::find_if(queue_.begin(), queue_.end(), [this](const auto& job) {
+        return !job->long_running || long_running_ < max_long_running_;
+    });
+}
+
+void JobScheduler::Worker() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (true) {
+        auto next = queue_.end();
+        cv_.wait(lock, [&]() { return stop_ || (next = NextJob()) != queue_.end(); });
+        if (stop_) {
+            return;
+        }
+        auto job = std::move(*next);
+        queue_.erase(next);
+        if (job->long_running) {
+            long_running_++;
+        }
+        lock.unlock();
+
+        auto ipc = IPCThreadState::self();
+        int64_t own_identity = ipc->clearCallingIdentity();
+        ipc->restoreCallingIdentity(job->identity);
+        current_ = job.get();
+
+        LOG(INFO) << "job " << job->id << " (" << job->name << ") started";
+        int result = job->work();
+        LOG(INFO) << "job " << job->id << " (" << job->name << ") finished: " << result;
+
+        current_ = nullptr;
+        ipc->restoreCallingIdentity(own_identity);
+
+        lock.lock();
+        jobs_.erase(job->id);
+        if (job->long_running) {
+            // A long job that was held back may start now.
+            long_running_--;
+            cv_.notify_one();
+        }
+        lock.unlock();
+        Complete(job.get(), result);
+        lock.lock();
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
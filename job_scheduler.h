@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace gsi {
+
+// Runs long operations on a pool of worker threads, so that they do not hold
+// the binder thread of the call that started them.
+//
+// A job runs with the calling identity of the binder call that scheduled it,
+// so permission checks made by the job see the original caller.
+//
+// Jobs that may run for minutes, like writing or wiping a partition, are
+// scheduled as long-running. They are kept off one of the workers, so that
+// short jobs still start while every other worker is busy with a long one.
+class JobScheduler final {
+  public:
+    // Returns an IGsiService::INSTALL_* result.
+    using Work = std::function<int()>;
+    // Invoked with the id of the job, on the worker thread running it.
+    using ProgressCallback = std::function<void(int64_t id, uint64_t current, uint64_t total)>;
+    using CompletionCallback = std::function<void(int64_t id, int result)>;
+    // Invoked with true when a job is scheduled while none are pending, and
+    // with false once the last pending job has completed, after its
+    // completion callback returns.
+    using BusyCallback = std::function<void(bool busy)>;
+
+    // Progress is reported at most this often, except when a job reaches its
+    // total.
+    static constexpr std::chrono::milliseconds kProgressInterval{100};
+
+    // Jobs that are cancelled before they start complete with
+    // |cancelled_result|, including those still queued when the scheduler is
+    // destroyed.
+    JobScheduler(size_t num_workers, int cancelled_result, BusyCallback on_busy);
+    ~JobScheduler();
+    JobScheduler(const JobScheduler&) = delete;
+    JobScheduler& operator=(const JobScheduler&) = delete;
+
+    // Queues |work| and returns the id of the job. Must be called on the
+    // binder thread of the call that schedules it.
+    int64_t Schedule(const std::string& name, bool long_running, Work work,
+                     ProgressCallback on_progress, CompletionCallback on_complete);
+
+    // Cancels a queued or running job. A queued job completes without
+    // running; a running job sees Cancelled() return true, and stops at its
+    // next check. Returns false if there is no such job, or it has already
+    // finished.
+    bool Cancel(int64_t id);
+
+    // For the code of a job. Whether the job running on the calling thread
+    // was cancelled; false outside of jobs.
+    static bool Cancelled();
+    // Reports the progress of the job running on the calling thread. Does
+    // nothing outside of jobs.
+    static void ReportProgress(uint64_t current, uint64_t total);
+
+  private:
+    struct Job {
+        int64_t id;
+        std::string name;
+        int64_t identity;
+        bool long_running;
+        Work work;
+        ProgressCallback on_progress;
+        CompletionCallback on_complete;
+        std::atomic<bool> cancelled = false;
+        std::chrono::steady_clock::time_point last_progress;
+    };
+
+    std::deque<std::shared_ptr<Job>>::iterator NextJob();
+    void Worker();
+    void Complete(Job* job, int result);
+
+    static thread_local Job* current_;
+
+    const int cancelled_result_;
+    const BusyCallback on_busy_;
+    // Jobs scheduled and not yet completed. Guarded by its own lock, so that
+    // |on_busy_| is called in order without holding |lock_|.
+    std::mutex pending_lock_;
+    size_t pending_ = 0;
+    // How many long-running jobs may run at once, and how many do.
+    const size_t max_long_running_;
+    size_t long_running_ = 0;
+
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<Job>> queue_;
+    // Queued and running jobs, by id.
+    std::map<int64_t, std::shared_ptr<Job>> jobs_;
+    int64_t next_id_ = 1;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+}  // namespace gsi
+}  // namespace android
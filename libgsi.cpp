@@ -16,16 +16,21 @@
 
 #include "libgsi/libgsi.h"
 
+#include <dirent.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <android-base/file.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 
+#include "directory_watcher.h"
 #include "file_paths.h"
 #include "libgsi_private.h"
 
@@ -37,16 +42,156 @@ using android::base::ReadFileToString;
 using android::base::Split;
 using android::base::unique_fd;
 
+// The state cache is only used where gsid runs. Recovery and host tools
+// read the state on every call.
+#if defined(__ANDROID__) && !defined(__ANDROID_RECOVERY__)
+#define GSI_STATE_CACHE 1
+#endif
+
+// A cached result, valid for one generation of DSU_METADATA_PREFIX.
+template <typename T>
+struct CachedState {
+    bool valid = false;
+    uint64_t generation = 0;
+    T value = {};
+};
+
+// The result of reading a state file.
+struct StateFile {
+    bool ok = false;
+    std::string content;
+};
+
+#ifdef GSI_STATE_CACHE
+static std::mutex sStateLock;
+static std::unique_ptr<DirectoryWatcher> sStateWatcher;
+#endif
+// Where the state is read from. Only tests change it, with sStateLock held.
+static std::string sStateDir = DSU_METADATA_PREFIX;
+static CachedState<bool> sGsiRunning;
+static CachedState<bool> sGsiInstalled;
+static CachedState<StateFile> sActiveDsu;
+static CachedState<StateFile> sInstallStatus;
+static CachedState<std::vector<std::string>> sInstalledDsuSlots;
+
+// Returns the cached state, or calls |read| if it may have changed since it
+// was cached, or if the cache is not enabled.
+template <typename T, typename Read>
+static T GetState([[maybe_unused]] CachedState<T>* cached, Read read) {
+#ifdef GSI_STATE_CACHE
+    std::lock_guard<std::mutex> guard(sStateLock);
+    uint64_t generation;
+    if (sStateWatcher && sStateWatcher->Poll(&generation)) {
+        if (!cached->valid || cached->generation != generation) {
+            cached->value = read();
+            cached->generation = generation;
+            cached->valid = true;
+        }
+        return cached->value;
+    }
+#endif
+    return read();
+}
+
+// Returns the watcher of the state cache, if it is enabled. Called with
+// sStateLock held.
+static DirectoryWatcher* StateWatcher() {
+#ifdef GSI_STATE_CACHE
+    return sStateWatcher.get();
+#else
+    return nullptr;
+#endif
+}
+
+// Returns |path|, which is under DSU_METADATA_PREFIX, relative to the
+// directory the state is read from.
+static std::string StatePath(const std::string& path) {
+    return sStateDir + path.substr(strlen(DSU_METADATA_PREFIX));
+}
+
+static StateFile ReadStateFile(const char* file) {
+    StateFile state;
+    state.ok = ReadFileToString(StatePath(file), &state.content);
+    return state;
+}
+
+bool EnableStateCache() {
+    return EnableStateCache(DSU_METADATA_PREFIX);
+}
+
+bool EnableStateCache([[maybe_unused]] const std::string& dir) {
+#ifdef GSI_STATE_CACHE
+    std::lock_guard<std::mutex> guard(sStateLock);
+    if (sStateWatcher && dir == sStateDir) {
+        return true;
+    }
+    // A new watcher starts its generations over, so drop what was cached.
+    sGsiRunning = {};
+    sGsiInstalled = {};
+    sActiveDsu = {};
+    sInstallStatus = {};
+    sInstalledDsuSlots = {};
+    sStateDir = dir;
+    sStateWatcher = std::make_unique<DirectoryWatcher>(sStateDir);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void DisableStateCache() {
+#ifdef GSI_STATE_CACHE
+    std::lock_guard<std::mutex> guard(sStateLock);
+    sStateWatcher = nullptr;
+#endif
+}
+
 bool GetActiveDsu(std::string* active_dsu) {
-    return android::base::ReadFileToString(kDsuActiveFile, active_dsu);
+    auto state = GetState(&sActiveDsu, []() { return ReadStateFile(kDsuActiveFile); });
+    *active_dsu = state.content;
+    return state.ok;
 }
 
 bool IsGsiRunning() {
-    return !access(kGsiBootedIndicatorFile, F_OK);
+    return GetState(&sGsiRunning, []() {
+        return !access(StatePath(kGsiBootedIndicatorFile).c_str(), F_OK);
+    });
 }
 
 bool IsGsiInstalled() {
-    return !access(kDsuInstallStatusFile, F_OK);
+    return GetState(&sGsiInstalled, []() {
+        return !access(StatePath(kDsuInstallStatusFile).c_str(), F_OK);
+    });
+}
+
+// Subdirectories are watched if |watcher| is set.
+static std::vector<std::string> ReadInstalledDsuSlots(DirectoryWatcher* watcher) {
+    std::vector<std::string> dsu_slots;
+    auto d = std::unique_ptr<DIR, decltype(&closedir)>(opendir(sStateDir.c_str()), closedir);
+    if (d != nullptr) {
+        struct dirent* de;
+        while ((de = readdir(d.get())) != nullptr) {
+            if (de->d_name[0] == '.') {
+                continue;
+            }
+            auto dsu_slot = std::string(de->d_name);
+            // Watched before it is looked at, so that an install_dir file
+            // created in between is not missed.
+            if (watcher) {
+                watcher->WatchSubdirectory(StatePath(MetadataDir(dsu_slot)));
+            }
+            if (access(StatePath(DsuInstallDirFile(dsu_slot)).c_str(), F_OK) != 0) {
+                continue;
+            }
+            dsu_slots.push_back(dsu_slot);
+        }
+    }
+    return dsu_slots;
+}
+
+std::vector<std::string> GetInstalledDsuSlots() {
+    return GetState(&sInstalledDsuSlots,
+                    []() { return ReadInstalledDsuSlots(StateWatcher()); });
 }
 
 static bool WriteAndSyncFile(const std::string& data, const std::string& file) {
@@ -126,7 +271,9 @@ bool MarkSystemAsGsi() {
 }
 
 bool GetInstallStatus(std::string* status) {
-    return android::base::ReadFileToString(kDsuInstallStatusFile, status);
+    auto state = GetState(&sInstallStatus, []() { return ReadStateFile(kDsuInstallStatusFile); });
+    *status = state.content;
+    return state.ok;
 }
 
 bool GetBootAttempts(const std::string& boot_key, int* attempts) {
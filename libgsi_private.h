@@ -24,6 +24,13 @@ namespace gsi {
 bool GetInstallStatus(std::string* status);
 bool GetBootAttempts(const std::string& boot_key, int* attempts);
 
+// For tests and benchmarks: reads the state from |dir|, which must end with a
+// slash and be laid out like DSU_METADATA_PREFIX, and caches it as
+// EnableStateCache() does. DisableStateCache() goes back to reading the state
+// on every call, from the same directory.
+bool EnableStateCache(const std::string& dir);
+void DisableStateCache();
+
 static constexpr char kInstallStatusOk[] = "ok";
 static constexpr char kInstallStatusWipe[] = "wipe";
 static constexpr char kInstallStatusDisabled[] = "disabled";
@@ -16,19 +16,30 @@
 
 #include "partition_installer.h"
 
+#include <fcntl.h>
+#include <string.h>
 #include <sys/statvfs.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 #include <ext4_utils/ext4_utils.h>
 #include <fs_mgr_dm_linear.h>
 #include <libdm/dm.h>
 #include <libgsi/libgsi.h>
+#include <openssl/sha.h>
 
 #include "file_paths.h"
 #include "gsi_service.h"
+#include "install_checkpoint.h"
 #include "libgsi_private.h"
+#include "stream_prefetcher.h"
 
 namespace android {
 namespace gsi {
@@ -37,12 +48,90 @@ using namespace std::literals;
 using namespace android::dm;
 using namespace android::fiemap;
 using namespace android::fs_mgr;
+using android::base::ReadFileToString;
 using android::base::unique_fd;
 
 // The default size of userdata.img for GSI.
 // We are looking for /data to have atleast 40% free space
 static constexpr uint32_t kMinimumFreeSpaceThreshold = 40;
 
+// When set, image data is written to the mapped device with O_DIRECT.
+static constexpr char kDirectIoProp[] = "gsid.direct_io";
+
+// When set (the default), stream data is moved to the mapped device without
+// being copied through gsid, if the stream type allows it.
+static constexpr char kZeroCopyProp[] = "gsid.zero_copy";
+
+// When set (the default), runs of zero blocks are zeroed on the device with
+// BLKZEROOUT rather than written.
+static constexpr char kZeroElisionProp[] = "gsid.zero_elision";
+
+// When set (the default), buffered writes are flushed to the device in windows
+// as they are written, rather than all at once when the partition is finished.
+static constexpr char kWritebackProp[] = "gsid.writeback";
+
+// When set (the default), an existing image of the right size is written over
+// rather than deleted and allocated again.
+static constexpr char kReuseImagesProp[] = "gsid.reuse_images";
+
+// How much of the start of a read-only image is held in memory while its
+// backing file is still being allocated.
+static constexpr uint64_t kMaxStagedBytes = 64 * 1024 * 1024;
+
+// How much more is spilled to a temporary file next to the image, at most.
+// Streams block once this is full too. The spill file is also kept to half of
+// the space the image leaves free.
+static constexpr uint64_t kMaxSpillBytes = 4ULL * 1024 * 1024 * 1024;
+
+// How much of the first chunk is read up front to detect sparse images.
+static constexpr size_t kSparseSniffSize = 4096;
+
+// How much raw image data is written between checkpoints. Each checkpoint
+// flushes the device, so this trades resume granularity for throughput.
+static constexpr uint64_t kCheckpointInterval = 256 * 1024 * 1024;
+
+// Bytes wiped at the start of a writable partition: enough to destroy both
+// the first block and the superblock.
+static constexpr uint64_t kHeaderWipeSize = 1024 * 1024;
+
+// How much of a device is zeroed between progress updates in a full wipe.
+static constexpr uint64_t kWipeChunkSize = 64 * 1024 * 1024;
+
+// Zeroes the first |bytes| of |device|. The block layer zeroes the range with
+// BLKZEROOUT where the device allows, which also discards it where that
+// reads back as zeroes; otherwise large writes are used, bypassing the page
+// cache if possible. Holes are never punched in the backing file instead: the
+// device is mapped from the file's pinned extents, which must not move.
+static bool ZeroDevice(MappedDevice* device, uint64_t bytes,
+                       const PartitionInstaller::WipeProgress& on_progress) {
+    PartitionWriter writer(device->fd(), device->path());
+    if (bytes > kHeaderWipeSize && !writer.EnableDirectIo()) {
+        writer.set_writeback(true);
+    }
+    if (on_progress && !on_progress(0, bytes)) {
+        return false;
+    }
+    for (uint64_t offset = 0; offset < bytes;) {
+        uint64_t chunk = std::min(bytes - offset, kWipeChunkSize);
+        if (!writer.Fill(offset, chunk, 0)) {
+            return false;
+        }
+        offset += chunk;
+        if (on_progress && !on_progress(offset, bytes)) {
+            return false;
+        }
+    }
+    if (fsync(device->fd())) {
+        PLOG(ERROR) << "fsync " << device->path();
+        return false;
+    }
+    return true;
+}
+
+static int64_t ToMillis(std::chrono::nanoseconds duration) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
+}
+
 PartitionInstaller::PartitionInstaller(GsiService* service, const std::string& install_dir,
                                        const std::string& name, const std::string& active_dsu,
                                        int64_t size, bool read_only)
@@ -53,14 +142,27 @@ PartitionInstaller::PartitionInstaller(GsiService* service, const std::string& i
       size_(size),
       readOnly_(read_only) {
     images_ = ImageManager::Open(MetadataDir(active_dsu), install_dir_);
+    avb_generation_ =
+            service_->avb_keys()->Invalidate(MetadataDir(active_dsu), GetBackingFile(name_));
 }
 
 PartitionInstaller::~PartitionInstaller() {
+    // Also waits for the background allocation, which must not outlive us.
     Finish();
+    service_->install_stats()->End(write_phase_);
     if (!succeeded_) {
         // Close open handles before we remove files.
-        system_device_ = nullptr;
+        sparse_ = nullptr;
+        delta_ = nullptr;
+        // The writer reports to the verifier, so it goes first.
+        writer_ = nullptr;
+        verifier_ = nullptr;
+        {
+            std::lock_guard<std::mutex> guard(metadata_lock());
+            system_device_ = nullptr;
+        }
         PostInstallCleanup(images_.get());
+        RemoveCheckpoint();
     }
     if (IsAshmemMapped()) {
         UnmapAshmem();
@@ -77,6 +179,7 @@ void PartitionInstaller::PostInstallCleanup() {
 }
 
 void PartitionInstaller::PostInstallCleanup(ImageManager* manager) {
+    std::lock_guard<std::mutex> guard(metadata_lock());
     std::string file = GetBackingFile(name_);
     if (manager->IsImageMapped(file)) {
         LOG(ERROR) << "unmap " << file;
@@ -89,27 +192,371 @@ int PartitionInstaller::StartInstall() {
     if (int status = PerformSanityChecks()) {
         return status;
     }
-    if (int status = Preallocate()) {
-        return status;
-    }
+    // A new install replaces any interrupted one.
+    RemoveCheckpoint();
     if (!readOnly_) {
+        if (int status = Preallocate()) {
+            return status;
+        }
         if (!Format()) {
             return IGsiService::INSTALL_ERROR_GENERIC;
         }
         succeeded_ = true;
-    } else {
-        // Map ${name}_gsi so we can write to it.
-        system_device_ = OpenPartition(GetBackingFile(name_));
-        if (!system_device_) {
+        return IGsiService::INSTALL_OK;
+    }
+
+    // Allocating and pinning a large image takes a while, so it runs in the
+    // background, and the stream is staged in memory, then in a spill file,
+    // meanwhile. Failures are returned by the first call that needs the image.
+    struct statvfs sb;
+    if (!statvfs(install_dir_.c_str(), &sb)) {
+        uint64_t free_space = 1ULL * sb.f_bavail * sb.f_frsize;
+        max_spill_bytes_ = std::min(kMaxSpillBytes, (free_space - std::min(free_space, size_)) / 2);
+    }
+    allocation_ = std::async(std::launch::async, [this]() -> int {
+        if (int status = Preallocate()) {
+            return status;
+        }
+        if (int status = OpenWriter()) {
+            return status;
+        }
+        // Checkpoint right away, so that at least the preallocation survives
+        // an interruption.
+        if (!WriteCheckpoint()) {
             return IGsiService::INSTALL_ERROR_GENERIC;
         }
 
         // Clear the progress indicator.
-        service_->UpdateProgress(IGsiService::STATUS_NO_OPERATION, 0);
+        UpdateAllocationProgress(IGsiService::STATUS_NO_OPERATION, 0);
+        return IGsiService::INSTALL_OK;
+    });
+    return IGsiService::INSTALL_OK;
+}
+
+// Read-only images are allocated in the background, while the client may be
+// doing something else, such as writing another partition. Their progress is
+// only reported while it does not hide that of a call in progress.
+void PartitionInstaller::StartAllocationProgress(const std::string& step) {
+    if (!readOnly_) {
+        service_->StartAsyncOperation(step, size_);
+        return;
+    }
+    allocation_step_ = step;
+    service_->StartBackgroundOperation(step, size_);
+}
+
+void PartitionInstaller::UpdateAllocationProgress(int status, uint64_t bytes) {
+    if (!readOnly_) {
+        service_->UpdateProgress(status, bytes);
+        return;
+    }
+    service_->UpdateBackgroundProgress(allocation_step_, status, bytes);
+}
+
+// Waits for the background allocation started by StartInstall, if any, then
+// writes out the data staged while it ran.
+int PartitionInstaller::WaitForAllocation() {
+    std::lock_guard<std::mutex> guard(allocation_lock_);
+    if (!allocation_.valid()) {
+        return allocation_status_;
+    }
+    allocation_status_ = allocation_.get();
+    auto staged = std::move(staged_);
+    staged_bytes_ = 0;
+    unique_fd spill_fd = std::move(spill_fd_);
+    uint64_t spilled = spilled_bytes_;
+    spilled_bytes_ = 0;
+    if (allocation_status_ != IGsiService::INSTALL_OK) {
+        return allocation_status_;
+    }
+    if (!staged.empty()) {
+        service_->StartAsyncOperation("write " + name_, size_);
+    }
+    for (const auto& [buffer, length] : staged) {
+        if (!CommitGsiChunk(buffer->data(), length)) {
+            allocation_status_ = IGsiService::INSTALL_ERROR_GENERIC;
+            return allocation_status_;
+        }
+    }
+    if (spilled && !CommitSpillFile(spill_fd.get(), spilled)) {
+        allocation_status_ = IGsiService::INSTALL_ERROR_GENERIC;
+        return allocation_status_;
+    }
+    return IGsiService::INSTALL_OK;
+}
+
+// Writes out the first |bytes| of the spill file, which follow the data
+// staged in memory.
+bool PartitionInstaller::CommitSpillFile(int fd, uint64_t bytes) {
+    StagingBuffer buffer(kStagingBufferSize);
+    if (!buffer.ok()) {
+        return false;
+    }
+    for (uint64_t offset = 0; offset < bytes;) {
+        size_t n = std::min(bytes - offset, static_cast<uint64_t>(buffer.size()));
+        if (!android::base::ReadFullyAtOffset(fd, buffer.data(), n, offset)) {
+            PLOG(ERROR) << "read spill file of " << name_;
+            return false;
+        }
+        if (!CommitGsiChunk(buffer.data(), n)) {
+            return false;
+        }
+        offset += n;
+        service_->UpdateProgress(IGsiService::STATUS_WORKING, gsi_bytes_written_);
+    }
+    return true;
+}
+
+// Reads as much of |stream_fd| into memory, then into the spill file, as
+// allowed while the image is being allocated. |bytes| is updated to what is
+// left to read.
+bool PartitionInstaller::StageChunk(int stream_fd, int64_t* bytes) {
+    while (*bytes > 0 && staged_bytes_ < kMaxStagedBytes &&
+           allocation_.wait_for(0s) != std::future_status::ready) {
+        size_t n = std::min({static_cast<uint64_t>(*bytes), kMaxStagedBytes - staged_bytes_,
+                             static_cast<uint64_t>(kStagingBufferSize)});
+        auto buffer = std::make_unique<StagingBuffer>(n);
+        if (!buffer->ok() || !ReadStreamFully(stream_fd, buffer->data(), n)) {
+            return false;
+        }
+        staged_.emplace_back(std::move(buffer), n);
+        staged_bytes_ += n;
+        *bytes -= n;
+    }
+    if (*bytes <= 0 || staged_bytes_ < kMaxStagedBytes || !OpenSpillFile()) {
+        return true;
+    }
+
+    StagingBuffer buffer(kStagingBufferSize);
+    if (!buffer.ok()) {
+        return false;
+    }
+    while (*bytes > 0 && spilled_bytes_ < max_spill_bytes_ &&
+           allocation_.wait_for(0s) != std::future_status::ready) {
+        size_t n = std::min({static_cast<uint64_t>(*bytes), max_spill_bytes_ - spilled_bytes_,
+                             static_cast<uint64_t>(buffer.size())});
+        if (!ReadStreamFully(stream_fd, buffer.data(), n)) {
+            return false;
+        }
+        if (!android::base::WriteFully(spill_fd_, buffer.data(), n)) {
+            PLOG(ERROR) << "write spill file of " << name_;
+            return false;
+        }
+        spilled_bytes_ += n;
+        *bytes -= n;
+    }
+    return true;
+}
+
+// Creates the spill file, unlinked, in the install directory. Returns false
+// if there is no room for it, so that streams wait for the allocation.
+bool PartitionInstaller::OpenSpillFile() {
+    if (spill_fd_ >= 0) {
+        return true;
+    }
+    if (!max_spill_bytes_) {
+        return false;
+    }
+    spill_fd_.reset(open(install_dir_.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if (spill_fd_ < 0) {
+        PLOG(WARNING) << "cannot create spill file in " << install_dir_;
+        max_spill_bytes_ = 0;
+        return false;
+    }
+    return true;
+}
+
+int PartitionInstaller::StartUpdate() {
+    if (!images_ || !readOnly_) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (android::gsi::IsGsiRunning()) {
+        LOG(ERROR) << "cannot install gsi inside a live gsi";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // The image stops being a consistent snapshot as soon as it is patched,
+    // so an update cannot be resumed.
+    RemoveCheckpoint();
+    std::string image = GetBackingFile(name_);
+    {
+        std::lock_guard<std::mutex> guard(metadata_lock());
+        if (!images_->BackingImageExists(image) || !images_->UnmapImageIfExists(image)) {
+            LOG(ERROR) << "no installed " << image << " to update";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+    if (int status = OpenWriter()) {
+        return status;
     }
+    if (get_block_device_size(system_device_->fd()) != size_) {
+        LOG(ERROR) << image << " is not " << size_ << " bytes, it cannot be updated in place";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    delta_ = std::make_unique<BlockDiffWriter>(writer_.get(), system_device_->fd(), size_);
+    LOG(INFO) << "updating " << name_ << " in place";
+
+    // Clear the progress indicator.
+    service_->UpdateProgress(IGsiService::STATUS_NO_OPERATION, 0);
     return IGsiService::INSTALL_OK;
 }
 
+int PartitionInstaller::OpenWriter() {
+    // Map ${name}_gsi so we can write to it.
+    {
+        std::lock_guard<std::mutex> guard(metadata_lock());
+        system_device_ = OpenPartition(GetBackingFile(name_));
+    }
+    if (!system_device_) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    writer_ = std::make_unique<PartitionWriter>(system_device_->fd(), system_device_->path());
+    // Zero-copy transfers go through the page cache, so they are only
+    // used when O_DIRECT was not asked for.
+    if (android::base::GetBoolProperty(kDirectIoProp, false)) {
+        if (!writer_->EnableDirectIo()) {
+            LOG(WARNING) << "O_DIRECT unavailable for " << name_ << ", using buffered writes";
+        }
+    } else {
+        writer_->set_zero_copy(android::base::GetBoolProperty(kZeroCopyProp, true));
+    }
+    writer_->set_zero_elision(android::base::GetBoolProperty(kZeroElisionProp, true));
+    writer_->set_writeback(android::base::GetBoolProperty(kWritebackProp, true));
+    write_start_ = std::chrono::steady_clock::now();
+    service_->install_stats()->End(write_phase_);
+    write_phase_ = service_->install_stats()->Start(name_, "write",
+                                                    [this]() { return BytesWritten(); });
+    return IGsiService::INSTALL_OK;
+}
+
+int PartitionInstaller::ResumeInstall(int64_t* offset) {
+    if (!images_ || !readOnly_) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (int status = WaitForAllocation()) {
+        return status;
+    }
+    auto file = CheckpointFile(active_dsu_, name_);
+    std::string content;
+    if (!ReadFileToString(file, &content)) {
+        PLOG(ERROR) << "read " << file;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    InstallCheckpoint checkpoint;
+    if (!ParseCheckpoint(content, size_, &checkpoint)) {
+        LOG(ERROR) << "invalid checkpoint " << file << ": " << content;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    uint64_t written = checkpoint.written;
+
+    size_ = checkpoint.size;
+    if (!writer_) {
+        // gsid may have died with the image still mapped.
+        std::string image = GetBackingFile(name_);
+        std::unique_lock<std::mutex> metadata_guard(metadata_lock());
+        if (!images_->BackingImageExists(image) || !images_->UnmapImageIfExists(image)) {
+            LOG(ERROR) << "cannot reopen " << image;
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        metadata_guard.unlock();
+        if (int status = OpenWriter()) {
+            return status;
+        }
+        if (get_block_device_size(system_device_->fd()) < size_) {
+            LOG(ERROR) << image << " is smaller than its checkpoint";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+
+    // Anything past the checkpoint is rewritten, so parser and verifier state
+    // from this session is dropped. Only the digest state is persisted.
+    sparse_ = nullptr;
+    writer_->set_write_observer(nullptr);
+    verifier_ = nullptr;
+    verified_ = false;
+    writer_->set_stream_observer(nullptr);
+    digest_ = nullptr;
+    if (!checkpoint.digest_state.empty()) {
+        digest_ = std::make_unique<SHA256_CTX>();
+        memcpy(digest_.get(), checkpoint.digest_state.data(), checkpoint.digest_state.size());
+        ObserveDigest();
+    }
+    expected_digest_ = checkpoint.expected_digest;
+
+    // Range commits past the checkpoint are redone by the client.
+    ranges_.Clear();
+    gsi_bytes_written_ = written;
+    checkpointed_ = written;
+    resumed_at_ = written;
+    LOG(INFO) << "resuming " << name_ << " at " << written << " of " << size_ << " bytes";
+    *offset = written;
+    return IGsiService::INSTALL_OK;
+}
+
+// Record progress for ResumeInstall() once enough data has been written since
+// the last checkpoint. Callers only do so at points the client can restart
+// from. Sparse images are never checkpointed, since the state of the parser
+// is not persisted, and neither are diffs. Only the contiguous start of the
+// image is recorded, so out-of-order chunks past it are written again after
+// a resume.
+void PartitionInstaller::MaybeCheckpoint() {
+    std::lock_guard<std::mutex> guard(checkpoint_lock_);
+    if (!readOnly_ || sparse_ || delta_ ||
+        gsi_bytes_written_ - checkpointed_ < kCheckpointInterval) {
+        return;
+    }
+    if (!WriteCheckpoint()) {
+        LOG(WARNING) << "could not checkpoint " << name_ << ", continuing";
+    }
+}
+
+bool PartitionInstaller::WriteCheckpoint() {
+    // The checkpoint must never claim data that is not on disk yet. Range
+    // commits may move the cursor while the device is synced.
+    uint64_t written = gsi_bytes_written_;
+    if (fdatasync(system_device_->fd())) {
+        PLOG(ERROR) << "fdatasync " << name_;
+        return false;
+    }
+    InstallCheckpoint checkpoint;
+    checkpoint.size = size_;
+    checkpoint.written = written;
+    if (digest_) {
+        auto state = reinterpret_cast<const uint8_t*>(digest_.get());
+        checkpoint.digest_state.assign(state, state + sizeof(SHA256_CTX));
+    }
+    checkpoint.expected_digest = expected_digest_;
+    auto content = SerializeCheckpoint(checkpoint);
+
+    // Replace the old checkpoint atomically.
+    auto file = CheckpointFile(active_dsu_, name_);
+    auto tmp = file + ".tmp";
+    unique_fd fd(open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR));
+    if (fd < 0 || !android::base::WriteStringToFd(content, fd) || fsync(fd) ||
+        rename(tmp.c_str(), file.c_str())) {
+        PLOG(ERROR) << "write " << file;
+        return false;
+    }
+    checkpointed_ = written;
+    return true;
+}
+
+void PartitionInstaller::RemoveCheckpoint() {
+    std::string message;
+    if (!android::base::RemoveFileIfExists(CheckpointFile(active_dsu_, name_), &message)) {
+        LOG(ERROR) << message;
+    }
+}
+
+bool PartitionInstaller::HasCheckpoints(const std::string& dsu_slot) {
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(MetadataDir(dsu_slot), ec)) {
+        if (android::base::EndsWith(entry.path().filename().string(), kCheckpointSuffix)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 int PartitionInstaller::PerformSanityChecks() {
     if (!images_) {
         LOG(ERROR) << "unable to create image manager";
@@ -150,31 +597,73 @@ int PartitionInstaller::PerformSanityChecks() {
 }
 
 int PartitionInstaller::Preallocate() {
+    ScopedPhase phase(service_->install_stats(), name_, "allocate");
+    // ImageManager only records an image once it is fully allocated, so
+    // preallocation is serialized with other partitions.
+    std::lock_guard<std::mutex> guard(metadata_lock());
     std::string file = GetBackingFile(name_);
     if (!images_->UnmapImageIfExists(file)) {
         LOG(ERROR) << "failed to UnmapImageIfExists " << file;
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
-    // always delete the old one when it presents in case there might a partition
-    // with same name but different size.
+    // Delete the old one when it is present, unless it can be reused as is,
+    // in case there might be a partition with same name but different size.
     if (images_->BackingImageExists(file)) {
+        if (CanReuseImage(file)) {
+            LOG(INFO) << "reusing " << file;
+            reused_ = true;
+            StartAllocationProgress("reuse " + name_);
+            UpdateAllocationProgress(IGsiService::STATUS_COMPLETE, 0);
+            return IGsiService::INSTALL_OK;
+        }
         if (!images_->DeleteBackingImage(file)) {
             LOG(ERROR) << "failed to DeleteBackingImage " << file;
             return IGsiService::INSTALL_ERROR_GENERIC;
         }
     }
-    service_->StartAsyncOperation("create " + name_, size_);
-    if (!CreateImage(file, size_)) {
+    StartAllocationProgress("create " + name_);
+    if (!CreateImage(file, size_, &phase)) {
         LOG(ERROR) << "Could not create userdata image";
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
-    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, 0);
+    UpdateAllocationProgress(IGsiService::STATUS_COMPLETE, 0);
     return IGsiService::INSTALL_OK;
 }
 
-bool PartitionInstaller::CreateImage(const std::string& name, uint64_t size) {
-    auto progress = [this](uint64_t bytes, uint64_t /* total */) -> bool {
-        service_->UpdateProgress(IGsiService::STATUS_WORKING, bytes);
+// Returns true if |file| can be written over instead of being allocated again:
+// it must be the requested size, and still pinned where the metadata says it
+// is. Its old contents are not cleared here; whatever the new image does not
+// write is zeroed as it is parsed. metadata_lock() must be held.
+bool PartitionInstaller::CanReuseImage(const std::string& file) {
+    if (!android::base::GetBoolProperty(kReuseImagesProp, true) ||
+        images_->IsImageDisabled(file)) {
+        return false;
+    }
+    {
+        // The device is unmapped again when it goes out of scope.
+        auto device = OpenPartition(file);
+        if (!device) {
+            LOG(WARNING) << "could not map " << file << ", reallocating it";
+            return false;
+        }
+        uint64_t size = get_block_device_size(device->fd());
+        if (size != size_) {
+            LOG(INFO) << file << " is " << size << " bytes, reallocating it";
+            return false;
+        }
+    }
+    if (!images_->Validate()) {
+        LOG(WARNING) << "images are no longer pinned, reallocating " << file;
+        return false;
+    }
+    return true;
+}
+
+bool PartitionInstaller::CreateImage(const std::string& name, uint64_t size,
+                                     ScopedPhase* phase) {
+    auto progress = [this, phase](uint64_t bytes, uint64_t /* total */) -> bool {
+        UpdateAllocationProgress(IGsiService::STATUS_WORKING, bytes);
+        phase->SetBytes(bytes);
         if (service_->should_abort()) return false;
         return true;
     };
@@ -185,54 +674,243 @@ bool PartitionInstaller::CreateImage(const std::string& name, uint64_t size) {
     return images_->CreateBackingImage(name, size, flags, std::move(progress));
 }
 
+void PartitionInstaller::Release(std::shared_ptr<PartitionInstaller>* installer) {
+    PartitionInstaller* self = installer->get();
+    // The waiter cannot see the reference go away, and destroy the installer,
+    // before the lock is released.
+    std::lock_guard<std::mutex> guard(self->references_lock_);
+    installer->reset();
+    self->references_cv_.notify_all();
+}
+
+void PartitionInstaller::WaitForLastReference(
+        const std::shared_ptr<PartitionInstaller>& installer) {
+    std::unique_lock<std::mutex> lock(installer->references_lock_);
+    installer->references_cv_.wait(lock, [&]() { return installer.use_count() == 1; });
+}
+
+std::mutex& PartitionInstaller::metadata_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
 std::unique_ptr<MappedDevice> PartitionInstaller::OpenPartition(const std::string& name) {
     return MappedDevice::Open(images_.get(), 10s, name);
 }
 
 bool PartitionInstaller::CommitGsiChunk(int stream_fd, int64_t bytes) {
-    service_->StartAsyncOperation("write " + name_, size_);
-
     if (bytes < 0) {
         LOG(ERROR) << "chunk size " << bytes << " is negative";
         return false;
     }
+    if (allocation_.valid() && !StageChunk(stream_fd, &bytes)) {
+        return false;
+    }
+    if (WaitForAllocation()) {
+        return false;
+    }
+    service_->StartAsyncOperation("write " + name_, size_);
+
+    if (gsi_bytes_written_ == 0 && ranges_.empty() && !sparse_ && !delta_ && bytes > 0) {
+        // Read the start of the image to find out whether it is sparse. It is
+        // committed like any other chunk, so the rest of the stream stays
+        // aligned for direct I/O.
+        StagingBuffer head(kSparseSniffSize);
+        size_t head_size = std::min(static_cast<uint64_t>(bytes), head.size());
+        if (!head.ok() || !ReadStreamFully(stream_fd, head.data(), head_size) ||
+            !CommitGsiChunk(head.data(), head_size)) {
+            return false;
+        }
+        bytes -= head_size;
+    }
 
-    static const size_t kBlockSize = 4096;
-    auto buffer = std::make_unique<char[]>(kBlockSize);
+    if (sparse_ || delta_) {
+        return CommitParsedChunk(stream_fd, bytes);
+    }
+
+    if (static_cast<uint64_t>(bytes) > size_ - gsi_bytes_written_) {
+        // We cannot write past the end of the image file.
+        LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << size_
+                   << " expected, " << gsi_bytes_written_ << " written)";
+        return false;
+    }
 
     int progress = -1;
-    uint64_t remaining = bytes;
-    while (remaining) {
-        size_t max_to_read = std::min(static_cast<uint64_t>(kBlockSize), remaining);
-        ssize_t rv = TEMP_FAILURE_RETRY(read(stream_fd, buffer.get(), max_to_read));
-        if (rv < 0) {
-            PLOG(ERROR) << "read gsi chunk";
+    uint64_t start = gsi_bytes_written_;
+    auto on_progress = [&](uint64_t written) -> bool {
+        gsi_bytes_written_ = start + written;
+        if (service_->should_abort()) {
             return false;
         }
-        if (rv == 0) {
-            LOG(ERROR) << "no bytes left in stream";
+        // Raw streams can be restarted at any offset.
+        MaybeCheckpoint();
+
+        // Only update the progress when the % (or permille, in this case)
+        // significantly changes.
+        int new_progress = (gsi_bytes_written_ * 1000) / size_;
+        if (new_progress != progress) {
+            progress = new_progress;
+            service_->UpdateProgress(IGsiService::STATUS_WORKING, gsi_bytes_written_);
+        }
+        return true;
+    };
+    if (!writer_->WriteFromStream(stream_fd, start, bytes, on_progress)) {
+        return false;
+    }
+    if (!VerifyIfFinished()) {
+        return false;
+    }
+
+    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
+    return true;
+}
+
+// Sparse images and diffs are parsed from memory, so stream them through the
+// same path as ashmem chunks.
+bool PartitionInstaller::CommitParsedChunk(int stream_fd, uint64_t bytes) {
+    StreamPrefetcher prefetcher(stream_fd, bytes);
+    if (!prefetcher.Start()) {
+        return false;
+    }
+    for (uint64_t consumed = 0; consumed < bytes;) {
+        const char* data;
+        size_t chunk;
+        if (!prefetcher.Next(&data, &chunk)) {
             return false;
         }
-        if (!CommitGsiChunk(buffer.get(), rv)) {
+        if (!CommitGsiChunk(data, chunk)) {
             return false;
         }
-        CHECK(static_cast<uint64_t>(rv) <= remaining);
-        remaining -= rv;
+        prefetcher.Release();
+        consumed += chunk;
+        service_->UpdateProgress(IGsiService::STATUS_WORKING, gsi_bytes_written_);
+    }
+    service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
+    return true;
+}
 
-        // Only update the progress when the % (or permille, in this case)
-        // significantly changes.
-        int new_progress = ((size_ - remaining) * 1000) / size_;
-        if (new_progress != progress) {
-            service_->UpdateProgress(IGsiService::STATUS_WORKING, size_ - remaining);
+bool PartitionInstaller::CommitCompressedGsiChunk(int stream_fd, int64_t bytes,
+                                                  Compression compression) {
+    if (compression == Compression::None) {
+        return CommitGsiChunk(stream_fd, bytes);
+    }
+    if (WaitForAllocation()) {
+        return false;
+    }
+    if (sparse_ || delta_) {
+        LOG(ERROR) << "compressed chunks cannot be mixed with a sparse image or diff";
+        return false;
+    }
+    service_->StartAsyncOperation("write " + name_, size_);
+
+    if (bytes < 0) {
+        LOG(ERROR) << "chunk size " << bytes << " is negative";
+        return false;
+    }
+
+    // |bytes| is the compressed size, so progress is tracked against the
+    // decompressed data actually written.
+    uint64_t start = gsi_bytes_written_;
+    auto on_progress = [&](uint64_t written) -> bool {
+        gsi_bytes_written_ = start + written;
+        if (service_->should_abort()) {
+            return false;
         }
+        service_->UpdateProgress(IGsiService::STATUS_WORKING, gsi_bytes_written_);
+        return true;
+    };
+    uint64_t written = 0;
+    bool ok = writer_->WriteFromCompressedStream(stream_fd, start, bytes, compression,
+                                                 size_ - start, on_progress, &written);
+    gsi_bytes_written_ = start + written;
+    if (!ok || !VerifyIfFinished()) {
+        return false;
     }
+    // Each compressed chunk is a stream of its own, so only chunk boundaries
+    // can be checkpointed.
+    MaybeCheckpoint();
 
     service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
     return true;
 }
 
+bool PartitionInstaller::CommitGsiChunkAt(int stream_fd, uint64_t offset, int64_t bytes,
+                                          Compression compression) {
+    if (WaitForAllocation()) {
+        return false;
+    }
+    // The digest and the sparse parser need the image in order.
+    if (!readOnly_ || sparse_ || delta_ || digest_) {
+        LOG(ERROR) << name_ << " cannot be written out of order";
+        return false;
+    }
+    if (bytes < 0 || offset > size_ ||
+        (compression == Compression::None && static_cast<uint64_t>(bytes) > size_ - offset)) {
+        LOG(ERROR) << "chunk of " << bytes << " bytes at " << offset << " exceeds image size "
+                   << size_;
+        return false;
+    }
+    service_->StartAsyncOperation("write " + name_, size_);
+
+    uint64_t reported = 0;
+    auto on_progress = [&](uint64_t written) -> bool {
+        in_flight_ += written - reported;
+        reported = written;
+        if (service_->should_abort()) {
+            return false;
+        }
+        service_->UpdateProgress(IGsiService::STATUS_WORKING,
+                                 std::min(BytesWritten() + in_flight_, size_));
+        return true;
+    };
+    uint64_t written = bytes;
+    bool ok;
+    if (compression == Compression::None) {
+        ok = writer_->WriteFromStream(stream_fd, offset, bytes, on_progress);
+    } else {
+        ok = writer_->WriteFromCompressedStream(stream_fd, offset, bytes, compression,
+                                                size_ - offset, on_progress, &written);
+    }
+    in_flight_ -= reported;
+    if (!ok) {
+        return false;
+    }
+    MarkWritten(offset, written);
+    MaybeCheckpoint();
+    if (!VerifyIfFinished()) {
+        return false;
+    }
+
+    if (IsFinishedWriting()) {
+        service_->UpdateProgress(IGsiService::STATUS_COMPLETE, size_);
+    } else {
+        service_->UpdateProgress(IGsiService::STATUS_WORKING, BytesWritten());
+    }
+    return true;
+}
+
+// Records a range written by CommitGsiChunkAt, and moves |gsi_bytes_written_|
+// past it if that closes the gap.
+void PartitionInstaller::MarkWritten(uint64_t offset, uint64_t length) {
+    std::lock_guard<std::mutex> guard(ranges_lock_);
+    ranges_.Add(offset, length);
+    gsi_bytes_written_ = ranges_.ContiguousFrom(gsi_bytes_written_);
+    ranges_.TrimBelow(gsi_bytes_written_);
+}
+
+uint64_t PartitionInstaller::BytesWritten() {
+    std::lock_guard<std::mutex> guard(ranges_lock_);
+    return gsi_bytes_written_ + ranges_.bytes();
+}
+
 bool PartitionInstaller::IsFinishedWriting() {
-    return gsi_bytes_written_ == size_;
+    // In-order chunks may have caught up with earlier range commits.
+    MarkWritten(gsi_bytes_written_, 0);
+    if (gsi_bytes_written_ != size_) {
+        return false;
+    }
+    service_->install_stats()->End(write_phase_);
+    return true;
 }
 
 bool PartitionInstaller::IsAshmemMapped() {
@@ -240,6 +918,31 @@ bool PartitionInstaller::IsAshmemMapped() {
 }
 
 bool PartitionInstaller::CommitGsiChunk(const void* data, size_t bytes) {
+    if (digest_) {
+        SHA256_Update(digest_.get(), data, bytes);
+    }
+    if (delta_) {
+        if (service_->should_abort()) {
+            return false;
+        }
+        bool ok = delta_->Feed(reinterpret_cast<const char*>(data), bytes);
+        gsi_bytes_written_ = delta_->offset();
+        return ok && VerifyIfFinished();
+    }
+    if (gsi_bytes_written_ == 0 && ranges_.empty() && !sparse_ &&
+        SparseImageWriter::IsSparseImage(data, bytes)) {
+        LOG(INFO) << name_ << " is a sparse image";
+        sparse_ = std::make_unique<SparseImageWriter>(writer_.get(), size_, reused_);
+    }
+    if (sparse_) {
+        if (service_->should_abort()) {
+            return false;
+        }
+        bool ok = sparse_->Feed(reinterpret_cast<const char*>(data), bytes);
+        gsi_bytes_written_ = sparse_->offset();
+        return ok && VerifyIfFinished();
+    }
+
     if (static_cast<uint64_t>(bytes) > size_ - gsi_bytes_written_) {
         // We cannot write past the end of the image file.
         LOG(ERROR) << "chunk size " << bytes << " exceeds remaining image size (" << size_
@@ -249,15 +952,105 @@ bool PartitionInstaller::CommitGsiChunk(const void* data, size_t bytes) {
     if (service_->should_abort()) {
         return false;
     }
-    if (!android::base::WriteFully(system_device_->fd(), data, bytes)) {
-        PLOG(ERROR) << "write failed";
+    if (!writer_->Write(gsi_bytes_written_, data, bytes)) {
         return false;
     }
     gsi_bytes_written_ += bytes;
+    return VerifyIfFinished();
+}
+
+int PartitionInstaller::EnableDigest(const std::vector<uint8_t>& expected) {
+    if (int status = WaitForAllocation()) {
+        return status;
+    }
+    if (gsi_bytes_written_ || !ranges_.empty() || sparse_) {
+        LOG(ERROR) << "digest must be enabled before writing " << name_;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (!expected.empty() && expected.size() != SHA256_DIGEST_LENGTH) {
+        LOG(ERROR) << "expected digest has " << expected.size() << " bytes";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    digest_ = std::make_unique<SHA256_CTX>();
+    SHA256_Init(digest_.get());
+    expected_digest_ = expected;
+    ObserveDigest();
+    return IGsiService::INSTALL_OK;
+}
+
+void PartitionInstaller::ObserveDigest() {
+    // Data committed from memory is hashed in CommitGsiChunk; streamed data
+    // is hashed by the writer as it passes through.
+    writer_->set_stream_observer([this](const char* data, size_t length) {
+        SHA256_Update(digest_.get(), data, length);
+    });
+}
+
+int PartitionInstaller::GetDigest(std::vector<uint8_t>* digest) {
+    if (int status = WaitForAllocation()) {
+        return status;
+    }
+    if (!digest_) {
+        LOG(ERROR) << "digest is not enabled for " << name_;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    if (!IsFinishedWriting()) {
+        LOG(ERROR) << name_ << " is incomplete, no digest yet";
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    // Finalize a copy, so that this can be called more than once.
+    SHA256_CTX ctx = *digest_;
+    digest->resize(SHA256_DIGEST_LENGTH);
+    SHA256_Final(digest->data(), &ctx);
+    return IGsiService::INSTALL_OK;
+}
+
+int PartitionInstaller::EnableVerification(const std::vector<uint8_t>& vbmeta) {
+    if (int status = WaitForAllocation()) {
+        return status;
+    }
+    // After a resume, data written before the interruption is read back.
+    if (gsi_bytes_written_ != resumed_at_ || !ranges_.empty() || sparse_) {
+        LOG(ERROR) << "verification must be enabled before writing " << name_;
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    auto verifier = std::make_unique<AvbVerifier>(name_, system_device_->fd(), size_);
+    if (!vbmeta.empty() && !verifier->SetVbmeta(vbmeta)) {
+        return IGsiService::INSTALL_ERROR_GENERIC;
+    }
+    verifier_ = std::move(verifier);
+    writer_->set_write_observer(verifier_.get());
+    return IGsiService::INSTALL_OK;
+}
+
+// Runs the AVB verification, if enabled, once the last chunk has been written.
+bool PartitionInstaller::VerifyIfFinished() {
+    std::lock_guard<std::mutex> guard(verify_lock_);
+    if (!verifier_ || verified_ || !IsFinishedWriting()) {
+        return true;
+    }
+    service_->StartAsyncOperation("verify " + name_, size_);
+    ScopedPhase phase(service_->install_stats(), name_, "verify");
+    auto on_progress = [this, &phase](uint64_t bytes) -> bool {
+        if (service_->should_abort()) {
+            return false;
+        }
+        service_->UpdateProgress(IGsiService::STATUS_WORKING, bytes);
+        phase.SetBytes(bytes);
+        return true;
+    };
+    if (!verifier_->Verify(on_progress)) {
+        LOG(ERROR) << "AVB verification failed for " << name_;
+        return false;
+    }
+    verified_ = true;
     return true;
 }
 
 int PartitionInstaller::GetPartitionFd() {
+    if (WaitForAllocation()) {
+        return -1;
+    }
     return system_device_->fd();
 }
 
@@ -274,14 +1067,94 @@ void PartitionInstaller::UnmapAshmem() {
     }
     ashmem_data_ = MAP_FAILED;
     ashmem_size_ = -1;
+    ring_slot_count_ = 0;
+}
+
+bool PartitionInstaller::MapAshmemRing(int fd, uint32_t slot_count, uint64_t slot_size) {
+    static constexpr uint64_t kPageSize = 4096;
+
+    if (slot_count > IGsiService::ASHMEM_RING_MAX_SLOTS || slot_size % kPageSize ||
+        slot_size > std::numeric_limits<size_t>::max() / (slot_count + 1)) {
+        LOG(ERROR) << "invalid ashmem ring: " << slot_count << " slots of " << slot_size
+                   << " bytes";
+        return false;
+    }
+    if (IsAshmemMapped()) {
+        UnmapAshmem();
+    }
+    uint64_t header_size = IGsiService::ASHMEM_RING_HEADER_SIZE + slot_count * sizeof(uint64_t);
+    header_size = (header_size + kPageSize - 1) & ~(kPageSize - 1);
+    if (!MapAshmem(fd, header_size + slot_count * slot_size)) {
+        PLOG(ERROR) << "cannot mmap ashmem ring";
+        return false;
+    }
+    ring_slot_count_ = slot_count;
+    ring_slot_size_ = slot_size;
+    ring_header_size_ = header_size;
+    ring_consumer_ = 0;
+
+    auto header = reinterpret_cast<uint64_t*>(ashmem_data_);
+    __atomic_store_n(&header[1], ring_consumer_, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool PartitionInstaller::CommitAshmemRing() {
+    if (WaitForAllocation()) {
+        return false;
+    }
+    if (!IsAshmemMapped() || !ring_slot_count_) {
+        LOG(ERROR) << "ashmem ring is not mapped";
+        return false;
+    }
+    auto header = reinterpret_cast<uint64_t*>(ashmem_data_);
+    auto lengths = header + IGsiService::ASHMEM_RING_HEADER_SIZE / sizeof(uint64_t);
+    auto slots = reinterpret_cast<char*>(ashmem_data_) + ring_header_size_;
+
+    // Keep going until the producer stops publishing slots, so that a client
+    // filling the ring concurrently never has to wait for another call.
+    while (true) {
+        uint64_t producer = __atomic_load_n(&header[0], __ATOMIC_ACQUIRE);
+        if (producer == ring_consumer_) {
+            break;
+        }
+        if (producer - ring_consumer_ > ring_slot_count_) {
+            LOG(ERROR) << "ashmem ring overrun: producer " << producer << ", consumer "
+                       << ring_consumer_ << ", " << ring_slot_count_ << " slots";
+            return false;
+        }
+        for (; ring_consumer_ < producer; ring_consumer_++) {
+            uint32_t slot = ring_consumer_ % ring_slot_count_;
+            uint64_t length = __atomic_load_n(&lengths[slot], __ATOMIC_RELAXED);
+            if (length > ring_slot_size_) {
+                LOG(ERROR) << "ashmem ring slot " << slot << " length " << length
+                           << " exceeds slot size " << ring_slot_size_;
+                return false;
+            }
+            if (!CommitGsiChunk(slots + slot * ring_slot_size_, length)) {
+                return false;
+            }
+            __atomic_store_n(&header[1], ring_consumer_ + 1, __ATOMIC_RELEASE);
+        }
+    }
+    MaybeCheckpoint();
+    if (IsFinishedWriting()) {
+        UnmapAshmem();
+    }
+    return true;
 }
 
 bool PartitionInstaller::CommitGsiChunk(size_t bytes) {
+    if (WaitForAllocation()) {
+        return false;
+    }
     if (!IsAshmemMapped()) {
         PLOG(ERROR) << "ashmem is not mapped";
         return false;
     }
     bool success = CommitGsiChunk(ashmem_data_, bytes);
+    if (success) {
+        MaybeCheckpoint();
+    }
     if (success && IsFinishedWriting()) {
         UnmapAshmem();
     }
@@ -293,6 +1166,8 @@ const std::string PartitionInstaller::GetBackingFile(std::string name) {
 }
 
 bool PartitionInstaller::Format() {
+    ScopedPhase phase(service_->install_stats(), name_, "format");
+    std::lock_guard<std::mutex> guard(metadata_lock());
     auto file = GetBackingFile(name_);
     auto device = OpenPartition(file);
     if (!device) {
@@ -300,29 +1175,78 @@ bool PartitionInstaller::Format() {
     }
 
     // libcutils checks the first 4K, no matter the block size.
-    std::string zeroes(4096, 0);
-    if (!android::base::WriteFully(device->fd(), zeroes.data(), zeroes.size())) {
-        PLOG(ERROR) << "write " << file;
+    static constexpr uint64_t kFormatSize = 4096;
+    if (!ZeroDevice(device.get(), kFormatSize, {})) {
+        LOG(ERROR) << "could not format " << file;
         return false;
     }
+    phase.SetBytes(kFormatSize);
     return true;
 }
 
 int PartitionInstaller::Finish() {
-    if (readOnly_ && gsi_bytes_written_ != size_) {
+    if (int status = WaitForAllocation()) {
+        return status;
+    }
+    if (readOnly_ && !IsFinishedWriting()) {
         // We cannot boot if the image is incomplete.
         LOG(ERROR) << "image incomplete; expected " << size_ << " bytes, waiting for "
                    << (size_ - gsi_bytes_written_) << " bytes";
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
-    if (system_device_ != nullptr && fsync(system_device_->fd())) {
-        PLOG(ERROR) << "fsync failed for " << name_ << "_gsi";
+    if (digest_ && !expected_digest_.empty()) {
+        std::vector<uint8_t> digest;
+        if (GetDigest(&digest) != IGsiService::INSTALL_OK) {
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+        if (digest != expected_digest_) {
+            LOG(ERROR) << "digest mismatch for " << name_;
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+    if (verifier_ && !verified_) {
+        LOG(ERROR) << name_ << " was not verified";
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
+    if (writer_) {
+        write_time_ = std::chrono::steady_clock::now() - write_start_;
+        writeback_wait_ = writer_->writeback_wait();
+    }
+    auto flush_start = std::chrono::steady_clock::now();
+    if (system_device_ != nullptr) {
+        ScopedPhase phase(service_->install_stats(), name_, "flush");
+        if (fsync(system_device_->fd())) {
+            PLOG(ERROR) << "fsync failed for " << name_ << "_gsi";
+            return IGsiService::INSTALL_ERROR_GENERIC;
+        }
+    }
+    flush_time_ = std::chrono::steady_clock::now() - flush_start;
+    if (writer_) {
+        LOG(INFO) << name_ << ": writing took " << ToMillis(write_time_) << " ms ("
+                  << ToMillis(writeback_wait_) << " ms waiting on writeback), final flush took "
+                  << ToMillis(flush_time_) << " ms";
+    }
+
+    // Read the AVB key while the image is mapped, so that status queries do
+    // not have to map it again.
+    AvbPublicKey key;
+    bool key_ok = readOnly_ && system_device_ && GetAvbPublicKeyFromFd(system_device_->fd(), &key);
+    service_->avb_keys()->Put(MetadataDir(active_dsu_), GetBackingFile(name_), avb_generation_,
+                              key_ok, key);
+
+    sparse_ = {};
+    delta_ = {};
+    // The writer reports to the verifier, so it goes first.
+    writer_ = {};
+    verifier_ = {};
+    RemoveCheckpoint();
+
+    std::lock_guard<std::mutex> guard(metadata_lock());
     system_device_ = {};
 
     // If files moved (are no longer pinned), the metadata file will be invalid.
     // This check can be removed once b/133967059 is fixed.
+    ScopedPhase phase(service_->install_stats(), name_, "validate");
     if (!images_->Validate()) {
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
@@ -332,7 +1256,9 @@ int PartitionInstaller::Finish() {
 }
 
 int PartitionInstaller::WipeWritable(const std::string& active_dsu, const std::string& install_dir,
-                                     const std::string& name) {
+                                     const std::string& name, bool full,
+                                     const WipeProgress& on_progress) {
+    std::lock_guard<std::mutex> guard(metadata_lock());
     auto image = ImageManager::Open(MetadataDir(active_dsu), install_dir);
     // The device object has to be destroyed before the image object
     auto device = MappedDevice::Open(image.get(), 10s, name);
@@ -340,17 +1266,13 @@ int PartitionInstaller::WipeWritable(const std::string& active_dsu, const std::s
         return IGsiService::INSTALL_ERROR_GENERIC;
     }
 
-    // Wipe the first 1MiB of the device, ensuring both the first block and
-    // the superblock are destroyed.
-    static constexpr uint64_t kEraseSize = 1024 * 1024;
-
-    std::string zeroes(4096, 0);
-    uint64_t erase_size = std::min(kEraseSize, get_block_device_size(device->fd()));
-    for (uint64_t i = 0; i < erase_size; i += zeroes.size()) {
-        if (!android::base::WriteFully(device->fd(), zeroes.data(), zeroes.size())) {
-            PLOG(ERROR) << "write " << name;
-            return IGsiService::INSTALL_ERROR_GENERIC;
-        }
+    uint64_t erase_size = get_block_device_size(device->fd());
+    if (!full) {
+        erase_size = std::min(kHeaderWipeSize, erase_size);
+    }
+    if (!ZeroDevice(device.get(), erase_size, on_progress)) {
+        LOG(ERROR) << "could not wipe " << name;
+        return IGsiService::INSTALL_ERROR_GENERIC;
     }
     return IGsiService::INSTALL_OK;
 }
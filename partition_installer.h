@@ -19,13 +19,29 @@
 #include <sys/mman.h>
 
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <android-base/unique_fd.h>
 #include <android/gsi/IGsiService.h>
 #include <android/gsi/MappedImage.h>
 #include <libfiemap/image_manager.h>
 #include <liblp/builder.h>
+#include <openssl/sha.h>
+
+#include "avb_verifier.h"
+#include "block_diff.h"
+#include "install_stats.h"
+#include "partition_writer.h"
+#include "sparse_image.h"
+#include "written_ranges.h"
 
 namespace android {
 namespace gsi {
@@ -42,37 +58,110 @@ class PartitionInstaller final {
                        const std::string& active_dsu, int64_t size, bool read_only);
     ~PartitionInstaller();
 
-    // Methods for a clean GSI install.
+    // Methods for a clean GSI install. For read-only partitions, the image is
+    // allocated in the background, and StartInstall returns right away.
     int StartInstall();
+    // Reopen a read-only partition whose install was interrupted, and rewind
+    // it to the last checkpoint. |offset| is set to the number of bytes of
+    // the image to continue from.
+    int ResumeInstall(int64_t* offset);
+    // Reopen the installed image of a read-only partition, to patch it in
+    // place with a block diff. All chunks are then parsed as a diff.
+    int StartUpdate();
     bool CommitGsiChunk(int stream_fd, int64_t bytes);
+    bool CommitCompressedGsiChunk(int stream_fd, int64_t bytes, Compression compression);
+    // Write a chunk of a raw image at |offset|, which need not follow the
+    // previous chunk. Several of these may run at once for disjoint ranges;
+    // the partition is complete once every byte has been written.
+    bool CommitGsiChunkAt(int stream_fd, uint64_t offset, int64_t bytes, Compression compression);
     bool CommitGsiChunk(const void* data, size_t bytes);
     bool MapAshmem(int fd, size_t size);
     bool CommitGsiChunk(size_t bytes);
+    bool MapAshmemRing(int fd, uint32_t slot_count, uint64_t slot_size);
+    bool CommitAshmemRing();
     int GetPartitionFd();
 
+    // Hash the image data committed from now on with SHA-256. If |expected|
+    // is not empty, Finish() fails unless it matches.
+    int EnableDigest(const std::vector<uint8_t>& expected);
+    int GetDigest(std::vector<uint8_t>* digest);
+
+    // Verify the image against its AVB hashtree or hash descriptor once it
+    // is complete. If |vbmeta| is given, data is hashed as it is written;
+    // otherwise the vbmeta image is read from the AVB footer at the end.
+    int EnableVerification(const std::vector<uint8_t>& vbmeta);
+
+    // Invoked with the number of bytes wiped so far and the total to wipe.
+    // Returning false aborts the wipe.
+    using WipeProgress = std::function<bool(uint64_t, uint64_t)>;
+
+    // Wipe the start of a writable partition so that it is formatted on next
+    // boot, or with |full|, zero all of it.
     static int WipeWritable(const std::string& active_dsu, const std::string& install_dir,
-                            const std::string& name);
+                            const std::string& name, bool full, const WipeProgress& on_progress);
+
+    // Returns true if an install in the slot can be resumed.
+    static bool HasCheckpoints(const std::string& dsu_slot);
 
     // Clean up install state if gsid crashed and restarted.
     void PostInstallCleanup();
     void PostInstallCleanup(ImageManager* manager);
 
     const std::string& install_dir() const { return install_dir_; }
+    const std::string& name() const { return name_; }
+
+    // Held by GsiService while it uses the installer, since partitions are
+    // installed from several binder threads at once. CommitGsiChunkAt only
+    // needs it shared.
+    std::shared_mutex& lock() { return lock_; }
+
+    // Set by GsiService before it waits for the installer to close. Calls that
+    // looked the installer up earlier give up once they hold the lock.
+    void MarkClosed() { closed_ = true; }
+    bool closed() const { return closed_; }
+
+    // Drops a reference held by a call, and wakes up WaitForLastReference.
+    static void Release(std::shared_ptr<PartitionInstaller>* installer);
+    // Blocks until |installer| is the only reference left. Other references
+    // must be dropped with Release.
+    static void WaitForLastReference(const std::shared_ptr<PartitionInstaller>& installer);
+
+    // ImageManager reads, modifies and writes back its metadata for every
+    // image it creates, maps or deletes, so these must not interleave for
+    // partitions installed at the same time.
+    static std::mutex& metadata_lock();
 
   private:
     int Finish();
     int PerformSanityChecks();
     int Preallocate();
+    int OpenWriter();
+    int WaitForAllocation();
+    bool StageChunk(int stream_fd, int64_t* bytes);
+    bool OpenSpillFile();
+    bool CommitSpillFile(int fd, uint64_t bytes);
+    void StartAllocationProgress(const std::string& step);
+    void UpdateAllocationProgress(int status, uint64_t bytes);
     bool Format();
-    bool CreateImage(const std::string& name, uint64_t size);
+    bool CanReuseImage(const std::string& file);
+    bool CreateImage(const std::string& name, uint64_t size, ScopedPhase* phase);
     std::unique_ptr<MappedDevice> OpenPartition(const std::string& name);
     int CheckInstallState();
     static const std::string GetBackingFile(std::string name);
+    bool CommitParsedChunk(int stream_fd, uint64_t bytes);
     bool IsFinishedWriting();
+    void MarkWritten(uint64_t offset, uint64_t length);
+    uint64_t BytesWritten();
+    bool VerifyIfFinished();
     bool IsAshmemMapped();
     void UnmapAshmem();
+    void ObserveDigest();
+    void MaybeCheckpoint();
+    bool WriteCheckpoint();
+    void RemoveCheckpoint();
 
     GsiService* service_;
+    std::shared_mutex lock_;
 
     std::string install_dir_;
     std::string name_;
@@ -80,13 +169,72 @@ class PartitionInstaller final {
     std::unique_ptr<ImageManager> images_;
     uint64_t size_ = 0;
     bool readOnly_;
-    // Remaining data we're waiting to receive for the GSI image.
-    uint64_t gsi_bytes_written_ = 0;
+    // Remaining data we're waiting to receive for the GSI image. For sparse
+    // images, this counts bytes of the expanded image. Chunks committed past
+    // it by CommitGsiChunkAt are kept in |ranges_| until the gap before them
+    // is filled.
+    std::atomic<uint64_t> gsi_bytes_written_ = 0;
+    std::mutex ranges_lock_;
+    WrittenRanges ranges_;
+    // Bytes of range commits still in progress, for progress reports.
+    std::atomic<uint64_t> in_flight_ = 0;
+    std::atomic<bool> closed_ = false;
+    std::mutex references_lock_;
+    std::condition_variable references_cv_;
+    // |gsi_bytes_written_| as of the last checkpoint, and when the install
+    // was last resumed.
+    std::mutex checkpoint_lock_;
+    uint64_t checkpointed_ = 0;
+    uint64_t resumed_at_ = 0;
     bool succeeded_ = false;
     uint64_t ashmem_size_ = -1;
     void* ashmem_data_ = MAP_FAILED;
+    // Ring layout, if the ashmem region was set up with MapAshmemRing.
+    uint32_t ring_slot_count_ = 0;
+    uint64_t ring_slot_size_ = 0;
+    uint64_t ring_header_size_ = 0;
+    uint64_t ring_consumer_ = 0;
+
+    // Background allocation of a read-only image, and the stream data read
+    // while it runs: first in memory, then in an unlinked spill file.
+    std::mutex allocation_lock_;
+    std::future<int> allocation_;
+    int allocation_status_ = IGsiService::INSTALL_OK;
+    std::string allocation_step_;
+    std::vector<std::pair<std::unique_ptr<StagingBuffer>, size_t>> staged_;
+    uint64_t staged_bytes_ = 0;
+    android::base::unique_fd spill_fd_;
+    uint64_t spilled_bytes_ = 0;
+    uint64_t max_spill_bytes_ = 0;
 
     std::unique_ptr<MappedDevice> system_device_;
+    // Observes |writer_|, so it is declared before it to outlive it. Both
+    // read |system_device_|.
+    std::unique_ptr<AvbVerifier> verifier_;
+    std::unique_ptr<PartitionWriter> writer_;
+    // Set if the image was written over rather than allocated again, so that
+    // it still holds the previous install where nothing is written to it.
+    bool reused_ = false;
+    // Set if the first chunk of the image was in the Android sparse format.
+    std::unique_ptr<SparseImageWriter> sparse_;
+    // Set for partitions updated with StartUpdate.
+    std::unique_ptr<BlockDiffWriter> delta_;
+    std::unique_ptr<SHA256_CTX> digest_;
+    std::vector<uint8_t> expected_digest_;
+    std::mutex verify_lock_;
+    bool verified_ = false;
+    // Generation of the image in the AvbKeyCache, from when it was opened.
+    uint64_t avb_generation_ = 0;
+
+    // Time from opening the writer to finishing the partition, how much of it
+    // was spent waiting on writeback, and how long the final fsync took.
+    std::chrono::steady_clock::time_point write_start_;
+    std::chrono::nanoseconds write_time_ = {};
+    std::chrono::nanoseconds writeback_wait_ = {};
+    std::chrono::nanoseconds flush_time_ = {};
+    // Phase of the install stats that counts bytes written, from opening the
+    // writer until the partition is complete.
+    uint64_t write_phase_ = InstallStats::kNoPhase;
 };
 
 }  // namespace gsi
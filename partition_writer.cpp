@@ -0,0 +1,575 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "partition_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+#include "stream_prefetcher.h"
+#include "zero_block.h"
+
+namespace android {
+namespace gsi {
+
+using android::base::unique_fd;
+
+// Upper bound for pipe buffers used with splice(). This is the default value
+// of /proc/sys/fs/pipe-max-size.
+static constexpr int kMaxPipeSize = 1024 * 1024;
+
+// Size of the buffer that is replicated over the device for pattern fills.
+static constexpr size_t kFillBufferSize = 1024 * 1024;
+
+// BLKZEROOUT requires ranges aligned to this many bytes.
+static constexpr uint64_t kSectorSize = 512;
+
+// Buffered writes are handed to writeback in windows of this size.
+static constexpr uint64_t kWritebackWindow = 32 * 1024 * 1024;
+
+// Granularity of zero detection, and the shortest run of zero blocks that is
+// worth an ioctl instead of a write.
+static constexpr size_t kZeroBlockSize = 4096;
+static constexpr size_t kMinZeroRun = 64 * 1024;
+
+StagingBuffer::StagingBuffer(size_t size) {
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        PLOG(ERROR) << "mmap staging buffer (" << size << " bytes)";
+        return;
+    }
+    data_ = reinterpret_cast<char*>(data);
+    size_ = size;
+}
+
+StagingBuffer::~StagingBuffer() {
+    if (data_ && munmap(data_, size_)) {
+        PLOG(ERROR) << "munmap staging buffer";
+    }
+}
+
+bool ReadStreamFully(int fd, void* data, size_t bytes) {
+    char* pos = reinterpret_cast<char*>(data);
+    while (bytes) {
+        ssize_t rv = TEMP_FAILURE_RETRY(read(fd, pos, bytes));
+        if (rv < 0) {
+            PLOG(ERROR) << "read gsi chunk";
+            return false;
+        }
+        if (rv == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        pos += rv;
+        bytes -= rv;
+    }
+    return true;
+}
+
+PartitionWriter::PartitionWriter(int fd, const std::string& path) : fd_(fd), path_(path) {}
+
+bool PartitionWriter::EnableDirectIo() {
+    unique_fd fd(open(path_.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC));
+    if (fd < 0) {
+        PLOG(WARNING) << "open " << path_ << " with O_DIRECT";
+        return false;
+    }
+    // Buffers must be aligned in memory as well as on disk, so never use less
+    // than a page.
+    direct_alignment_ = getpagesize();
+
+    struct stat st;
+    if (fstat(fd, &st)) {
+        PLOG(WARNING) << "fstat " << path_;
+        return false;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        int logical_block_size;
+        if (ioctl(fd, BLKSSZGET, &logical_block_size) || logical_block_size <= 0) {
+            PLOG(WARNING) << "BLKSSZGET " << path_;
+            return false;
+        }
+        direct_alignment_ = std::max(direct_alignment_, static_cast<size_t>(logical_block_size));
+    }
+    direct_fd_ = std::move(fd);
+    return true;
+}
+
+bool PartitionWriter::CanWriteDirect(uint64_t offset, const void* data, size_t bytes) const {
+    if (direct_fd_ < 0) {
+        return false;
+    }
+    return (offset % direct_alignment_) == 0 && (bytes % direct_alignment_) == 0 &&
+           (reinterpret_cast<uintptr_t>(data) % direct_alignment_) == 0;
+}
+
+bool PartitionWriter::Write(uint64_t offset, const void* data, size_t bytes) {
+    if (write_observer_) {
+        write_observer_->OnWrite(offset, reinterpret_cast<const char*>(data), bytes);
+    }
+    if (zero_elision_ && !zero_out_unsupported_ && bytes >= kMinZeroRun) {
+        return WriteEliding(offset, reinterpret_cast<const char*>(data), bytes);
+    }
+    return WriteData(offset, data, bytes);
+}
+
+bool PartitionWriter::WriteEliding(uint64_t offset, const char* data, size_t bytes) {
+    // Only look at whole blocks that are aligned on the device.
+    size_t pos = std::min(bytes, (kZeroBlockSize - offset % kZeroBlockSize) % kZeroBlockSize);
+    // Start of the data that has not been written yet.
+    size_t pending = 0;
+    while (bytes - pos >= kZeroBlockSize) {
+        if (!IsZeroBlock(data + pos, kZeroBlockSize)) {
+            pos += kZeroBlockSize;
+            continue;
+        }
+        size_t end = pos + kZeroBlockSize;
+        while (bytes - end >= kZeroBlockSize && IsZeroBlock(data + end, kZeroBlockSize)) {
+            end += kZeroBlockSize;
+        }
+        if (end - pos >= kMinZeroRun) {
+            if (pos > pending && !WriteData(offset + pending, data + pending, pos - pending)) {
+                return false;
+            }
+            if (!FillData(offset + pos, end - pos, 0)) {
+                return false;
+            }
+            pending = end;
+        }
+        pos = end;
+    }
+    if (pending < bytes) {
+        return WriteData(offset + pending, data + pending, bytes - pending);
+    }
+    return true;
+}
+
+bool PartitionWriter::WriteData(uint64_t offset, const void* data, size_t bytes) {
+    int fd = CanWriteDirect(offset, data, bytes) ? direct_fd_.get() : fd_;
+    const char* pos = reinterpret_cast<const char*>(data);
+    while (bytes) {
+        ssize_t rv = TEMP_FAILURE_RETRY(pwrite64(fd, pos, bytes, offset));
+        if (rv <= 0) {
+            PLOG(ERROR) << "write failed";
+            return false;
+        }
+        if (fd == fd_) {
+            OnDirty(offset, rv);
+        }
+        pos += rv;
+        offset += rv;
+        bytes -= rv;
+    }
+    return true;
+}
+
+// Called after data was written through the page cache. Once a window's worth
+// is dirty, writeback of it is started, and the previous window is waited
+// for, so that at most two windows are in memory at a time. Writes are not
+// necessarily sequential, so a window covers the bounds of the data written.
+void PartitionWriter::OnDirty(uint64_t offset, uint64_t bytes) {
+    if (!writeback_) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(writeback_lock_);
+    dirty_start_ = dirty_bytes_ ? std::min(dirty_start_, offset) : offset;
+    dirty_end_ = dirty_bytes_ ? std::max(dirty_end_, offset + bytes) : offset + bytes;
+    dirty_bytes_ += bytes;
+    if (dirty_bytes_ < kWritebackWindow) {
+        return;
+    }
+    if (sync_file_range(fd_, dirty_start_, dirty_end_ - dirty_start_, SYNC_FILE_RANGE_WRITE)) {
+        // This is only advisory; the final fsync still flushes everything.
+        PLOG(WARNING) << "sync_file_range " << path_ << ", disabling writeback";
+        writeback_ = false;
+        return;
+    }
+    if (flushing_end_ > flushing_start_) {
+        auto start = std::chrono::steady_clock::now();
+        if (sync_file_range(fd_, flushing_start_, flushing_end_ - flushing_start_,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                    SYNC_FILE_RANGE_WAIT_AFTER)) {
+            PLOG(WARNING) << "sync_file_range " << path_;
+        }
+        writeback_wait_ += std::chrono::steady_clock::now() - start;
+    }
+    flushing_start_ = dirty_start_;
+    flushing_end_ = dirty_end_;
+    dirty_bytes_ = 0;
+}
+
+std::chrono::nanoseconds PartitionWriter::writeback_wait() {
+    std::lock_guard<std::mutex> guard(writeback_lock_);
+    return writeback_wait_;
+}
+
+bool PartitionWriter::ZeroOut(uint64_t offset, uint64_t bytes) {
+    if (zero_out_unsupported_ || (offset % kSectorSize) || (bytes % kSectorSize)) {
+        return false;
+    }
+    uint64_t range[2] = {offset, bytes};
+    if (ioctl(fd_, BLKZEROOUT, &range)) {
+        // Not a block device, or the device cannot zero ranges; fall back to
+        // writing zeroes from now on.
+        PLOG(WARNING) << "BLKZEROOUT " << path_;
+        zero_out_unsupported_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool PartitionWriter::Fill(uint64_t offset, uint64_t bytes, uint32_t pattern) {
+    if (write_observer_) {
+        write_observer_->OnFill(offset, bytes, pattern);
+    }
+    return FillData(offset, bytes, pattern);
+}
+
+bool PartitionWriter::FillData(uint64_t offset, uint64_t bytes, uint32_t pattern) {
+    if (!pattern && ZeroOut(offset, bytes)) {
+        return true;
+    }
+    std::lock_guard<std::mutex> guard(fill_lock_);
+    if (!fill_buffer_) {
+        fill_buffer_ = std::make_unique<StagingBuffer>(kFillBufferSize);
+        if (!fill_buffer_->ok()) {
+            fill_buffer_ = nullptr;
+            return false;
+        }
+        fill_pattern_ = ~pattern;
+    }
+    if (fill_pattern_ != pattern) {
+        auto words = reinterpret_cast<uint32_t*>(fill_buffer_->data());
+        std::fill(words, words + fill_buffer_->size() / sizeof(uint32_t), pattern);
+        fill_pattern_ = pattern;
+    }
+    while (bytes) {
+        size_t chunk = std::min(static_cast<uint64_t>(fill_buffer_->size()), bytes);
+        if (!WriteData(offset, fill_buffer_->data(), chunk)) {
+            return false;
+        }
+        offset += chunk;
+        bytes -= chunk;
+    }
+    return true;
+}
+
+bool PartitionWriter::WriteFromStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                                      const ProgressCallback& on_progress) {
+    uint64_t written = 0;
+    if (zero_copy_ && !observer_ && !write_observer_ &&
+        !ZeroCopyFromStream(stream_fd, offset, bytes, on_progress, &written)) {
+        return false;
+    }
+    if (written == bytes) {
+        return true;
+    }
+    return BufferedFromStream(stream_fd, offset, bytes, on_progress, &written);
+}
+
+bool PartitionWriter::WriteFromCompressedStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                                                Compression compression, uint64_t max_output,
+                                                const ProgressCallback& on_progress,
+                                                uint64_t* written) {
+    *written = 0;
+    auto sink = [&](const char* data, size_t length) -> bool {
+        if (length > max_output - *written) {
+            LOG(ERROR) << "decompressed data exceeds remaining image size (" << max_output
+                       << " bytes)";
+            return false;
+        }
+        if (observer_) {
+            observer_(data, length);
+        }
+        if (!Write(offset + *written, data, length)) {
+            return false;
+        }
+        *written += length;
+        return !on_progress || on_progress(*written);
+    };
+    auto decompressor = Decompressor::Create(compression, std::move(sink));
+    if (!decompressor) {
+        return false;
+    }
+
+    // The stream is read on the prefetcher's thread, decompression of
+    // independent blocks is spread over worker threads, and device writes
+    // happen here.
+    StreamPrefetcher prefetcher(stream_fd, bytes);
+    if (!prefetcher.Start()) {
+        return false;
+    }
+    for (uint64_t consumed = 0; consumed < bytes;) {
+        const char* data;
+        size_t chunk;
+        if (!prefetcher.Next(&data, &chunk)) {
+            return false;
+        }
+        if (!decompressor->Feed(data, chunk)) {
+            return false;
+        }
+        prefetcher.Release();
+        consumed += chunk;
+    }
+    return decompressor->Finish();
+}
+
+bool PartitionWriter::BufferedFromStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                                         const ProgressCallback& on_progress, uint64_t* written) {
+    // Read ahead on a separate thread, so the stream and the device are busy
+    // at the same time.
+    StreamPrefetcher prefetcher(stream_fd, bytes - *written);
+    if (!prefetcher.Start()) {
+        return false;
+    }
+
+    while (*written < bytes) {
+        const char* data;
+        size_t chunk;
+        if (!prefetcher.Next(&data, &chunk)) {
+            return false;
+        }
+        if (observer_) {
+            observer_(data, chunk);
+        }
+        if (!Write(offset + *written, data, chunk)) {
+            return false;
+        }
+        prefetcher.Release();
+        *written += chunk;
+        if (on_progress && !on_progress(*written)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Errors which mean the kernel cannot move data between this pair of
+// descriptors, as opposed to an actual I/O failure.
+static bool IsZeroCopyUnsupported(int error) {
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP ||
+           error == EBADF;
+}
+
+// Zero-copy transfers can advance in small steps (a pipe holds 64KiB by
+// default), so only report progress about as often as the buffered path does.
+class ProgressReporter final {
+  public:
+    ProgressReporter(const PartitionWriter::ProgressCallback& callback, uint64_t total)
+        : callback_(callback), total_(total) {}
+
+    bool Report(uint64_t written) {
+        if (written != total_ && written - reported_ < kStagingBufferSize) {
+            return true;
+        }
+        reported_ = written;
+        return !callback_ || callback_(written);
+    }
+
+  private:
+    const PartitionWriter::ProgressCallback& callback_;
+    uint64_t total_;
+    uint64_t reported_ = 0;
+};
+
+bool PartitionWriter::ZeroCopyFromStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                                         const ProgressCallback& on_progress, uint64_t* written) {
+    struct stat st;
+    if (fstat(stream_fd, &st)) {
+        PLOG(ERROR) << "fstat stream";
+        return false;
+    }
+    if (S_ISFIFO(st.st_mode)) {
+        return SpliceFromPipe(stream_fd, offset, bytes, on_progress, written);
+    }
+    if (S_ISSOCK(st.st_mode)) {
+        return SpliceFromSocket(stream_fd, offset, bytes, on_progress, written);
+    }
+    if (S_ISREG(st.st_mode)) {
+        return CopyFromFile(stream_fd, offset, bytes, on_progress, written);
+    }
+    return true;
+}
+
+bool PartitionWriter::SpliceFromPipe(int stream_fd, uint64_t offset, uint64_t bytes,
+                                     const ProgressCallback& on_progress, uint64_t* written) {
+    // A larger pipe means fewer splice calls; this is best effort.
+    fcntl(stream_fd, F_SETPIPE_SZ, kMaxPipeSize);
+
+    ProgressReporter progress(on_progress, bytes);
+    while (*written < bytes) {
+        size_t chunk = std::min(static_cast<uint64_t>(kStagingBufferSize), bytes - *written);
+        loff_t out_offset = offset + *written;
+        ssize_t rv = TEMP_FAILURE_RETRY(
+                splice(stream_fd, nullptr, fd_, &out_offset, chunk, SPLICE_F_MOVE | SPLICE_F_MORE));
+        if (rv > 0) {
+            OnDirty(offset + *written, rv);
+        }
+        if (rv < 0) {
+            // A failed splice does not consume anything from the pipe, so it
+            // is always safe to continue with a buffered copy.
+            if (IsZeroCopyUnsupported(errno)) {
+                PLOG(INFO) << "splice unavailable, falling back to buffered copy";
+                return true;
+            }
+            PLOG(ERROR) << "splice gsi chunk";
+            return false;
+        }
+        if (rv == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        *written += rv;
+        if (!progress.Report(*written)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PartitionWriter::SpliceFromSocket(int stream_fd, uint64_t offset, uint64_t bytes,
+                                       const ProgressCallback& on_progress, uint64_t* written) {
+    // splice() needs a pipe on one side, so route the socket through one.
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC)) {
+        PLOG(ERROR) << "pipe2";
+        return false;
+    }
+    unique_fd pipe_read(pipefd[0]);
+    unique_fd pipe_write(pipefd[1]);
+    fcntl(pipe_write, F_SETPIPE_SZ, kMaxPipeSize);
+
+    ProgressReporter progress(on_progress, bytes);
+    while (*written < bytes) {
+        size_t chunk = std::min(static_cast<uint64_t>(kStagingBufferSize), bytes - *written);
+        ssize_t in_pipe = TEMP_FAILURE_RETRY(splice(stream_fd, nullptr, pipe_write, nullptr, chunk,
+                                                    SPLICE_F_MOVE | SPLICE_F_MORE));
+        if (in_pipe < 0) {
+            if (IsZeroCopyUnsupported(errno)) {
+                PLOG(INFO) << "splice unavailable, falling back to buffered copy";
+                return true;
+            }
+            PLOG(ERROR) << "splice gsi chunk";
+            return false;
+        }
+        if (in_pipe == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        while (in_pipe) {
+            loff_t out_offset = offset + *written;
+            ssize_t rv = TEMP_FAILURE_RETRY(splice(pipe_read, nullptr, fd_, &out_offset, in_pipe,
+                                                   SPLICE_F_MOVE | SPLICE_F_MORE));
+            if (rv < 0 && IsZeroCopyUnsupported(errno)) {
+                // The data has already left the socket; write it out by hand
+                // before handing the rest of the stream to the buffered path.
+                PLOG(INFO) << "splice unavailable, falling back to buffered copy";
+                StagingBuffer buffer(in_pipe);
+                if (!buffer.ok() || !ReadStreamFully(pipe_read, buffer.data(), in_pipe) ||
+                    !Write(out_offset, buffer.data(), in_pipe)) {
+                    return false;
+                }
+                *written += in_pipe;
+                return true;
+            }
+            if (rv <= 0) {
+                PLOG(ERROR) << "splice gsi chunk";
+                return false;
+            }
+            OnDirty(offset + *written, rv);
+            in_pipe -= rv;
+            *written += rv;
+        }
+        if (!progress.Report(*written)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Not every libc exposes a copy_file_range() wrapper, so call it directly.
+static ssize_t CopyFileRange(int fd_in, int fd_out, loff_t* off_out, size_t len) {
+    return syscall(__NR_copy_file_range, fd_in, nullptr, fd_out, off_out, len, 0);
+}
+
+bool PartitionWriter::CopyFromFile(int stream_fd, uint64_t offset, uint64_t bytes,
+                                   const ProgressCallback& on_progress, uint64_t* written) {
+    ProgressReporter progress(on_progress, bytes);
+
+    // copy_file_range() can share extents between files on the same file
+    // system, but block devices are rejected by older kernels.
+    bool use_sendfile = false;
+    unique_fd sendfile_fd;
+    while (*written < bytes) {
+        size_t chunk = std::min(static_cast<uint64_t>(kStagingBufferSize), bytes - *written);
+        loff_t out_offset = offset + *written;
+        ssize_t rv;
+        if (!use_sendfile) {
+            rv = TEMP_FAILURE_RETRY(CopyFileRange(stream_fd, fd_, &out_offset, chunk));
+            if (rv < 0 && IsZeroCopyUnsupported(errno)) {
+                use_sendfile = true;
+                continue;
+            }
+        } else {
+            // sendfile() writes at the output file position, so use a private
+            // descriptor rather than moving the position of the shared one.
+            if (sendfile_fd < 0) {
+                sendfile_fd.reset(open(path_.c_str(), O_WRONLY | O_CLOEXEC));
+                if (sendfile_fd < 0) {
+                    PLOG(ERROR) << "open " << path_;
+                    return false;
+                }
+            }
+            if (lseek64(sendfile_fd, out_offset, SEEK_SET) < 0) {
+                PLOG(ERROR) << "lseek " << path_;
+                return false;
+            }
+            rv = TEMP_FAILURE_RETRY(sendfile(sendfile_fd, stream_fd, nullptr, chunk));
+            if (rv < 0 && IsZeroCopyUnsupported(errno)) {
+                PLOG(INFO) << "sendfile unavailable, falling back to buffered copy";
+                return true;
+            }
+        }
+        if (rv < 0) {
+            PLOG(ERROR) << "copy gsi chunk";
+            return false;
+        }
+        if (rv == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        OnDirty(offset + *written, rv);
+        *written += rv;
+        if (!progress.Report(*written)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <android-base/unique_fd.h>
+
+#include "decompressor.h"
+
+namespace android {
+namespace gsi {
+
+// Size of each staging buffer used when copying from a stream. Reads are
+// accumulated until a buffer is full, so each device write is this large
+// (except for the tail of a chunk).
+static constexpr size_t kStagingBufferSize = 4 * 1024 * 1024;
+
+// Page-aligned memory used to stage data between the source stream and the
+// partition device. The alignment makes the buffer usable with O_DIRECT.
+class StagingBuffer final {
+  public:
+    explicit StagingBuffer(size_t size);
+    ~StagingBuffer();
+    StagingBuffer(const StagingBuffer&) = delete;
+    StagingBuffer& operator=(const StagingBuffer&) = delete;
+
+    bool ok() const { return data_ != nullptr; }
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Sees all data written through a PartitionWriter, at device offsets.
+class WriteObserver {
+  public:
+    virtual ~WriteObserver() = default;
+    virtual void OnWrite(uint64_t offset, const char* data, size_t length) = 0;
+    virtual void OnFill(uint64_t offset, uint64_t length, uint32_t pattern) = 0;
+};
+
+// Writes image data to a mapped partition device. All writes are positional,
+// so the file offset of the device descriptor is never relied upon. Once the
+// writer is set up, writes to disjoint ranges may come from several threads.
+class PartitionWriter final {
+  public:
+    // Invoked after each device write with the number of bytes written so far
+    // by the current call. Returning false aborts the write.
+    using ProgressCallback = std::function<bool(uint64_t)>;
+
+    // Invoked with each piece of stream data, after decompression, before it
+    // is written.
+    using StreamObserver = std::function<void(const char* data, size_t length)>;
+
+    // |fd| is the mapped partition device and |path| its block device node.
+    // The descriptor is not owned and must outlive the writer.
+    PartitionWriter(int fd, const std::string& path);
+
+    // Open a second, O_DIRECT descriptor for the device. Aligned writes then
+    // bypass the page cache; unaligned writes still go through |fd|.
+    bool EnableDirectIo();
+
+    // When enabled, WriteFromStream moves data in the kernel with splice(),
+    // copy_file_range() or sendfile() where the source allows it, and only
+    // falls back to copying through a staging buffer otherwise.
+    void set_zero_copy(bool enabled) { zero_copy_ = enabled; }
+
+    // Zero-copy transfers are skipped while an observer is set, since their
+    // data never passes through gsid.
+    void set_stream_observer(StreamObserver observer) { observer_ = std::move(observer); }
+    // Likewise for an observer of device writes, which must outlive the
+    // writer.
+    void set_write_observer(WriteObserver* observer) { write_observer_ = observer; }
+    WriteObserver* write_observer() const { return write_observer_; }
+
+    // When enabled, Write() looks for runs of zero blocks in the data and
+    // zeroes them on the device with BLKZEROOUT instead of writing them. The
+    // device content is the same either way.
+    void set_zero_elision(bool enabled) { zero_elision_ = enabled; }
+
+    // When enabled, data written through the page cache is handed to
+    // writeback in windows as it is written, and writers wait for the window
+    // before last to reach the device. This bounds the dirty pages held by an
+    // install, and how much the final fsync has to flush.
+    void set_writeback(bool enabled) { writeback_ = enabled; }
+
+    // Total time writes have spent waiting on writeback.
+    std::chrono::nanoseconds writeback_wait();
+
+    bool Write(uint64_t offset, const void* data, size_t bytes);
+
+    // Fill |bytes| at |offset| with a repeating 32-bit |pattern|. Zero fills
+    // are handed to the block layer with BLKZEROOUT when possible, so no data
+    // has to be transferred.
+    bool Fill(uint64_t offset, uint64_t bytes, uint32_t pattern);
+
+    // Copy exactly |bytes| from |stream_fd| to the device at |offset|.
+    bool WriteFromStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                         const ProgressCallback& on_progress);
+
+    // Decompress |bytes| of |compression| data from |stream_fd| to the device
+    // at |offset|. At most |max_output| bytes may be produced. On return,
+    // |*written| is the number of decompressed bytes written, which is also
+    // what |on_progress| reports.
+    bool WriteFromCompressedStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                                   Compression compression, uint64_t max_output,
+                                   const ProgressCallback& on_progress, uint64_t* written);
+
+  private:
+    bool CanWriteDirect(uint64_t offset, const void* data, size_t bytes) const;
+    bool ZeroOut(uint64_t offset, uint64_t bytes);
+    bool FillData(uint64_t offset, uint64_t bytes, uint32_t pattern);
+    bool WriteData(uint64_t offset, const void* data, size_t bytes);
+    bool WriteEliding(uint64_t offset, const char* data, size_t bytes);
+    void OnDirty(uint64_t offset, uint64_t bytes);
+
+    // Each of these advances |*written| as data lands on the device. They
+    // return true with |*written| < |bytes| if the kernel cannot move data
+    // between these descriptors, in which case the caller continues with a
+    // buffered copy.
+    bool ZeroCopyFromStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                            const ProgressCallback& on_progress, uint64_t* written);
+    bool SpliceFromPipe(int stream_fd, uint64_t offset, uint64_t bytes,
+                        const ProgressCallback& on_progress, uint64_t* written);
+    bool SpliceFromSocket(int stream_fd, uint64_t offset, uint64_t bytes,
+                          const ProgressCallback& on_progress, uint64_t* written);
+    bool CopyFromFile(int stream_fd, uint64_t offset, uint64_t bytes,
+                      const ProgressCallback& on_progress, uint64_t* written);
+    bool BufferedFromStream(int stream_fd, uint64_t offset, uint64_t bytes,
+                            const ProgressCallback& on_progress, uint64_t* written);
+
+    int fd_;
+    std::string path_;
+    android::base::unique_fd direct_fd_;
+    size_t direct_alignment_ = 0;
+    bool zero_copy_ = false;
+    bool zero_elision_ = false;
+    std::atomic<bool> writeback_ = false;
+    StreamObserver observer_;
+    WriteObserver* write_observer_ = nullptr;
+    // Set once BLKZEROOUT has failed, so it is not retried for every fill.
+    std::atomic<bool> zero_out_unsupported_ = false;
+    // Guards the fill buffer, which holds one pattern at a time.
+    std::mutex fill_lock_;
+    std::unique_ptr<StagingBuffer> fill_buffer_;
+    uint32_t fill_pattern_ = 0;
+
+    // Bounds of the buffered writes since the last window was started, and
+    // of the window under writeback.
+    std::mutex writeback_lock_;
+    uint64_t dirty_bytes_ = 0;
+    uint64_t dirty_start_ = 0;
+    uint64_t dirty_end_ = 0;
+    uint64_t flushing_start_ = 0;
+    uint64_t flushing_end_ = 0;
+    std::chrono::nanoseconds writeback_wait_ = {};
+};
+
+// Read exactly |bytes| from |fd|, failing if the stream ends early.
+bool ReadStreamFully(int fd, void* data, size_t bytes);
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "progress_publisher.h"
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+ProgressPublisher::ProgressPublisher(Snapshot snapshot) : snapshot_(std::move(snapshot)) {}
+
+ProgressPublisher::~ProgressPublisher() {
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+void ProgressPublisher::Register(const sp<IGsiProgressCallback>& callback) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto binder = IInterface::asBinder(callback);
+    for (const auto& existing : callbacks_) {
+        if (IInterface::asBinder(existing) == binder) {
+            return;
+        }
+    }
+    callbacks_.emplace_back(callback);
+    if (!worker_.joinable()) {
+        worker_ = std::thread([this]() { Worker(); });
+    }
+    // Send the current progress to the new callback, and again to the
+    // others, which is harmless.
+    pending_ = true;
+    cv_.notify_one();
+}
+
+void ProgressPublisher::Unregister(const sp<IGsiProgressCallback>& callback) {
+    std::lock_guard<std::mutex> guard(lock_);
+    auto binder = IInterface::asBinder(callback);
+    callbacks_.erase(std::remove_if(callbacks_.begin(), callbacks_.end(),
+                                    [&](const sp<IGsiProgressCallback>& existing) {
+                                        return IInterface::asBinder(existing) == binder;
+                                    }),
+                     callbacks_.end());
+}
+
+void ProgressPublisher::Notify() {
+    // Only wake the publishing thread for the first change since its last
+    // snapshot. The notification is sent without the lock, so it can be
+    // missed; the thread then sees the change when its wait times out.
+    if (!pending_.exchange(true, std::memory_order_acq_rel)) {
+        cv_.notify_one();
+    }
+}
+
+void ProgressPublisher::Worker() {
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stop_) {
+        cv_.wait_for(lock, kInterval, [this]() { return stop_ || pending_; });
+        if (stop_) {
+            break;
+        }
+        if (!pending_.exchange(false, std::memory_order_acq_rel) || callbacks_.empty()) {
+            continue;
+        }
+        auto callbacks = callbacks_;
+        lock.unlock();
+
+        GsiProgress progress = snapshot_();
+        std::vector<sp<IGsiProgressCallback>> dead;
+        for (const auto& callback : callbacks) {
+            auto status = callback->onProgress(progress);
+            if (!status.isOk()) {
+                LOG(ERROR) << "progress callback returned: " << status.toString8().string();
+                dead.emplace_back(callback);
+            }
+        }
+        for (const auto& callback : dead) {
+            Unregister(callback);
+        }
+
+        // Coalesce whatever changes in the meantime into the next update.
+        lock.lock();
+        cv_.wait_for(lock, kInterval, [this]() { return stop_; });
+    }
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android/gsi/GsiProgress.h>
+#include <android/gsi/IGsiProgressCallback.h>
+
+namespace android {
+namespace gsi {
+
+// Sends install progress to registered callbacks from a thread of its own,
+// so that writers never wait on a binder call. Changes are coalesced: at
+// most one update is sent per interval, carrying the latest progress.
+class ProgressPublisher final {
+  public:
+    // Returns the progress to send. Called from the publishing thread.
+    using Snapshot = std::function<GsiProgress()>;
+
+    static constexpr std::chrono::milliseconds kInterval{100};
+
+    explicit ProgressPublisher(Snapshot snapshot);
+    ~ProgressPublisher();
+    ProgressPublisher(const ProgressPublisher&) = delete;
+    ProgressPublisher& operator=(const ProgressPublisher&) = delete;
+
+    void Register(const sp<IGsiProgressCallback>& callback);
+    void Unregister(const sp<IGsiProgressCallback>& callback);
+
+    // Marks the progress as changed. This does not block, and is cheap
+    // enough to call on every progress update.
+    void Notify();
+
+  private:
+    void Worker();
+
+    Snapshot snapshot_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+    std::vector<sp<IGsiProgressCallback>> callbacks_;
+    std::thread worker_;
+    bool stop_ = false;
+    // Set by Notify, and cleared when the publishing thread takes a
+    // snapshot.
+    std::atomic<bool> pending_ = false;
+};
+
+}  // namespace gsi
+}  // namespace android
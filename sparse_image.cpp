@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "sparse_image.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+// On-disk format, see system/core/libsparse/sparse_format.h.
+static constexpr uint32_t kSparseHeaderMagic = 0xed26ff3a;
+static constexpr uint16_t kSparseMajorVersion = 1;
+
+static constexpr uint16_t kChunkTypeRaw = 0xcac1;
+static constexpr uint16_t kChunkTypeFill = 0xcac2;
+static constexpr uint16_t kChunkTypeDontCare = 0xcac3;
+static constexpr uint16_t kChunkTypeCrc32 = 0xcac4;
+
+struct SparseHeader {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} __attribute__((packed));
+
+struct ChunkHeader {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+} __attribute__((packed));
+
+static_assert(sizeof(SparseHeader) == 28);
+static_assert(sizeof(ChunkHeader) == 12);
+
+SparseImageWriter::SparseImageWriter(PartitionWriter* writer, uint64_t max_size, bool stale)
+    : writer_(writer), max_size_(max_size), stale_(stale) {}
+
+bool SparseImageWriter::IsSparseImage(const void* data, size_t length) {
+    uint32_t magic;
+    if (length < sizeof(magic)) {
+        return false;
+    }
+    memcpy(&magic, data, sizeof(magic));
+    return magic == kSparseHeaderMagic;
+}
+
+bool SparseImageWriter::Gather(const char** data, size_t* length, size_t needed) {
+    size_t n = std::min(*length, needed - pending_length_);
+    memcpy(pending_ + pending_length_, *data, n);
+    pending_length_ += n;
+    *data += n;
+    *length -= n;
+    if (pending_length_ < needed) {
+        return false;
+    }
+    pending_length_ = 0;
+    return true;
+}
+
+bool SparseImageWriter::ParseFileHeader() {
+    SparseHeader header;
+    memcpy(&header, pending_, sizeof(header));
+    if (header.magic != kSparseHeaderMagic) {
+        LOG(ERROR) << "bad sparse image magic " << std::hex << header.magic;
+        return false;
+    }
+    if (header.major_version != kSparseMajorVersion) {
+        LOG(ERROR) << "unsupported sparse image version " << header.major_version;
+        return false;
+    }
+    if (header.file_hdr_sz < sizeof(SparseHeader) || header.chunk_hdr_sz < sizeof(ChunkHeader)) {
+        LOG(ERROR) << "bad sparse header sizes " << header.file_hdr_sz << ", "
+                   << header.chunk_hdr_sz;
+        return false;
+    }
+    if (!header.blk_sz || (header.blk_sz % sizeof(uint32_t))) {
+        LOG(ERROR) << "bad sparse block size " << header.blk_sz;
+        return false;
+    }
+    image_size_ = static_cast<uint64_t>(header.total_blks) * header.blk_sz;
+    if (image_size_ > max_size_) {
+        LOG(ERROR) << "sparse image size " << image_size_ << " exceeds partition size "
+                   << max_size_;
+        return false;
+    }
+    chunk_header_size_ = header.chunk_hdr_sz;
+    block_size_ = header.blk_sz;
+    chunks_remaining_ = header.total_chunks;
+
+    skip_ = header.file_hdr_sz - sizeof(SparseHeader);
+    after_skip_ = chunks_remaining_ ? State::ChunkHeader : State::Done;
+    if (!chunks_remaining_ && image_size_) {
+        LOG(ERROR) << "sparse image has no chunks";
+        return false;
+    }
+    if (!chunks_remaining_ && !FinishImage()) {
+        return false;
+    }
+    state_ = skip_ ? State::Skip : after_skip_;
+    return true;
+}
+
+bool SparseImageWriter::ParseChunkHeader() {
+    ChunkHeader header;
+    memcpy(&header, pending_, sizeof(header));
+
+    uint64_t size = static_cast<uint64_t>(header.chunk_sz) * block_size_;
+    if (size > image_size_ - offset_) {
+        LOG(ERROR) << "sparse chunk at " << offset_ << " (" << size
+                   << " bytes) exceeds image size " << image_size_;
+        return false;
+    }
+    if (header.total_sz < chunk_header_size_) {
+        LOG(ERROR) << "bad sparse chunk size " << header.total_sz;
+        return false;
+    }
+    uint64_t data_size = header.total_sz - chunk_header_size_;
+    // Skip whatever the header has beyond the fields we know of.
+    skip_ = chunk_header_size_ - sizeof(ChunkHeader);
+
+    switch (header.chunk_type) {
+        case kChunkTypeRaw:
+            if (data_size != size) {
+                LOG(ERROR) << "sparse raw chunk has " << data_size << " bytes, expected " << size;
+                return false;
+            }
+            chunk_remaining_ = size;
+            after_skip_ = size ? State::Raw : State::ChunkHeader;
+            if (!size && !FinishChunk()) {
+                return false;
+            }
+            break;
+        case kChunkTypeFill:
+            if (data_size != sizeof(uint32_t)) {
+                LOG(ERROR) << "sparse fill chunk has " << data_size << " bytes";
+                return false;
+            }
+            chunk_remaining_ = size;
+            after_skip_ = State::FillPattern;
+            break;
+        case kChunkTypeDontCare:
+        case kChunkTypeCrc32:
+            // Checksums are optional, and the image is verified as a whole
+            // by AVB.
+            if (data_size != (header.chunk_type == kChunkTypeCrc32 ? sizeof(uint32_t) : 0)) {
+                LOG(ERROR) << "sparse chunk type " << std::hex << header.chunk_type << " has "
+                           << std::dec << data_size << " bytes";
+                return false;
+            }
+            if (header.chunk_type == kChunkTypeDontCare && size &&
+                (stale_ || writer_->write_observer()) && !writer_->Fill(offset_, size, 0)) {
+                return false;
+            }
+            offset_ += size;
+            skip_ += data_size;
+            if (!FinishChunk()) {
+                return false;
+            }
+            break;
+        default:
+            LOG(ERROR) << "unknown sparse chunk type " << std::hex << header.chunk_type;
+            return false;
+    }
+    state_ = skip_ ? State::Skip : after_skip_;
+    return true;
+}
+
+// Called once a chunk has been fully accounted for. Sets |after_skip_| to the
+// state that follows it.
+bool SparseImageWriter::FinishChunk() {
+    if (--chunks_remaining_) {
+        after_skip_ = State::ChunkHeader;
+        return true;
+    }
+    if (offset_ != image_size_) {
+        LOG(ERROR) << "sparse image chunks cover " << offset_ << " bytes, expected "
+                   << image_size_;
+        return false;
+    }
+    after_skip_ = State::Done;
+    return FinishImage();
+}
+
+// Called once every chunk has been accounted for.
+bool SparseImageWriter::FinishImage() {
+    if (stale_ && image_size_ < max_size_ &&
+        !writer_->Fill(image_size_, max_size_ - image_size_, 0)) {
+        return false;
+    }
+    return true;
+}
+
+bool SparseImageWriter::Feed(const char* data, size_t length) {
+    while (length) {
+        switch (state_) {
+            case State::FileHeader:
+                if (Gather(&data, &length, sizeof(SparseHeader)) && !ParseFileHeader()) {
+                    return false;
+                }
+                break;
+            case State::ChunkHeader:
+                if (Gather(&data, &length, sizeof(ChunkHeader)) && !ParseChunkHeader()) {
+                    return false;
+                }
+                break;
+            case State::Skip: {
+                size_t n = std::min(static_cast<uint64_t>(length), skip_);
+                data += n;
+                length -= n;
+                skip_ -= n;
+                if (!skip_) {
+                    state_ = after_skip_;
+                }
+                break;
+            }
+            case State::Raw: {
+                size_t n = std::min(static_cast<uint64_t>(length), chunk_remaining_);
+                if (!writer_->Write(offset_, data, n)) {
+                    return false;
+                }
+                data += n;
+                length -= n;
+                offset_ += n;
+                chunk_remaining_ -= n;
+                if (!chunk_remaining_) {
+                    if (!FinishChunk()) {
+                        return false;
+                    }
+                    state_ = after_skip_;
+                }
+                break;
+            }
+            case State::FillPattern: {
+                if (!Gather(&data, &length, sizeof(uint32_t))) {
+                    break;
+                }
+                uint32_t pattern;
+                memcpy(&pattern, pending_, sizeof(pattern));
+                if (!writer_->Fill(offset_, chunk_remaining_, pattern)) {
+                    return false;
+                }
+                offset_ += chunk_remaining_;
+                chunk_remaining_ = 0;
+                if (!FinishChunk()) {
+                    return false;
+                }
+                state_ = after_skip_;
+                break;
+            }
+            case State::Done:
+                LOG(ERROR) << length << " bytes of trailing data after sparse image";
+                return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "partition_writer.h"
+
+namespace android {
+namespace gsi {
+
+// Expands an Android sparse image onto a partition as the image is streamed
+// in, in pieces of any size. Only RAW chunk data is written as-is: FILL chunks
+// are expanded by the writer, and DONT_CARE chunks are skipped entirely. When
+// the writer has a write observer, DONT_CARE chunks are zeroed instead, since
+// AVB hashes them as zeroes.
+class SparseImageWriter final {
+  public:
+    // |max_size| is the size of the partition. A sparse image that describes
+    // less than that leaves the tail of the partition untouched, like a
+    // trailing DONT_CARE chunk.
+    //
+    // A new partition reads back as zeroes, but one that is written over may
+    // hold a previous image. With |stale|, DONT_CARE chunks and the tail are
+    // zeroed, so that the result is the same either way.
+    SparseImageWriter(PartitionWriter* writer, uint64_t max_size, bool stale = false);
+
+    // Returns true if |data| starts with the sparse image magic.
+    static bool IsSparseImage(const void* data, size_t length);
+
+    bool Feed(const char* data, size_t length);
+
+    // Number of bytes of the partition accounted for so far. This counts
+    // logical bytes, not sparse image bytes, and reaches the partition size
+    // once the last chunk has been processed.
+    uint64_t offset() const { return state_ == State::Done ? max_size_ : offset_; }
+
+  private:
+    enum class State {
+        FileHeader,
+        ChunkHeader,
+        Skip,
+        Raw,
+        FillPattern,
+        Done,
+    };
+
+    bool Gather(const char** data, size_t* length, size_t needed);
+    bool ParseFileHeader();
+    bool ParseChunkHeader();
+    bool FinishChunk();
+    bool FinishImage();
+
+    PartitionWriter* writer_;
+    uint64_t max_size_;
+    bool stale_;
+    State state_ = State::FileHeader;
+    // Header bytes collected so far, for headers split across pieces.
+    char pending_[32];
+    size_t pending_length_ = 0;
+
+    uint32_t chunk_header_size_ = 0;
+    uint32_t block_size_ = 0;
+    uint64_t image_size_ = 0;
+    uint32_t chunks_remaining_ = 0;
+
+    // Logical offset of the next chunk, or of the rest of the current RAW
+    // chunk.
+    uint64_t offset_ = 0;
+    // Bytes left in the current RAW or FILL chunk.
+    uint64_t chunk_remaining_ = 0;
+    // Bytes to skip, and the state to resume with afterwards.
+    uint64_t skip_ = 0;
+    State after_skip_ = State::ChunkHeader;
+};
+
+}  // namespace gsi
+}  // namespace android
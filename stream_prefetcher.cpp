@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "stream_prefetcher.h"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <android-base/logging.h>
+
+namespace android {
+namespace gsi {
+
+StreamPrefetcher::StreamPrefetcher(int fd, uint64_t bytes, size_t buffer_size, size_t depth)
+    : fd_(fd), bytes_(bytes), buffer_size_(buffer_size), slots_(depth) {}
+
+StreamPrefetcher::~StreamPrefetcher() {
+    Stop();
+}
+
+bool StreamPrefetcher::Start() {
+    wakeup_fd_.reset(eventfd(0, EFD_CLOEXEC));
+    if (wakeup_fd_ < 0) {
+        PLOG(ERROR) << "eventfd";
+        return false;
+    }
+    // Don't allocate more buffers than the stream can fill.
+    uint64_t pieces = (bytes_ + buffer_size_ - 1) / buffer_size_;
+    slots_.resize(std::max(static_cast<uint64_t>(1), std::min(pieces, uint64_t(slots_.size()))));
+    for (auto& slot : slots_) {
+        slot.buffer = std::make_unique<StagingBuffer>(buffer_size_);
+        if (!slot.buffer->ok()) {
+            return false;
+        }
+    }
+    thread_ = std::thread([this]() { Run(); });
+    return true;
+}
+
+void StreamPrefetcher::Stop() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    if (wakeup_fd_ >= 0) {
+        uint64_t value = 1;
+        if (TEMP_FAILURE_RETRY(write(wakeup_fd_, &value, sizeof(value))) < 0) {
+            PLOG(ERROR) << "write eventfd";
+        }
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void StreamPrefetcher::Run() {
+    for (uint64_t offset = 0; offset < bytes_;) {
+        Slot* slot;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopped_ || filled_ - consumed_ < slots_.size(); });
+            if (stopped_) {
+                return;
+            }
+            slot = &slots_[filled_ % slots_.size()];
+        }
+
+        size_t length = std::min(static_cast<uint64_t>(buffer_size_), bytes_ - offset);
+        bool ok = Fill(slot, length);
+        {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (ok) {
+                filled_++;
+            } else {
+                failed_ = true;
+            }
+        }
+        cv_.notify_all();
+        if (!ok) {
+            return;
+        }
+        offset += length;
+    }
+}
+
+// Block until the stream has data, or until Stop() is called. A blocking
+// read() on a stalled pipe could otherwise never be interrupted.
+bool StreamPrefetcher::WaitReadable() {
+    struct pollfd fds[2] = {
+            {.fd = fd_, .events = POLLIN, .revents = 0},
+            {.fd = wakeup_fd_, .events = POLLIN, .revents = 0},
+    };
+    if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) < 0) {
+        PLOG(ERROR) << "poll gsi stream";
+        return false;
+    }
+    return !(fds[1].revents & POLLIN);
+}
+
+bool StreamPrefetcher::Fill(Slot* slot, size_t length) {
+    char* pos = slot->buffer->data();
+    size_t remaining = length;
+    while (remaining) {
+        if (!WaitReadable()) {
+            return false;
+        }
+        ssize_t rv = TEMP_FAILURE_RETRY(read(fd_, pos, remaining));
+        if (rv < 0) {
+            PLOG(ERROR) << "read gsi chunk";
+            return false;
+        }
+        if (rv == 0) {
+            LOG(ERROR) << "no bytes left in stream";
+            return false;
+        }
+        pos += rv;
+        remaining -= rv;
+    }
+    slot->length = length;
+    return true;
+}
+
+bool StreamPrefetcher::Next(const char** data, size_t* length) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return filled_ > consumed_ || failed_ || stopped_; });
+    if (filled_ == consumed_) {
+        return false;
+    }
+    const Slot& slot = slots_[consumed_ % slots_.size()];
+    *data = slot.buffer->data();
+    *length = slot.length;
+    return true;
+}
+
+void StreamPrefetcher::Release() {
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        consumed_++;
+    }
+    cv_.notify_all();
+}
+
+}  // namespace gsi
+}  // namespace android
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "partition_writer.h"
+
+namespace android {
+namespace gsi {
+
+// Number of staging buffers that can be filled ahead of the device writes.
+static constexpr size_t kPrefetchDepth = 4;
+
+// Reads a stream into a ring of staging buffers on a separate thread, so that
+// reading the next pieces of the stream overlaps with writing the current one
+// to the partition device.
+class StreamPrefetcher final {
+  public:
+    // Reads exactly |bytes| from |fd| in pieces of at most |buffer_size|.
+    StreamPrefetcher(int fd, uint64_t bytes, size_t buffer_size = kStagingBufferSize,
+                     size_t depth = kPrefetchDepth);
+    ~StreamPrefetcher();
+    StreamPrefetcher(const StreamPrefetcher&) = delete;
+    StreamPrefetcher& operator=(const StreamPrefetcher&) = delete;
+
+    bool Start();
+
+    // Wait for the next filled buffer. On success, |*data| and |*length|
+    // describe it and it stays valid until Release() is called. Returns false
+    // if the stream failed or ended early.
+    bool Next(const char** data, size_t* length);
+    void Release();
+
+  private:
+    struct Slot {
+        std::unique_ptr<StagingBuffer> buffer;
+        size_t length = 0;
+    };
+
+    void Run();
+    bool WaitReadable();
+    bool Fill(Slot* slot, size_t length);
+    void Stop();
+
+    int fd_;
+    uint64_t bytes_;
+    size_t buffer_size_;
+    std::vector<Slot> slots_;
+    // Used to wake the reader if it is blocked waiting for the stream.
+    android::base::unique_fd wakeup_fd_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    uint64_t filled_ = 0;
+    uint64_t consumed_ = 0;
+    bool failed_ = false;
+    bool stopped_ = false;
+    std::thread thread_;
+};
+
+}  // namespace gsi
+}  // namespace android
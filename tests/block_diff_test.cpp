@@ -0,0 +1,333 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "block_diff.h"
+#include "partition_writer.h"
+#include "stream_parser_test.h"
+
+using android::base::TemporaryFile;
+using android::gsi::BlockDiffHeader;
+using android::gsi::BlockDiffOp;
+using android::gsi::BlockDiffOpType;
+using android::gsi::BlockDiffWriter;
+using android::gsi::FeedInPieces;
+using android::gsi::kBlockDiffMagic;
+using android::gsi::kBlockDiffMajorVersion;
+using android::gsi::kSplitPieces;
+using android::gsi::kStagingBufferSize;
+using android::gsi::MalformedInput;
+using android::gsi::MalformedInputName;
+using android::gsi::PartitionWriter;
+
+static constexpr uint32_t kBlockSize = 4096;
+// Large enough that copies go through the staging buffer in several pieces.
+static constexpr uint64_t kTotalBlocks = kStagingBufferSize / kBlockSize + 256;
+
+// A block filled with its own index, so that moved blocks can be told apart.
+static std::string BlockData(uint32_t index) {
+    std::string data(kBlockSize, '\0');
+    for (size_t i = 0; i < data.size(); i += sizeof(index)) {
+        memcpy(&data[i], &index, sizeof(index));
+    }
+    return data;
+}
+
+// Builds a block diff operation by operation. The header is written as is,
+// so tests can change it to produce malformed diffs.
+class BlockDiffBuilder {
+  public:
+    explicit BlockDiffBuilder(uint64_t total_blocks) {
+        header.magic = kBlockDiffMagic;
+        header.major_version = kBlockDiffMajorVersion;
+        header.header_size = sizeof(BlockDiffHeader);
+        header.block_size = kBlockSize;
+        header.op_header_size = sizeof(BlockDiffOp);
+        header.total_blocks = total_blocks;
+        header.op_count = 0;
+    }
+
+    void Copy(uint64_t dst, uint64_t src, uint64_t count) {
+        Op(BlockDiffOpType::Copy, dst, src, count);
+    }
+    void Literal(uint64_t dst, const std::string& data) {
+        Op(BlockDiffOpType::Literal, dst, 0, data.size() / kBlockSize);
+        ops_ += data;
+    }
+    void Zero(uint64_t dst, uint64_t count) { Op(BlockDiffOpType::Zero, dst, 0, count); }
+
+    void Op(BlockDiffOpType type, uint64_t dst, uint64_t src, uint64_t count) {
+        BlockDiffOp op = {static_cast<uint32_t>(type), 0, dst, src, count};
+        ops_.append(reinterpret_cast<const char*>(&op), sizeof(op));
+        ops_.append(header.op_header_size - sizeof(op), '\0');
+        header.op_count++;
+    }
+
+    std::string Build() const {
+        std::string diff(reinterpret_cast<const char*>(&header), sizeof(header));
+        diff.append(std::max<size_t>(header.header_size, sizeof(header)) - sizeof(header), '\0');
+        return diff + ops_;
+    }
+
+    BlockDiffHeader header;
+
+  private:
+    std::string ops_;
+};
+
+class BlockDiffTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        ASSERT_EQ(lseek(device_.fd, 0, SEEK_SET), 0);
+        for (uint32_t i = 0; i < kTotalBlocks; i++) {
+            std::string block = BlockData(i);
+            ASSERT_TRUE(android::base::WriteFully(device_.fd, block.data(), block.size()));
+        }
+    }
+
+    // Applies |diff| in pieces of |piece| bytes.
+    bool Apply(const std::string& diff, size_t piece = SIZE_MAX) {
+        diff_ = std::make_unique<BlockDiffWriter>(&writer_, device_.fd, kTotalBlocks * kBlockSize);
+        return FeedInPieces(diff_.get(), diff, piece);
+    }
+
+    std::string ReadBlock(uint64_t index) {
+        std::string data(kBlockSize, '\0');
+        EXPECT_TRUE(android::base::ReadFullyAtOffset(device_.fd, data.data(), data.size(),
+                                                     index * kBlockSize));
+        return data;
+    }
+
+    // Checks that block |index| holds what block |original| held before the
+    // diff was applied.
+    void ExpectBlockFrom(uint64_t index, uint32_t original) {
+        EXPECT_EQ(ReadBlock(index), BlockData(original)) << "block " << index;
+    }
+
+    // Moves blocks down from a range that is zeroed afterwards, rewrites two
+    // blocks, and keeps the rest.
+    static std::string MixedDiff() {
+        BlockDiffBuilder builder(kTotalBlocks);
+        builder.Copy(0, 6, 2);
+        builder.Literal(2, BlockData(1000) + BlockData(1001));
+        builder.Copy(4, 8, 2);
+        builder.Zero(6, 10);
+        builder.Copy(16, 16, kTotalBlocks - 16);
+        return builder.Build();
+    }
+
+    void ExpectMixedDiff() {
+        ExpectBlockFrom(0, 6);
+        ExpectBlockFrom(1, 7);
+        ExpectBlockFrom(2, 1000);
+        ExpectBlockFrom(3, 1001);
+        ExpectBlockFrom(4, 8);
+        ExpectBlockFrom(5, 9);
+        for (uint64_t i = 6; i < 16; i++) {
+            EXPECT_EQ(ReadBlock(i), std::string(kBlockSize, '\0')) << "block " << i;
+        }
+        ExpectBlockFrom(16, 16);
+        ExpectBlockFrom(kTotalBlocks - 1, kTotalBlocks - 1);
+    }
+
+    TemporaryFile device_;
+    PartitionWriter writer_{device_.fd, device_.path};
+    std::unique_ptr<BlockDiffWriter> diff_;
+};
+
+TEST_F(BlockDiffTest, CopyLiteralZero) {
+    ASSERT_TRUE(Apply(MixedDiff()));
+    EXPECT_EQ(diff_->offset(), kTotalBlocks * kBlockSize);
+    ExpectMixedDiff();
+}
+
+// Operation headers and literal data can be split anywhere.
+TEST_F(BlockDiffTest, SplitAnywhere) {
+    std::string diff = MixedDiff();
+    for (size_t piece : kSplitPieces) {
+        SCOPED_TRACE(piece);
+        SetUp();
+        ASSERT_TRUE(Apply(diff, piece));
+        EXPECT_EQ(diff_->offset(), kTotalBlocks * kBlockSize);
+        ExpectMixedDiff();
+    }
+}
+
+// Fields added to operations in later minor versions sit between the
+// operation and its literal data, and are skipped.
+TEST_F(BlockDiffTest, ExtendedOpHeaderBeforeLiteral) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.header.op_header_size = sizeof(BlockDiffOp) + 16;
+    builder.Literal(0, BlockData(1000));
+    builder.Copy(1, 1, kTotalBlocks - 1);
+    ASSERT_TRUE(Apply(builder.Build()));
+    ExpectBlockFrom(0, 1000);
+    ExpectBlockFrom(1, 1);
+}
+
+// An identity diff only claims the blocks; nothing is read or written.
+TEST_F(BlockDiffTest, CopyOntoItself) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.Copy(0, 0, kTotalBlocks);
+    ASSERT_TRUE(Apply(builder.Build()));
+    EXPECT_EQ(diff_->offset(), kTotalBlocks * kBlockSize);
+    ExpectBlockFrom(0, 0);
+    ExpectBlockFrom(kTotalBlocks - 1, kTotalBlocks - 1);
+}
+
+// Operations need not be in block order. A run can be moved out of the way
+// before the blocks it came from are rewritten.
+TEST_F(BlockDiffTest, OutOfOrderOps) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.Copy(4, 0, 2);
+    builder.Literal(0, BlockData(1000) + BlockData(1001));
+    builder.Zero(2, 2);
+    builder.Copy(6, 6, kTotalBlocks - 6);
+    ASSERT_TRUE(Apply(builder.Build(), 4095));
+    ExpectBlockFrom(0, 1000);
+    ExpectBlockFrom(1, 1001);
+    EXPECT_EQ(ReadBlock(2), std::string(kBlockSize, '\0'));
+    EXPECT_EQ(ReadBlock(3), std::string(kBlockSize, '\0'));
+    ExpectBlockFrom(4, 0);
+    ExpectBlockFrom(5, 1);
+    ExpectBlockFrom(6, 6);
+}
+
+// A run copied one block towards the start overlaps its source, and must be
+// copied front to back across staging buffer pieces, like memmove.
+TEST_F(BlockDiffTest, SelfOverlappingCopyDown) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.Copy(0, 1, kTotalBlocks - 1);
+    builder.Zero(kTotalBlocks - 1, 1);
+    ASSERT_TRUE(Apply(builder.Build()));
+    for (uint64_t i = 0; i < kTotalBlocks - 1; i++) {
+        ASSERT_EQ(ReadBlock(i), BlockData(i + 1)) << "block " << i;
+    }
+}
+
+// Likewise one block towards the end, copied back to front.
+TEST_F(BlockDiffTest, SelfOverlappingCopyUp) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.Copy(1, 0, kTotalBlocks - 1);
+    builder.Zero(0, 1);
+    ASSERT_TRUE(Apply(builder.Build()));
+    for (uint64_t i = 1; i < kTotalBlocks; i++) {
+        ASSERT_EQ(ReadBlock(i), BlockData(i - 1)) << "block " << i;
+    }
+}
+
+// The diff is applied in place, so a block that was already rewritten no
+// longer holds the data the diff was computed against.
+TEST_F(BlockDiffTest, CopyFromOverwrittenRejected) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.Literal(0, BlockData(1000));
+    builder.Copy(1, 0, 1);
+    builder.Copy(2, 2, kTotalBlocks - 2);
+    EXPECT_FALSE(Apply(builder.Build()));
+    // The rejected copy did not touch the device.
+    ExpectBlockFrom(1, 1);
+}
+
+TEST_F(BlockDiffTest, CopyFromPartlyOverwrittenRejected) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    builder.Zero(5, 1);
+    builder.Copy(0, 2, 4);
+    EXPECT_FALSE(Apply(builder.Build()));
+}
+
+// The partition is complete once the last operation is applied, and the diff
+// must end there.
+TEST_F(BlockDiffTest, EndsWithLastOp) {
+    std::string diff = MixedDiff();
+    ASSERT_TRUE(Apply(diff.substr(0, diff.size() - sizeof(BlockDiffOp))));
+    EXPECT_EQ(diff_->offset(), 16 * kBlockSize);
+    SetUp();
+    EXPECT_FALSE(Apply(diff + std::string(sizeof(BlockDiffOp), '\0')));
+}
+
+using MalformedDiff = MalformedInput<BlockDiffBuilder>;
+
+class BlockDiffMalformedTest : public BlockDiffTest,
+                               public ::testing::WithParamInterface<MalformedDiff> {};
+
+TEST_P(BlockDiffMalformedTest, Rejected) {
+    BlockDiffBuilder builder(kTotalBlocks);
+    GetParam().make(&builder);
+    std::string diff = builder.Build();
+    EXPECT_FALSE(Apply(diff));
+    EXPECT_FALSE(Apply(diff, 1));
+}
+
+// Diffs that break the header rules, or the rule that every block is written
+// by exactly one operation.
+static const MalformedDiff kMalformedDiffs[] = {
+        {"BadMagic",
+         [](BlockDiffBuilder* b) {
+             b->header.magic++;
+             b->Zero(0, kTotalBlocks);
+         }},
+        {"BadMajorVersion",
+         [](BlockDiffBuilder* b) {
+             b->header.major_version++;
+             b->Zero(0, kTotalBlocks);
+         }},
+        {"HeaderTooSmall",
+         [](BlockDiffBuilder* b) {
+             b->header.header_size = sizeof(BlockDiffHeader) - 1;
+             b->Zero(0, kTotalBlocks);
+         }},
+        {"OpHeaderTooSmall",
+         [](BlockDiffBuilder* b) {
+             b->header.op_header_size = sizeof(BlockDiffOp) - 8;
+         }},
+        {"UnalignedBlockSize",
+         [](BlockDiffBuilder* b) {
+             b->header.block_size = kBlockSize + 1;
+             b->Zero(0, kTotalBlocks);
+         }},
+        {"ResizesPartition",
+         [](BlockDiffBuilder* b) {
+             b->header.total_blocks = kTotalBlocks + 1;
+             b->Zero(0, kTotalBlocks + 1);
+         }},
+        {"NoOps", [](BlockDiffBuilder*) {}},
+        {"EmptyOp",
+         [](BlockDiffBuilder* b) {
+             b->Zero(0, 0);
+             b->Zero(0, kTotalBlocks);
+         }},
+        {"UnknownOp",
+         [](BlockDiffBuilder* b) { b->Op(static_cast<BlockDiffOpType>(4), 0, 0, kTotalBlocks); }},
+        {"WritePastEnd", [](BlockDiffBuilder* b) { b->Zero(1, kTotalBlocks); }},
+        {"CopyPastEnd", [](BlockDiffBuilder* b) { b->Copy(0, 1, kTotalBlocks); }},
+        {"WrittenTwice",
+         [](BlockDiffBuilder* b) {
+             b->Zero(0, 2);
+             b->Zero(1, kTotalBlocks - 1);
+         }},
+        {"NotCovered", [](BlockDiffBuilder* b) { b->Zero(0, kTotalBlocks - 1); }},
+};
+
+INSTANTIATE_TEST_SUITE_P(BlockDiff, BlockDiffMalformedTest, ::testing::ValuesIn(kMalformedDiffs),
+                         MalformedInputName());
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+
+#include <gtest/gtest.h>
+#include <lz4frame.h>
+
+#include "decompressor.h"
+
+using android::gsi::Compression;
+using android::gsi::Decompressor;
+
+// Data that repeats with a period of 16KiB, so matches reach back across
+// several small blocks.
+static std::string RepeatingData(size_t size) {
+    std::string period(16 * 1024, '\0');
+    srand(1);
+    for (auto& c : period) {
+        c = rand();
+    }
+    std::string data;
+    while (data.size() < size) {
+        data += period;
+    }
+    data.resize(size);
+    return data;
+}
+
+// Compresses |data| as one frame, flushing the compressor every |flush_every|
+// bytes, which ends the current block early.
+static std::string Lz4Compress(const std::string& data, bool linked, size_t flush_every) {
+    LZ4F_preferences_t prefs = {};
+    prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs.frameInfo.blockMode = linked ? LZ4F_blockLinked : LZ4F_blockIndependent;
+
+    LZ4F_cctx* ctx;
+    EXPECT_FALSE(LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION)));
+    std::string out(LZ4F_compressBound(data.size(), &prefs) + LZ4F_HEADER_SIZE_MAX +
+                            (data.size() / flush_every + 1) * 16,
+                    '\0');
+    size_t pos = LZ4F_compressBegin(ctx, out.data(), out.size(), &prefs);
+    for (size_t i = 0; i < data.size(); i += flush_every) {
+        size_t n = std::min(flush_every, data.size() - i);
+        pos += LZ4F_compressUpdate(ctx, &out[pos], out.size() - pos, &data[i], n, nullptr);
+        pos += LZ4F_flush(ctx, &out[pos], out.size() - pos, nullptr);
+    }
+    pos += LZ4F_compressEnd(ctx, &out[pos], out.size() - pos, nullptr);
+    LZ4F_freeCompressionContext(ctx);
+    out.resize(pos);
+    return out;
+}
+
+// Feeds |input| in pieces of |piece| bytes and returns the output.
+static bool Decompress(const std::string& input, size_t piece, std::string* output) {
+    auto decompressor = Decompressor::Create(Compression::Lz4, [&](const char* data, size_t n) {
+        output->append(data, n);
+        return true;
+    });
+    if (!decompressor) {
+        return false;
+    }
+    for (size_t i = 0; i < input.size(); i += piece) {
+        if (!decompressor->Feed(&input[i], std::min(piece, input.size() - i))) {
+            return false;
+        }
+    }
+    return decompressor->Finish();
+}
+
+// Blocks cut short by flushes reference output from several blocks back,
+// which must still be in the dictionary.
+TEST(Lz4DecompressorTest, LinkedShortBlocks) {
+    std::string data = RepeatingData(1024 * 1024);
+    std::string compressed = Lz4Compress(data, true, 4096);
+    std::string output;
+    ASSERT_TRUE(Decompress(compressed, 65536, &output));
+    EXPECT_EQ(output, data);
+}
+
+TEST(Lz4DecompressorTest, LinkedFullBlocks) {
+    std::string data = RepeatingData(1024 * 1024 + 123);
+    std::string compressed = Lz4Compress(data, true, data.size());
+    std::string output;
+    ASSERT_TRUE(Decompress(compressed, 1000, &output));
+    EXPECT_EQ(output, data);
+}
+
+TEST(Lz4DecompressorTest, IndependentBlocksInOrder) {
+    std::string data = RepeatingData(4 * 1024 * 1024 + 5);
+    std::string compressed = Lz4Compress(data, false, 100 * 1024);
+    std::string output;
+    ASSERT_TRUE(Decompress(compressed, 7000, &output));
+    EXPECT_EQ(output, data);
+}
+
+TEST(Lz4DecompressorTest, Truncated) {
+    std::string data = RepeatingData(256 * 1024);
+    std::string compressed = Lz4Compress(data, false, data.size());
+    compressed.resize(compressed.size() / 2);
+    std::string output;
+    EXPECT_FALSE(Decompress(compressed, compressed.size(), &output));
+}
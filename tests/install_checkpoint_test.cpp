@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <openssl/sha.h>
+
+#include "install_checkpoint.h"
+
+using android::gsi::InstallCheckpoint;
+using android::gsi::ParseCheckpoint;
+using android::gsi::SerializeCheckpoint;
+
+static InstallCheckpoint HashedCheckpoint() {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, "data", 4);
+    auto state = reinterpret_cast<const uint8_t*>(&ctx);
+
+    InstallCheckpoint checkpoint;
+    checkpoint.size = 4ULL << 30;
+    checkpoint.written = 3ULL << 30;
+    checkpoint.digest_state.assign(state, state + sizeof(ctx));
+    checkpoint.expected_digest.assign(SHA256_DIGEST_LENGTH, 0xab);
+    return checkpoint;
+}
+
+static void ExpectEqual(const InstallCheckpoint& a, const InstallCheckpoint& b) {
+    EXPECT_EQ(a.size, b.size);
+    EXPECT_EQ(a.written, b.written);
+    EXPECT_EQ(a.digest_state, b.digest_state);
+    EXPECT_EQ(a.expected_digest, b.expected_digest);
+}
+
+TEST(InstallCheckpointTest, RoundTrip) {
+    InstallCheckpoint checkpoint = HashedCheckpoint();
+    InstallCheckpoint parsed;
+    ASSERT_TRUE(ParseCheckpoint(SerializeCheckpoint(checkpoint), checkpoint.size, &parsed));
+    ExpectEqual(parsed, checkpoint);
+}
+
+TEST(InstallCheckpointTest, RoundTripWithoutDigests) {
+    InstallCheckpoint checkpoint;
+    checkpoint.size = 1 << 20;
+    checkpoint.written = 0;
+    std::string content = SerializeCheckpoint(checkpoint);
+    EXPECT_EQ(content, "1 1048576 0 - -\n");
+
+    InstallCheckpoint parsed = HashedCheckpoint();
+    ASSERT_TRUE(ParseCheckpoint(content, 0, &parsed));
+    ExpectEqual(parsed, checkpoint);
+}
+
+// A resumed install that does not know the image size yet takes it from the
+// checkpoint; otherwise the sizes must match.
+TEST(InstallCheckpointTest, ImageSize) {
+    InstallCheckpoint checkpoint = HashedCheckpoint();
+    std::string content = SerializeCheckpoint(checkpoint);
+    InstallCheckpoint parsed;
+    EXPECT_TRUE(ParseCheckpoint(content, 0, &parsed));
+    EXPECT_EQ(parsed.size, checkpoint.size);
+    EXPECT_FALSE(ParseCheckpoint(content, checkpoint.size + 4096, &parsed));
+}
+
+TEST(InstallCheckpointTest, Rejected) {
+    std::string state(2 * sizeof(SHA256_CTX), 'a');
+    std::string digest(2 * SHA256_DIGEST_LENGTH, 'b');
+    struct {
+        const char* name;
+        std::string content;
+    } cases[] = {
+            {"empty", ""},
+            {"too few fields", "1 4096 0 -"},
+            {"too many fields", "1 4096 0 - - -"},
+            {"old version", "0 4096 0 - -"},
+            {"newer version", "2 4096 0 - -"},
+            {"bad version", "x 4096 0 - -"},
+            {"bad size", "1 4k 0 - -"},
+            {"bad written", "1 4096 -1 - -"},
+            {"written past size", "1 4096 8192 - -"},
+            {"short digest state", "1 4096 0 " + state.substr(2) + " -"},
+            {"long digest state", "1 4096 0 " + state + "00 -"},
+            {"odd digest state", "1 4096 0 " + state.substr(1) + " -"},
+            {"non-hex digest state", "1 4096 0 " + state.substr(2) + "zz -"},
+            {"short expected digest", "1 4096 0 - " + digest.substr(2)},
+            {"long expected digest", "1 4096 0 - " + digest + "00"},
+            {"non-hex expected digest", "1 4096 0 - " + digest.substr(2) + "g0"},
+    };
+    for (const auto& c : cases) {
+        InstallCheckpoint parsed;
+        EXPECT_FALSE(ParseCheckpoint(c.content, 0, &parsed)) << c.name;
+    }
+}
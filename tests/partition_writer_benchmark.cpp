@@ -0,0 +1,276 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <libdm/loop_control.h>
+
+#include "partition_writer.h"
+#include "zero_block.h"
+
+using namespace std::chrono_literals;
+using android::base::TemporaryFile;
+using android::base::unique_fd;
+using android::dm::LoopDevice;
+using android::gsi::IsZeroBlock;
+using android::gsi::PartitionWriter;
+
+static constexpr uint64_t kImageSize = 256 * 1024 * 1024;
+
+// Creates a source image of kImageSize bytes of non-zero data.
+static bool CreateSourceImage(const TemporaryFile& file) {
+    std::string block(1024 * 1024, 'G');
+    for (uint64_t i = 0; i < kImageSize; i += block.size()) {
+        if (!android::base::WriteFully(file.fd, block.data(), block.size())) {
+            return false;
+        }
+    }
+    return fsync(file.fd) == 0;
+}
+
+// The loop PartitionInstaller used before PartitionWriter: one 4KiB read and
+// one 4KiB write per iteration.
+static bool LegacyCopy(int stream_fd, int device_fd, uint64_t bytes) {
+    static const size_t kBlockSize = 4096;
+    auto buffer = std::make_unique<char[]>(kBlockSize);
+
+    uint64_t remaining = bytes;
+    while (remaining) {
+        size_t max_to_read = std::min(static_cast<uint64_t>(kBlockSize), remaining);
+        ssize_t rv = TEMP_FAILURE_RETRY(read(stream_fd, buffer.get(), max_to_read));
+        if (rv <= 0) {
+            return false;
+        }
+        if (!android::base::WriteFully(device_fd, buffer.get(), rv)) {
+            return false;
+        }
+        remaining -= rv;
+    }
+    return true;
+}
+
+static void BM_LegacyCopy(benchmark::State& state) {
+    TemporaryFile source;
+    TemporaryFile device;
+    if (!CreateSourceImage(source)) {
+        state.SkipWithError("could not create source image");
+        return;
+    }
+    for (auto _ : state) {
+        unique_fd stream(open(source.path, O_RDONLY | O_CLOEXEC));
+        lseek(device.fd, 0, SEEK_SET);
+        if (!LegacyCopy(stream, device.fd, kImageSize) || fsync(device.fd)) {
+            state.SkipWithError("copy failed");
+            return;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_LegacyCopy)->Unit(benchmark::kMillisecond)->UseRealTime();
+
+enum class WriterMode { Buffered, DirectIo, ZeroCopy };
+
+static void BM_PartitionWriter(benchmark::State& state) {
+    TemporaryFile source;
+    TemporaryFile device;
+    if (!CreateSourceImage(source)) {
+        state.SkipWithError("could not create source image");
+        return;
+    }
+    PartitionWriter writer(device.fd, device.path);
+    auto mode = static_cast<WriterMode>(state.range(0));
+    if (mode == WriterMode::DirectIo && !writer.EnableDirectIo()) {
+        state.SkipWithError("O_DIRECT is not supported");
+        return;
+    }
+    writer.set_zero_copy(mode == WriterMode::ZeroCopy);
+    for (auto _ : state) {
+        unique_fd stream(open(source.path, O_RDONLY | O_CLOEXEC));
+        if (!writer.WriteFromStream(stream, 0, kImageSize, nullptr) || fsync(device.fd)) {
+            state.SkipWithError("copy failed");
+            return;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_PartitionWriter)
+        ->ArgName("mode")
+        ->Arg(static_cast<int>(WriterMode::Buffered))
+        ->Arg(static_cast<int>(WriterMode::DirectIo))
+        ->Arg(static_cast<int>(WriterMode::ZeroCopy))
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+
+// Same as BM_PartitionWriter, but the source is a pipe fed by another thread,
+// which is how gsi_tool and adb deliver images.
+static void BM_PartitionWriterFromPipe(benchmark::State& state) {
+    TemporaryFile source;
+    TemporaryFile device;
+    if (!CreateSourceImage(source)) {
+        state.SkipWithError("could not create source image");
+        return;
+    }
+    PartitionWriter writer(device.fd, device.path);
+    writer.set_zero_copy(state.range(0));
+    for (auto _ : state) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC)) {
+            state.SkipWithError("pipe2 failed");
+            return;
+        }
+        unique_fd pipe_read(pipefd[0]);
+        std::thread feeder([&source, fd = pipefd[1]]() {
+            unique_fd pipe_write(fd);
+            unique_fd stream(open(source.path, O_RDONLY | O_CLOEXEC));
+            LegacyCopy(stream, pipe_write, kImageSize);
+        });
+        bool ok = writer.WriteFromStream(pipe_read, 0, kImageSize, nullptr);
+        feeder.join();
+        if (!ok || fsync(device.fd)) {
+            state.SkipWithError("copy failed");
+            return;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_PartitionWriterFromPipe)
+        ->ArgName("zero_copy")
+        ->Arg(0)
+        ->Arg(1)
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+
+static void BM_IsZeroBlock(benchmark::State& state) {
+    std::string block(state.range(0), '\0');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(IsZeroBlock(block.data(), block.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * block.size());
+}
+BENCHMARK(BM_IsZeroBlock)->Arg(4096)->Arg(1024 * 1024);
+
+// The usual alternative: compare against a block of zeroes.
+static void BM_IsZeroBlockMemcmp(benchmark::State& state) {
+    std::string block(state.range(0), '\0');
+    std::string zeroes(state.range(0), '\0');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(memcmp(block.data(), zeroes.data(), block.size()) == 0);
+    }
+    state.SetBytesProcessed(state.iterations() * block.size());
+}
+BENCHMARK(BM_IsZeroBlockMemcmp)->Arg(4096)->Arg(1024 * 1024);
+
+// Writes an image that is half zeroes, in 1MiB runs, from memory the way the
+// ashmem path does. BLKZEROOUT needs a block device, so the target is a loop
+// device over a temporary file.
+static void BM_PartitionWriterZeroElision(benchmark::State& state) {
+    static constexpr size_t kPieceSize = 4 * 1024 * 1024;
+    static constexpr size_t kRunSize = 1024 * 1024;
+
+    TemporaryFile backing;
+    if (ftruncate(backing.fd, kImageSize)) {
+        state.SkipWithError("could not size backing file");
+        return;
+    }
+    LoopDevice loop(backing.fd, 10s);
+    if (!loop.valid()) {
+        state.SkipWithError("could not create loop device");
+        return;
+    }
+    unique_fd device(open(loop.device().c_str(), O_RDWR | O_CLOEXEC));
+    if (device < 0) {
+        state.SkipWithError("could not open loop device");
+        return;
+    }
+
+    std::string piece(kPieceSize, 'G');
+    for (size_t i = 0; i < piece.size(); i += 2 * kRunSize) {
+        memset(&piece[i], 0, kRunSize);
+    }
+
+    PartitionWriter writer(device, loop.device());
+    writer.set_zero_elision(state.range(0));
+    for (auto _ : state) {
+        for (uint64_t offset = 0; offset < kImageSize; offset += piece.size()) {
+            if (!writer.Write(offset, piece.data(), piece.size())) {
+                state.SkipWithError("write failed");
+                return;
+            }
+        }
+        if (fsync(device)) {
+            state.SkipWithError("fsync failed");
+            return;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+}
+BENCHMARK(BM_PartitionWriterZeroElision)
+        ->ArgName("elision")
+        ->Arg(0)
+        ->Arg(1)
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+
+// Buffered copy with and without incremental writeback. The final fsync is
+// reported separately, since bounding it is the point of writeback.
+static void BM_PartitionWriterWriteback(benchmark::State& state) {
+    TemporaryFile source;
+    TemporaryFile device;
+    if (!CreateSourceImage(source)) {
+        state.SkipWithError("could not create source image");
+        return;
+    }
+    PartitionWriter writer(device.fd, device.path);
+    writer.set_writeback(state.range(0));
+    double flush_ms = 0;
+    for (auto _ : state) {
+        unique_fd stream(open(source.path, O_RDONLY | O_CLOEXEC));
+        if (!writer.WriteFromStream(stream, 0, kImageSize, nullptr)) {
+            state.SkipWithError("copy failed");
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if (fsync(device.fd)) {
+            state.SkipWithError("fsync failed");
+            return;
+        }
+        flush_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                              start)
+                            .count();
+    }
+    state.SetBytesProcessed(state.iterations() * kImageSize);
+    state.counters["flush_ms"] = benchmark::Counter(flush_ms, benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_PartitionWriterWriteback)
+        ->ArgName("writeback")
+        ->Arg(0)
+        ->Arg(1)
+        ->Unit(benchmark::kMillisecond)
+        ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,166 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/unique_fd.h>
+#include <android/gsi/IGsiService.h>
+#include <gtest/gtest.h>
+#include <libgsi/libgsi.h>
+#include <libgsi/libgsid.h>
+
+#include "file_paths.h"
+
+using namespace android::gsi;
+using namespace std::chrono_literals;
+using android::sp;
+using android::base::unique_fd;
+using android::os::ParcelFileDescriptor;
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr char kPartitionName[] = "query_latency_test";
+static constexpr int64_t kPartitionSize = 64 * 1024 * 1024;
+static constexpr size_t kWriteSize = 1024 * 1024;
+// The stream is fed slowly, so that the install is still in progress while
+// queries are made.
+static constexpr auto kWriteInterval = 50ms;
+
+// Status queries must not wait on the data path.
+static constexpr auto kMaxP99Latency = 50ms;
+
+class QueryLatencyTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        gsid_ = GetGsiService();
+        ASSERT_NE(gsid_, nullptr);
+        if (IsGsiRunning() || IsGsiInstalled()) {
+            GTEST_SKIP() << "a DSU is installed";
+        }
+    }
+
+    void TearDown() override {
+        if (!installing_) {
+            return;
+        }
+        bool ok;
+        gsid_->cancelGsiInstall(&ok);
+        gsid_->removeGsi(&ok);
+    }
+
+    // Calls each query in turn until |done|, and returns the latency of
+    // every call.
+    std::vector<Clock::duration> MeasureQueries(const std::atomic<bool>& done) {
+        std::vector<std::function<android::binder::Status()>> queries = {
+                [this]() {
+                    bool result;
+                    return gsid_->isGsiRunning(&result);
+                },
+                [this]() {
+                    bool result;
+                    return gsid_->isGsiInstalled(&result);
+                },
+                [this]() {
+                    bool result;
+                    return gsid_->isGsiEnabled(&result);
+                },
+                [this]() {
+                    bool result;
+                    return gsid_->isGsiInstallInProgress(&result);
+                },
+                [this]() {
+                    std::string result;
+                    return gsid_->getActiveDsuSlot(&result);
+                },
+                [this]() {
+                    std::string result;
+                    return gsid_->getInstalledGsiImageDir(&result);
+                },
+        };
+        std::vector<Clock::duration> latencies;
+        for (size_t i = 0; !done; i++) {
+            auto start = Clock::now();
+            auto status = queries[i % queries.size()]();
+            latencies.emplace_back(Clock::now() - start);
+            EXPECT_TRUE(status.isOk()) << status.exceptionMessage().string();
+            std::this_thread::sleep_for(1ms);
+        }
+        return latencies;
+    }
+
+    sp<IGsiService> gsid_;
+    bool installing_ = false;
+};
+
+TEST_F(QueryLatencyTest, DuringInstall) {
+    int error;
+    ASSERT_TRUE(gsid_->openInstall(kDefaultDsuImageFolder, &error).isOk());
+    ASSERT_EQ(error, IGsiService::INSTALL_OK);
+    installing_ = true;
+    ASSERT_TRUE(gsid_->createPartition(kPartitionName, kPartitionSize, true, &error).isOk());
+    ASSERT_EQ(error, IGsiService::INSTALL_OK);
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    unique_fd read_end(fds[0]);
+    unique_fd write_end(fds[1]);
+
+    std::thread feeder([&]() {
+        std::string data(kWriteSize, 'G');
+        for (int64_t fed = 0; fed < kPartitionSize; fed += data.size()) {
+            if (!android::base::WriteFully(write_end, data.data(), data.size())) {
+                break;
+            }
+            std::this_thread::sleep_for(kWriteInterval);
+        }
+        write_end = {};
+    });
+
+    std::atomic<bool> done = false;
+    bool committed = false;
+    std::thread committer([&]() {
+        ParcelFileDescriptor stream(std::move(read_end));
+        gsid_->commitGsiChunkFromStream(stream, kPartitionSize, &committed);
+        done = true;
+    });
+
+    auto latencies = MeasureQueries(done);
+    committer.join();
+    feeder.join();
+    EXPECT_TRUE(committed);
+
+    ASSERT_FALSE(latencies.empty());
+    std::sort(latencies.begin(), latencies.end());
+    auto p50 = latencies[latencies.size() / 2];
+    auto p99 = latencies[latencies.size() * 99 / 100];
+    auto max = latencies.back();
+    auto to_us = [](Clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    std::cout << latencies.size() << " queries during install: p50 " << to_us(p50) << " us, p99 "
+              << to_us(p99) << " us, max " << to_us(max) << " us" << std::endl;
+    EXPECT_LT(p99, kMaxP99Latency);
+}
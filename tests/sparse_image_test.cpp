@@ -0,0 +1,401 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "partition_writer.h"
+#include "sparse_image.h"
+#include "stream_parser_test.h"
+
+using android::base::TemporaryFile;
+using android::gsi::FeedInPieces;
+using android::gsi::kSplitPieces;
+using android::gsi::MalformedInput;
+using android::gsi::MalformedInputName;
+using android::gsi::PartitionWriter;
+using android::gsi::SparseImageWriter;
+using android::gsi::WriteObserver;
+
+static constexpr uint32_t kBlockSize = 4096;
+
+static constexpr uint16_t kChunkTypeRaw = 0xcac1;
+static constexpr uint16_t kChunkTypeFill = 0xcac2;
+static constexpr uint16_t kChunkTypeDontCare = 0xcac3;
+static constexpr uint16_t kChunkTypeCrc32 = 0xcac4;
+
+static std::string Blocks(uint64_t count, char c) {
+    return std::string(count * kBlockSize, c);
+}
+
+// Builds a sparse image chunk by chunk, in the layout libsparse writes. The
+// header fields can be changed before Build() to produce malformed images.
+class SparseImageBuilder {
+  public:
+    explicit SparseImageBuilder(uint32_t total_blocks) : total_blocks(total_blocks) {}
+
+    void Raw(const std::string& data) {
+        Chunk(kChunkTypeRaw, data.size() / kBlockSize, data.size());
+        image_ += data;
+    }
+    void Fill(uint32_t blocks, uint32_t pattern) {
+        Chunk(kChunkTypeFill, blocks, sizeof(pattern));
+        Append(&image_, pattern);
+    }
+    void DontCare(uint32_t blocks) { Chunk(kChunkTypeDontCare, blocks, 0); }
+    void Crc32(uint32_t crc) {
+        Chunk(kChunkTypeCrc32, 0, sizeof(crc));
+        Append(&image_, crc);
+    }
+
+    // Appends a chunk header, and |data_size| bytes of data after it.
+    void Chunk(uint16_t type, uint32_t blocks, uint32_t data_size) {
+        Append(&image_, type);
+        Append(&image_, uint16_t(0));
+        Append(&image_, blocks);
+        Append(&image_, uint32_t(chunk_hdr_sz + data_size));
+        image_.append(std::max(chunk_hdr_sz, uint16_t(12)) - 12, '\0');
+        chunks++;
+    }
+
+    std::string Build() const {
+        std::string header;
+        Append(&header, magic);
+        Append(&header, major_version);
+        Append(&header, uint16_t(0));
+        Append(&header, file_hdr_sz);
+        Append(&header, chunk_hdr_sz);
+        Append(&header, blk_sz);
+        Append(&header, total_blocks);
+        Append(&header, chunks);
+        Append(&header, uint32_t(0));
+        header.append(std::max(file_hdr_sz, uint16_t(28)) - 28, '\0');
+        return header + image_;
+    }
+
+    uint32_t magic = 0xed26ff3a;
+    uint16_t major_version = 1;
+    uint16_t file_hdr_sz = 28;
+    uint16_t chunk_hdr_sz = 12;
+    uint32_t blk_sz = kBlockSize;
+    uint32_t total_blocks;
+    uint32_t chunks = 0;
+
+  private:
+    template <typename T>
+    static void Append(std::string* out, T value) {
+        out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    std::string image_;
+};
+
+class FillRecorder : public WriteObserver {
+  public:
+    void OnWrite(uint64_t, const char*, size_t) override {}
+    void OnFill(uint64_t offset, uint64_t length, uint32_t pattern) override {
+        fills.emplace_back(Fill{offset, length, pattern});
+    }
+
+    struct Fill {
+        uint64_t offset;
+        uint64_t length;
+        uint32_t pattern;
+    };
+    std::vector<Fill> fills;
+};
+
+class SparseImageTest : public ::testing::Test {
+  protected:
+    static constexpr uint64_t kPartitionSize = 8 * kBlockSize;
+
+    void SetUp() override {
+        // Stale data, as left in a freshly allocated or reused image.
+        std::string stale(kPartitionSize, '\xaa');
+        ASSERT_EQ(lseek(device_.fd, 0, SEEK_SET), 0);
+        ASSERT_TRUE(android::base::WriteFully(device_.fd, stale.data(), stale.size()));
+    }
+
+    // Feeds |image| to a new parser in pieces of |piece| bytes.
+    bool Feed(const std::string& image, size_t piece = SIZE_MAX) {
+        sparse_ = std::make_unique<SparseImageWriter>(&writer_, kPartitionSize, stale_);
+        return FeedInPieces(sparse_.get(), image, piece);
+    }
+
+    std::string ReadBlocks(uint64_t first, uint64_t count) {
+        std::string data(count * kBlockSize, '\0');
+        EXPECT_TRUE(android::base::ReadFullyAtOffset(device_.fd, data.data(), data.size(),
+                                                     first * kBlockSize));
+        return data;
+    }
+
+    // Every chunk type, covering the whole partition:
+    //   0-1 RAW 'a', 2-3 FILL, 4 DONT_CARE, CRC32, 5 RAW 'b', 6-7 DONT_CARE.
+    static std::string AllChunkTypes() {
+        SparseImageBuilder builder(8);
+        builder.Raw(Blocks(2, 'a'));
+        builder.Fill(2, 0x01020304);
+        builder.DontCare(1);
+        builder.Crc32(0x12345678);
+        builder.Raw(Blocks(1, 'b'));
+        builder.DontCare(2);
+        return builder.Build();
+    }
+
+    void ExpectAllChunkTypes(char dont_care) {
+        EXPECT_EQ(ReadBlocks(0, 2), Blocks(2, 'a'));
+        std::string fill = ReadBlocks(2, 2);
+        for (size_t i = 0; i < fill.size(); i += 4) {
+            ASSERT_EQ(fill.substr(i, 4), "\x04\x03\x02\x01") << "at " << i;
+        }
+        EXPECT_EQ(ReadBlocks(4, 1), Blocks(1, dont_care));
+        EXPECT_EQ(ReadBlocks(5, 1), Blocks(1, 'b'));
+        EXPECT_EQ(ReadBlocks(6, 2), Blocks(2, dont_care));
+    }
+
+    TemporaryFile device_;
+    PartitionWriter writer_{device_.fd, device_.path};
+    std::unique_ptr<SparseImageWriter> sparse_;
+    // Whether the device holds a previous image, as when it is reused.
+    bool stale_ = false;
+};
+
+TEST_F(SparseImageTest, IsSparseImage) {
+    std::string image = AllChunkTypes();
+    EXPECT_TRUE(SparseImageWriter::IsSparseImage(image.data(), image.size()));
+    EXPECT_FALSE(SparseImageWriter::IsSparseImage(image.data(), 3));
+    EXPECT_FALSE(SparseImageWriter::IsSparseImage(Blocks(1, 'a').data(), kBlockSize));
+}
+
+TEST_F(SparseImageTest, AllChunkTypes) {
+    ASSERT_TRUE(Feed(AllChunkTypes()));
+    EXPECT_EQ(sparse_->offset(), kPartitionSize);
+    ExpectAllChunkTypes('\xaa');
+}
+
+// Commits can end anywhere, including in the middle of the file header, a
+// chunk header or a fill pattern.
+TEST_F(SparseImageTest, SplitAnywhere) {
+    std::string image = AllChunkTypes();
+    for (size_t piece : kSplitPieces) {
+        SCOPED_TRACE(piece);
+        SetUp();
+        ASSERT_TRUE(Feed(image, piece));
+        EXPECT_EQ(sparse_->offset(), kPartitionSize);
+        ExpectAllChunkTypes('\xaa');
+    }
+}
+
+TEST_F(SparseImageTest, LargerHeaders) {
+    SparseImageBuilder builder(8);
+    builder.file_hdr_sz = 40;
+    builder.chunk_hdr_sz = 16;
+    builder.Raw(Blocks(2, 'a'));
+    builder.Fill(2, 0x01020304);
+    builder.DontCare(1);
+    builder.Crc32(0);
+    builder.Raw(Blocks(1, 'b'));
+    builder.DontCare(2);
+    ASSERT_TRUE(Feed(builder.Build(), 7));
+    EXPECT_EQ(sparse_->offset(), kPartitionSize);
+    ExpectAllChunkTypes('\xaa');
+}
+
+// An image smaller than the partition leaves the rest of it untouched.
+TEST_F(SparseImageTest, SmallerThanPartition) {
+    SparseImageBuilder builder(2);
+    builder.Raw(Blocks(2, 'a'));
+    ASSERT_TRUE(Feed(builder.Build()));
+    EXPECT_EQ(sparse_->offset(), kPartitionSize);
+    EXPECT_EQ(ReadBlocks(0, 2), Blocks(2, 'a'));
+    EXPECT_EQ(ReadBlocks(2, 6), Blocks(6, '\xaa'));
+}
+
+// A stream that ends early is not rejected by Feed, but does not account for
+// the whole partition, so the install is not complete.
+TEST_F(SparseImageTest, TruncatedTail) {
+    std::string image = AllChunkTypes();
+    for (size_t cut : {size_t(1), size_t(4), size_t(12), size_t(kBlockSize + 12)}) {
+        SCOPED_TRACE(cut);
+        ASSERT_TRUE(Feed(image.substr(0, image.size() - cut)));
+        EXPECT_LT(sparse_->offset(), kPartitionSize);
+    }
+}
+
+TEST_F(SparseImageTest, TrailingData) {
+    EXPECT_FALSE(Feed(AllChunkTypes() + "x"));
+}
+
+TEST_F(SparseImageTest, DontCareSkipped) {
+    SparseImageBuilder builder(4);
+    builder.Raw(Blocks(1, 'a'));
+    builder.DontCare(2);
+    builder.Raw(Blocks(1, 'b'));
+    ASSERT_TRUE(Feed(builder.Build()));
+    EXPECT_EQ(ReadBlocks(1, 2), Blocks(2, '\xaa'));
+}
+
+// A verifier hashes DONT_CARE blocks as zeroes, so they must be zeroed on the
+// device and reported as a zero fill rather than read back as stale data.
+TEST_F(SparseImageTest, DontCareZeroedWhenObserved) {
+    FillRecorder observer;
+    writer_.set_write_observer(&observer);
+
+    SparseImageBuilder builder(4);
+    builder.Raw(Blocks(1, 'a'));
+    builder.DontCare(2);
+    builder.Raw(Blocks(1, 'b'));
+    ASSERT_TRUE(Feed(builder.Build()));
+
+    EXPECT_EQ(ReadBlocks(0, 1), Blocks(1, 'a'));
+    EXPECT_EQ(ReadBlocks(1, 2), Blocks(2, '\0'));
+    EXPECT_EQ(ReadBlocks(3, 1), Blocks(1, 'b'));
+
+    ASSERT_EQ(observer.fills.size(), 1u);
+    EXPECT_EQ(observer.fills[0].offset, kBlockSize);
+    EXPECT_EQ(observer.fills[0].length, 2 * kBlockSize);
+    EXPECT_EQ(observer.fills[0].pattern, 0u);
+}
+
+// A reused image still holds the previous install. Whatever the new image
+// leaves out must read back as zeroes, as on a newly allocated image.
+TEST_F(SparseImageTest, StaleImageZeroed) {
+    stale_ = true;
+    SparseImageBuilder builder(6);
+    builder.Raw(Blocks(1, 'a'));
+    builder.DontCare(2);
+    builder.Fill(1, 0);
+    builder.Raw(Blocks(1, 'b'));
+    builder.DontCare(1);
+    ASSERT_TRUE(Feed(builder.Build(), 7));
+    EXPECT_EQ(sparse_->offset(), kPartitionSize);
+
+    EXPECT_EQ(ReadBlocks(0, 1), Blocks(1, 'a'));
+    EXPECT_EQ(ReadBlocks(1, 3), Blocks(3, '\0'));
+    EXPECT_EQ(ReadBlocks(4, 1), Blocks(1, 'b'));
+    // The last DONT_CARE chunk, then the tail past the image.
+    EXPECT_EQ(ReadBlocks(5, 3), Blocks(3, '\0'));
+}
+
+TEST_F(SparseImageTest, StaleImageWithoutChunks) {
+    stale_ = true;
+    ASSERT_TRUE(Feed(SparseImageBuilder(0).Build()));
+    EXPECT_EQ(sparse_->offset(), kPartitionSize);
+    EXPECT_EQ(ReadBlocks(0, 8), Blocks(8, '\0'));
+}
+
+TEST_F(SparseImageTest, AllChunkTypesObserved) {
+    FillRecorder observer;
+    writer_.set_write_observer(&observer);
+    ASSERT_TRUE(Feed(AllChunkTypes(), 5));
+    ExpectAllChunkTypes('\0');
+}
+
+using MalformedImage = MalformedInput<SparseImageBuilder>;
+
+class SparseImageMalformedTest : public SparseImageTest,
+                                 public ::testing::WithParamInterface<MalformedImage> {};
+
+// Each image is rejected, whether it arrives at once or a byte at a time.
+TEST_P(SparseImageMalformedTest, Rejected) {
+    SparseImageBuilder builder(4);
+    GetParam().make(&builder);
+    std::string image = builder.Build();
+    EXPECT_FALSE(Feed(image));
+    EXPECT_FALSE(Feed(image, 1));
+}
+
+static const MalformedImage kMalformedImages[] = {
+        {"BadMagic",
+         [](SparseImageBuilder* b) {
+             b->magic = 0xed26ff3b;
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"BadMajorVersion",
+         [](SparseImageBuilder* b) {
+             b->major_version = 2;
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"FileHeaderTooSmall",
+         [](SparseImageBuilder* b) {
+             b->file_hdr_sz = 24;
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"ChunkHeaderTooSmall",
+         [](SparseImageBuilder* b) {
+             b->chunk_hdr_sz = 8;
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"ZeroBlockSize",
+         [](SparseImageBuilder* b) {
+             b->blk_sz = 0;
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"UnalignedBlockSize",
+         [](SparseImageBuilder* b) {
+             b->blk_sz = kBlockSize + 2;
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"LargerThanPartition",
+         [](SparseImageBuilder* b) {
+             b->total_blocks = 9;
+             b->Raw(Blocks(9, 'a'));
+         }},
+        {"NoChunks", [](SparseImageBuilder*) {}},
+        {"ChunkPastImage",
+         [](SparseImageBuilder* b) {
+             b->Raw(Blocks(2, 'a'));
+             b->DontCare(3);
+         }},
+        {"ChunksShortOfImage", [](SparseImageBuilder* b) { b->Raw(Blocks(3, 'a')); }},
+        {"RawSizeMismatch",
+         [](SparseImageBuilder* b) {
+             b->Chunk(kChunkTypeRaw, 4, 3 * kBlockSize);
+             b->Raw(Blocks(3, 'a'));
+         }},
+        {"FillSizeMismatch",
+         [](SparseImageBuilder* b) {
+             b->Chunk(kChunkTypeFill, 4, 8);
+             b->Raw(std::string(8, '\0'));
+         }},
+        {"DontCareWithData",
+         [](SparseImageBuilder* b) {
+             b->Chunk(kChunkTypeDontCare, 4, 4);
+         }},
+        {"Crc32SizeMismatch",
+         [](SparseImageBuilder* b) {
+             b->Chunk(kChunkTypeCrc32, 0, 8);
+             b->Raw(Blocks(4, 'a'));
+         }},
+        {"TotalSizeBelowHeader",
+         [](SparseImageBuilder* b) {
+             b->Chunk(kChunkTypeDontCare, 4, -4);
+         }},
+        {"UnknownChunkType",
+         [](SparseImageBuilder* b) {
+             b->Chunk(0xcac5, 4, 0);
+         }},
+};
+
+INSTANTIATE_TEST_SUITE_P(SparseImage, SparseImageMalformedTest,
+                         ::testing::ValuesIn(kMalformedImages), MalformedInputName());
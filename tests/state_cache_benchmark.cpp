@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures the libgsi state queries gsid makes on most binder calls, with and
+// without the state cache. The state lives in a temporary directory laid out
+// like DSU_METADATA_PREFIX.
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <benchmark/benchmark.h>
+#include <libgsi/libgsi.h>
+
+#include "libgsi_private.h"
+
+using android::base::TemporaryDir;
+using android::base::WriteStringToFile;
+
+class MetadataDir {
+  public:
+    MetadataDir() {
+        WriteStringToFile("1", path("booted"));
+        WriteStringToFile("ok", path("install_status"));
+        WriteStringToFile("dsu", path("active"));
+        for (const auto& slot : {"dsu", "dsu2"}) {
+            mkdir(path(slot).c_str(), 0700);
+            WriteStringToFile("/data/gsi/dsu/", path(slot) + "/install_dir");
+        }
+    }
+    ~MetadataDir() {
+        android::gsi::DisableStateCache();
+        for (const auto& slot : {"dsu", "dsu2"}) {
+            unlink((path(slot) + "/install_dir").c_str());
+            rmdir(path(slot).c_str());
+        }
+        for (const auto& file : {"booted", "install_status", "active"}) {
+            unlink(path(file).c_str());
+        }
+    }
+
+    std::string path(const std::string& name) const { return dir() + name; }
+    std::string dir() const { return std::string(dir_.path) + "/"; }
+
+  private:
+    TemporaryDir dir_;
+};
+
+// Queries every predicate once, as gsid does for a status call.
+static void QueryState() {
+    std::string active_dsu, install_status;
+    benchmark::DoNotOptimize(android::gsi::IsGsiRunning());
+    benchmark::DoNotOptimize(android::gsi::IsGsiInstalled());
+    benchmark::DoNotOptimize(android::gsi::GetActiveDsu(&active_dsu));
+    benchmark::DoNotOptimize(android::gsi::GetInstallStatus(&install_status));
+    benchmark::DoNotOptimize(android::gsi::GetInstalledDsuSlots());
+}
+
+static void BM_QueryStateUncached(benchmark::State& state) {
+    MetadataDir metadata;
+    if (!android::gsi::EnableStateCache(metadata.dir())) {
+        state.SkipWithError("the state cache is not available");
+        return;
+    }
+    android::gsi::DisableStateCache();
+    for (auto _ : state) {
+        QueryState();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryStateUncached);
+
+// Arg is the number of iterations between writes to the directory, or 0 for
+// none, to include the cost of refilling the cache.
+static void BM_QueryStateCached(benchmark::State& state) {
+    MetadataDir metadata;
+    if (!android::gsi::EnableStateCache(metadata.dir())) {
+        state.SkipWithError("the state cache is not available");
+        return;
+    }
+    int64_t write_interval = state.range(0);
+    int64_t n = 0;
+    for (auto _ : state) {
+        if (write_interval && ++n % write_interval == 0) {
+            state.PauseTiming();
+            WriteStringToFile("ok", metadata.path("install_status"));
+            state.ResumeTiming();
+        }
+        QueryState();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_QueryStateCached)->Arg(0)->Arg(100);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Helpers for testing the parsers that gsid feeds streamed chunks to, such as
+// SparseImageWriter and BlockDiffWriter.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+
+#include <gtest/gtest.h>
+
+namespace android {
+namespace gsi {
+
+// Piece sizes that end commits inside headers, inside data, and right next to
+// a block boundary.
+static constexpr size_t kSplitPieces[] = {1, 3, 7, 13, 31, 4095, 4097};
+
+// Feeds |input| to |parser| in pieces of |piece| bytes, as separate commits
+// would. Stops at the first piece the parser rejects.
+template <typename Parser>
+bool FeedInPieces(Parser* parser, const std::string& input, size_t piece = SIZE_MAX) {
+    for (size_t i = 0; i < input.size(); i += piece) {
+        if (!parser->Feed(&input[i], std::min(piece, input.size() - i))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A named way to build an input that the parser must reject, for tables of
+// parameterized tests.
+template <typename Builder>
+struct MalformedInput {
+    const char* name;
+    void (*make)(Builder* builder);
+};
+
+// Names the parameterized tests of a table of MalformedInput.
+struct MalformedInputName {
+    template <typename Builder>
+    std::string operator()(const ::testing::TestParamInfo<MalformedInput<Builder>>& info) const {
+        return info.param.name;
+    }
+};
+
+}  // namespace gsi
+}  // namespace android
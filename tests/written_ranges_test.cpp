@@ -0,0 +1,185 @@
+//
+// Copyright (C) 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "written_ranges.h"
+
+using android::gsi::WrittenRanges;
+
+using Range = std::pair<uint64_t, uint64_t>;
+
+struct AddCase {
+    const char* name;
+    // Ranges as offset and length, added in this order.
+    std::vector<Range> added;
+    // The resulting extents, as start and end.
+    std::vector<Range> extents;
+};
+
+// Reads the extents back through the public interface: each one is a run
+// that ContiguousFrom() follows to its end, and the gap after it is not
+// written.
+static std::vector<Range> Extents(const WrittenRanges& ranges, uint64_t limit) {
+    std::vector<Range> extents;
+    for (uint64_t offset = 0; offset < limit; offset++) {
+        uint64_t end = ranges.ContiguousFrom(offset);
+        if (end > offset) {
+            extents.emplace_back(offset, end);
+            offset = end;
+        }
+    }
+    return extents;
+}
+
+class WrittenRangesAddTest : public ::testing::TestWithParam<AddCase> {};
+
+TEST_P(WrittenRangesAddTest, Extents) {
+    WrittenRanges ranges;
+    uint64_t bytes = 0;
+    for (const auto& [offset, length] : GetParam().added) {
+        ranges.Add(offset, length);
+    }
+    for (const auto& [start, end] : GetParam().extents) {
+        bytes += end - start;
+    }
+    EXPECT_EQ(Extents(ranges, 100), GetParam().extents);
+    EXPECT_EQ(ranges.bytes(), bytes);
+    EXPECT_EQ(ranges.empty(), GetParam().extents.empty());
+}
+
+INSTANTIATE_TEST_SUITE_P(
+        WrittenRanges, WrittenRangesAddTest,
+        ::testing::Values(
+                AddCase{"Empty", {}, {}},
+                AddCase{"ZeroLength", {{10, 0}}, {}},
+                AddCase{"Single", {{10, 5}}, {{10, 15}}},
+                AddCase{"Disjoint", {{10, 5}, {20, 5}}, {{10, 15}, {20, 25}}},
+                AddCase{"AdjacentAfter", {{10, 5}, {15, 5}}, {{10, 20}}},
+                AddCase{"AdjacentBefore", {{15, 5}, {10, 5}}, {{10, 20}}},
+                AddCase{"OverlapStart", {{10, 10}, {5, 10}}, {{5, 20}}},
+                AddCase{"OverlapEnd", {{10, 10}, {15, 10}}, {{10, 25}}},
+                AddCase{"Contained", {{10, 10}, {12, 3}}, {{10, 20}}},
+                AddCase{"Containing", {{12, 3}, {10, 10}}, {{10, 20}}},
+                AddCase{"Duplicate", {{10, 5}, {10, 5}}, {{10, 15}}},
+                AddCase{"BridgesGap", {{10, 5}, {20, 5}, {15, 5}}, {{10, 25}}},
+                AddCase{"SpansSeveral",
+                        {{10, 2}, {20, 2}, {30, 2}, {40, 2}, {5, 32}},
+                        {{5, 37}, {40, 42}}},
+                AddCase{"OutOfOrder",
+                        {{40, 10}, {0, 10}, {20, 10}, {10, 10}, {30, 10}},
+                        {{0, 50}}},
+                AddCase{"Reversed", {{8, 2}, {6, 2}, {4, 2}, {2, 2}, {0, 2}}, {{0, 10}}}),
+        [](const ::testing::TestParamInfo<AddCase>& info) { return std::string(info.param.name); });
+
+TEST(WrittenRangesTest, ContiguousFrom) {
+    WrittenRanges ranges;
+    ranges.Add(10, 10);
+    ranges.Add(30, 10);
+
+    struct {
+        uint64_t offset;
+        uint64_t expected;
+    } cases[] = {
+            {0, 0},    // before the first extent
+            {10, 20},  // at its start
+            {15, 20},  // inside it
+            {20, 20},  // at its end
+            {25, 25},  // in the gap
+            {30, 40},  // at the next one
+            {40, 40},  // at the end of the last one
+            {50, 50},  // past everything
+    };
+    for (const auto& c : cases) {
+        EXPECT_EQ(ranges.ContiguousFrom(c.offset), c.expected) << "offset " << c.offset;
+    }
+}
+
+TEST(WrittenRangesTest, Overlaps) {
+    WrittenRanges ranges;
+    ranges.Add(10, 10);
+    ranges.Add(30, 10);
+
+    struct {
+        uint64_t offset;
+        uint64_t length;
+        bool expected;
+    } cases[] = {
+            {0, 10, false},   // ends where the first extent starts
+            {0, 11, true},    // reaches its first byte
+            {19, 1, true},    // its last byte
+            {20, 10, false},  // exactly the gap
+            {15, 20, true},   // spans the gap
+            {0, 100, true},   // covers everything
+            {40, 10, false},  // starts where the last one ends
+            {12, 0, false},   // empty, inside an extent
+    };
+    for (const auto& c : cases) {
+        EXPECT_EQ(ranges.Overlaps(c.offset, c.length), c.expected)
+                << "range " << c.offset << "+" << c.length;
+    }
+}
+
+TEST(WrittenRangesTest, TrimBelow) {
+    struct {
+        uint64_t offset;
+        std::vector<Range> extents;
+    } cases[] = {
+            {0, {{10, 20}, {30, 40}}},
+            {10, {{10, 20}, {30, 40}}},
+            {15, {{15, 20}, {30, 40}}},
+            {20, {{30, 40}}},
+            {25, {{30, 40}}},
+            {35, {{35, 40}}},
+            {40, {}},
+            {50, {}},
+    };
+    for (const auto& c : cases) {
+        WrittenRanges ranges;
+        ranges.Add(10, 10);
+        ranges.Add(30, 10);
+        ranges.TrimBelow(c.offset);
+        EXPECT_EQ(Extents(ranges, 100), c.extents) << "offset " << c.offset;
+    }
+}
+
+// How PartitionInstaller tracks chunks committed out of order: the
+// contiguous start grows as gaps are filled, and is trimmed away.
+TEST(WrittenRangesTest, GapFilledOutOfOrder) {
+    WrittenRanges ranges;
+    uint64_t written = 0;
+    for (uint64_t chunk : {1, 3, 2, 0, 5, 4}) {
+        ranges.Add(chunk * 10, 10);
+        written = ranges.ContiguousFrom(written);
+        ranges.TrimBelow(written);
+    }
+    EXPECT_EQ(written, 60u);
+    EXPECT_TRUE(ranges.empty());
+}
+
+TEST(WrittenRangesTest, Clear) {
+    WrittenRanges ranges;
+    ranges.Add(10, 10);
+    ranges.Clear();
+    EXPECT_TRUE(ranges.empty());
+    EXPECT_EQ(ranges.bytes(), 0u);
+    EXPECT_FALSE(ranges.Overlaps(0, 100));
+}
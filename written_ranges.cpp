@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "written_ranges.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace android {
+namespace gsi {
+
+void WrittenRanges::Add(uint64_t offset, uint64_t length) {
+    if (!length) {
+        return;
+    }
+    uint64_t end = offset + length;
+    auto iter = extents_.upper_bound(offset);
+    if (iter != extents_.begin()) {
+        auto prev = std::prev(iter);
+        if (prev->second >= offset) {
+            offset = prev->first;
+            end = std::max(end, prev->second);
+            extents_.erase(prev);
+        }
+    }
+    while (iter != extents_.end() && iter->first <= end) {
+        end = std::max(end, iter->second);
+        iter = extents_.erase(iter);
+    }
+    extents_.emplace(offset, end);
+}
+
+uint64_t WrittenRanges::ContiguousFrom(uint64_t offset) const {
+    auto iter = extents_.upper_bound(offset);
+    if (iter == extents_.begin()) {
+        return offset;
+    }
+    return std::max(offset, std::prev(iter)->second);
+}
+
+bool WrittenRanges::Overlaps(uint64_t offset, uint64_t length) const {
+    if (!length) {
+        return false;
+    }
+    // The last extent starting before the end of the range is the only one
+    // that can reach into it.
+    auto iter = extents_.lower_bound(offset + length);
+    if (iter == extents_.begin()) {
+        return false;
+    }
+    return std::prev(iter)->second > offset;
+}
+
+void WrittenRanges::TrimBelow(uint64_t offset) {
+    while (!extents_.empty() && extents_.begin()->first < offset) {
+        auto node = extents_.extract(extents_.begin());
+        if (node.mapped() > offset) {
+            node.key() = offset;
+            extents_.insert(std::move(node));
+            break;
+        }
+    }
+}
+
+uint64_t WrittenRanges::bytes() const {
+    uint64_t total = 0;
+    for (const auto& [start, end] : extents_) {
+        total += end - start;
+    }
+    return total;
+}
+
+}  // namespace gsi
+}  // namespace android
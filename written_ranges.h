@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <map>
+
+namespace android {
+namespace gsi {
+
+// The byte ranges of a partition that have been written, kept as sorted,
+// disjoint extents. Overlapping and adjacent ranges are merged as they are
+// added, so a partition written in any order collapses back to one extent.
+// Not thread-safe.
+class WrittenRanges final {
+  public:
+    void Add(uint64_t offset, uint64_t length);
+
+    // Returns the end of the written run that |offset| is in or at the end
+    // of, or |offset| if the byte at |offset| was not written.
+    uint64_t ContiguousFrom(uint64_t offset) const;
+
+    // Returns true if any byte in the range was written.
+    bool Overlaps(uint64_t offset, uint64_t length) const;
+
+    // Forget everything below |offset|.
+    void TrimBelow(uint64_t offset);
+
+    void Clear() { extents_.clear(); }
+    bool empty() const { return extents_.empty(); }
+    // Total number of bytes written.
+    uint64_t bytes() const;
+
+  private:
+    // Start offset to end offset.
+    std::map<uint64_t, uint64_t> extents_;
+};
+
+}  // namespace gsi
+}  // namespace android
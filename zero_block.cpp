@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "zero_block.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace android {
+namespace gsi {
+
+// Bytes checked per loop iteration. Four vectors are OR-ed together before
+// testing, which keeps the loop bound by load bandwidth.
+#if defined(__AVX2__)
+static constexpr size_t kStride = 4 * sizeof(__m256i);
+
+static bool IsZeroStride(const char* p) {
+    auto v = reinterpret_cast<const __m256i*>(p);
+    __m256i lo = _mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1));
+    __m256i hi = _mm256_or_si256(_mm256_loadu_si256(v + 2), _mm256_loadu_si256(v + 3));
+    __m256i acc = _mm256_or_si256(lo, hi);
+    return _mm256_testz_si256(acc, acc);
+}
+#elif defined(__SSE2__)
+static constexpr size_t kStride = 4 * sizeof(__m128i);
+
+static bool IsZeroStride(const char* p) {
+    auto v = reinterpret_cast<const __m128i*>(p);
+    __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                               _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+}
+#elif defined(__ARM_NEON)
+static constexpr size_t kStride = 4 * sizeof(uint64x2_t);
+
+static bool IsZeroStride(const char* p) {
+    auto v = reinterpret_cast<const uint64_t*>(p);
+    uint64x2_t acc = vorrq_u64(vorrq_u64(vld1q_u64(v), vld1q_u64(v + 2)),
+                               vorrq_u64(vld1q_u64(v + 4), vld1q_u64(v + 6)));
+    return (vgetq_lane_u64(acc, 0) | vgetq_lane_u64(acc, 1)) == 0;
+}
+#else
+static constexpr size_t kStride = 4 * sizeof(uint64_t);
+
+static bool IsZeroStride(const char* p) {
+    uint64_t v[4];
+    memcpy(v, p, sizeof(v));
+    return (v[0] | v[1] | v[2] | v[3]) == 0;
+}
+#endif
+
+bool IsZeroBlock(const void* data, size_t length) {
+    auto p = reinterpret_cast<const char*>(data);
+    for (; length >= kStride; p += kStride, length -= kStride) {
+        if (!IsZeroStride(p)) {
+            return false;
+        }
+    }
+    for (; length; p++, length--) {
+        if (*p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace gsi
+}  // namespace android